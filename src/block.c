@@ -4,10 +4,61 @@
  * @brief Mesh blocks, code
  */
 
+#include <float.h>
+#include <string.h>
+
 #include "assert.h"
 #include "block.h"
+#include "space.h"
 #include "malloc.h"
 
+/** @brief Largest packed value (see blk_pack()). */
+#define BLK_PACK_MAX		65535
+
+/** @brief Packed values cover the values in a block, extended by this
+ * fraction of their range on each side. Values can then change a little
+ * before they have to be clamped. */
+#define BLK_PACK_MARGIN		0.25
+
+/** @brief Smallest extension of the range of packed values. Used for 
+ * blocks in which all values are equal. */
+#define BLK_PACK_TINY		1e-12
+
+/**
+ * @brief Allocates a zeroed array for a mesh block.
+ *
+ * Arrays come from the arena of the parent grid, which aligns them to a 
+ * cache line and frees them all at once when the mesh is unloaded.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param nmemb Number of elements.
+ * @param size Size of an element in bytes.
+ * @return Pointer to the array or NULL on error.
+ */
+static void *blk_calloc(struct block *blk, size_t nmemb, size_t size)
+{
+	if(blk->sp->arena!=NULL) {
+		return mem_arena_calloc(blk->sp->arena, nmemb, size);
+	} else {
+		return n_calloc(nmemb, size);
+	}
+}
+
+/**
+ * @brief Frees an array allocated with blk_calloc().
+ *
+ * @param blk Pointer to the mesh block.
+ * @param ptr Pointer to the array.
+ */
+static void blk_release(struct block *blk, void *ptr)
+{
+	if(blk->sp->arena!=NULL) {
+		if(!mem_arena_free(blk->sp->arena, ptr)) return;
+	}
+
+	n_free(ptr);
+}
+
 /**
  * @brief Set some default values for the mesh block structure.
  *
@@ -23,6 +74,8 @@
  */
 void blk_init(struct block *blk, struct space *sp, n_v3i pos, n_v3i size)
 {
+	int n;
+
 	assert(blk!=NULL);
 	assert(sp!=NULL);
 
@@ -30,12 +83,33 @@ void blk_init(struct block *blk, struct space *sp, n_v3i pos, n_v3i size)
 	blk->size=size;
 
 	blk->n=NULL;
+	blk->h=NULL;
 	blk->a=NULL;
+	blk->k[0]=NULL;
+	blk->k[1]=NULL;
 	blk->con=NULL;
+	blk->span=NULL;
+	blk->spanrow=NULL;
+
+	blk->link=NULL;
+	blk->linkrow=NULL;
+	blk->linksrc=NULL;
+	blk->linkw=NULL;
+	blk->linknum=0;
+
+	blk->scale=1;
+
+	for(n=0;n<BLK_VEC_NUM;n++) blk->vec[n]=NULL;
 
 	blk->c_n=0.0;
 	blk->c_a=0.0;
 
+	blk->delta=0.0;
+	blk->resid=0.0;
+	blk->dmax=0.0;
+	blk->drift=0.0;
+	blk->quiet=0;
+
 	blk->xnext=NULL;
 	blk->xprev=NULL;
 	blk->ynext=NULL;
@@ -59,7 +133,7 @@ int blk_convert_heterogeneous(struct block *blk)
 	assert(blk->a==NULL);
 
 	memsize=blk->size.x * blk->size.y;
-	blk->a=n_calloc(memsize, sizeof(*blk->a));
+	blk->a=blk_calloc(blk, memsize, sizeof(*blk->a));
 	if(blk->a==NULL) return -1;
 
 	for(n=0;n<memsize;n++) {
@@ -106,7 +180,7 @@ int blk_convert_homogeneous(struct block *blk)
 
 	blk->c_a = a;
 
-	n_free(blk->a);
+	blk_release(blk, blk->a);
 	blk->a = NULL;
 
 	return 1;
@@ -126,24 +200,44 @@ int blk_convert_variable(struct block *blk)
 	assert(blk->n==NULL);
 	assert(blk->con==NULL);
 
-	memsize=blk->size.x * blk->size.y * blk->size.z;
-	blk->n=n_calloc(memsize, sizeof(*blk->n));
+	/* include the halo */
+	memsize=(blk->size.x + 2) * (blk->size.y + 2) * (blk->size.z + 2);
+	blk->n=blk_calloc(blk, memsize, sizeof(*blk->n));
 	if(blk->n==NULL) return -1;
 
-	for(n=0;n<memsize;n++) {
-		blk->n[n]=blk->c_n;
+	/* the array is already zeroed */
+	if(blk->c_n!=0.0) {
+		for(n=0;n<memsize;n++) {
+			blk->n[n]=blk->c_n;
+		}
 	}
 
-	blk->con=n_calloc(memsize, sizeof(*blk->con));
+	blk->con=blk_calloc(blk, (memsize + 7) / 8, sizeof(*blk->con));
 	if(blk->con==NULL) return -1;
 
-	for(n=0;n<memsize;n++) {
-		blk->con[n]=1;
-	}
+	memset(blk->con, 0xff, (memsize + 7) / 8);
 
 	return 0;
 }
 
+/**
+ * @brief Frees runs of variable points of a mesh block.
+ *
+ * @param blk Pointer to the mesh block.
+ */
+static void blk_span_free(struct block *blk)
+{
+	if(blk->span!=NULL) {
+		n_free(blk->span);
+		blk->span=NULL;
+	}
+
+	if(blk->spanrow!=NULL) {
+		n_free(blk->spanrow);
+		blk->spanrow=NULL;
+	}
+}
+
 /**
  * @brief Converts a mesh block from variable to constant.
  *
@@ -158,8 +252,8 @@ int blk_convert_variable(struct block *blk)
  */
 int blk_convert_constant(struct block *blk)
 {
-	size_t memsize, i;
 	n_float n;
+	n_v3i pos;
 
 	assert(blk!=NULL);
 
@@ -170,189 +264,1603 @@ int blk_convert_constant(struct block *blk)
 
 	assert(blk->con!=NULL);
 
-	memsize=blk->size.x * blk->size.y * blk->size.z;
+	/* ghost points are not checked */
 
-	n = blk->n[0];
+	n = BLK_N(blk, v3i(0,0,0));
 
-	for(i=0;i<memsize;i++) {
-		if(blk->con[i] != 1) {
-			/* not all points are constant in this block */
-			return 0;
-		}
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+				if(BLK_CON(blk, pos) != 1) {
+					/* not all points are constant in 
+					 * this block */
+					return 0;
+				}
 
-		if(blk->n[i] != n) {
-			/* not all points have equal values */
-			return 0;
+				if(BLK_N(blk, pos) != n) {
+					/* not all points have equal values */
+					return 0;
+				}
+			}
 		}
 	}
 
 	blk->c_n = n;
 
-	n_free(blk->n);
+	blk_release(blk, blk->n);
 	blk->n = NULL;
 
+	blk_release(blk, blk->con);
+	blk->con = NULL;
+
+	blk_span_free(blk);
+
 	return 1;
 }
 
 /**
- * @brief Frees any memory allocated for arrays in a mesh block 
+ * @brief Converts a mesh block to a coarse block.
+ *
+ * Only every \a scale-th point along the x and y axis is kept, starting
+ * with the first one. Values and constant points of the kept points are
+ * copied, the others are dropped. Ghost points are constant as usual. The
+ * block must be homogeneous and stencil coefficients and runs of variable
+ * points must be built again afterwards (see blk_coef_build() and 
+ * blk_span_build()).
  *
  * @param blk Pointer to the mesh block.
+ * @param scale Distance between the kept points (see struct block).
+ * @param size Number of kept points along each axis.
+ * @return 0 on success and -1 on error.
  */
-void blk_free(struct block *blk) 
+int blk_coarsen(struct block *blk, int scale, n_v3i size)
 {
-	if(blk->a!=NULL) {
-		n_free(blk->a);
-		blk->a=NULL;
-	}
+	struct block old;
+	size_t memsize, off;
+	n_v3i pos, src;
 
-	if(blk->n!=NULL) {
-		n_free(blk->n);
-		blk->n=NULL;
+	assert(blk!=NULL);
+	assert(blk->scale==1);
+	assert(blk->a==NULL);
+	assert(blk->h==NULL);
+	assert(blk->vec[0]==NULL);
+	assert(size.z==blk->size.z);
+	assert((size.x - 1) * scale < blk->size.x);
+	assert((size.y - 1) * scale < blk->size.y);
+
+	old=*blk;
+
+	blk->scale=scale;
+	blk->size=size;
+
+	if(old.n==NULL) return 0;
+
+	blk->n=NULL;
+	blk->con=NULL;
+	blk->span=NULL;
+	blk->spanrow=NULL;
+
+	memsize=(size.x + 2) * (size.y + 2) * (size.z + 2);
+
+	blk->n=blk_calloc(blk, memsize, sizeof(*blk->n));
+	blk->con=blk_calloc(blk, (memsize + 7) / 8, sizeof(*blk->con));
+	if(blk->n==NULL || blk->con==NULL) {
+		if(blk->n!=NULL) blk_release(blk, blk->n);
+		if(blk->con!=NULL) blk_release(blk, blk->con);
+		*blk=old;
+		return -1;
 	}
 
-	if(blk->con!=NULL) {
-		n_free(blk->con);
-		blk->con=NULL;
+	memset(blk->con, 0xff, (memsize + 7) / 8);
+
+	for(pos.z=0;pos.z<size.z;pos.z++) {
+		for(pos.y=0;pos.y<size.y;pos.y++) {
+			for(pos.x=0;pos.x<size.x;pos.x++) {
+				src=v3i(pos.x * scale, pos.y * scale, pos.z);
+
+				off=blk_off3(&old, src);
+
+				blk->n[blk_off3(blk, pos)]=old.n[off];
+				blk_con_set(blk, blk_off3(blk, pos),
+						BLK_CON_OFF(&old, off));
+			}
+		}
 	}
+
+	blk_release(blk, old.n);
+	blk_release(blk, old.con);
+	blk_span_free(&old);
+
+	return 0;
 }
 
 /**
- * @brief Get array index of a mesh point value at position \a pos.
+ * @brief Absolute position of a mesh point.
  *
- * To get value of a mesh point, use:
+ * @param blk Pointer to the mesh block.
+ * @param pos Position of the mesh point in block coordinates.
+ * @return Absolute position.
+ */
+n_v3i blk_abs(struct block *blk, n_v3i pos)
+{
+	pos.x*=blk->scale;
+	pos.y*=blk->scale;
+
+	return v3i_add(blk->pos, pos);
+}
+
+/**
+ * @brief Distance between two neighboring mesh points as a multiple of 
+ * the step of the space along their axis.
  *
- * <code>
- * blk->n[blk_off3(blk, pos)];
- * </code>
+ * Helper function for blk_coef_plane(). This is 1 in a uniform mesh, the
+ * scale of the block between points of a coarse block (see 
+ * blk_coarsen()) and follows the positions of mesh points in a graded 
+ * mesh (see sp_dist()).
  *
- * To determine whether a mesh point is constant use:
+ * @param blk Pointer to the mesh block.
+ * @param a Position of the first point in block coordinates.
+ * @param b Position of the second point in block coordinates.
+ * @return Distance.
+ */
+static n_float blk_dist(struct block *blk, n_v3i a, n_v3i b)
+{
+	struct space *sp;
+	double d;
+
+	sp=blk->sp;
+
+	d=sp_dist(sp, blk_abs(blk, a), blk_abs(blk, b));
+
+	if(a.x!=b.x) return d / sp->step.x;
+	if(a.y!=b.y) return d / sp->step.y;
+	return d / sp->step.z;
+}
+
+/**
+ * @brief Calculates stencil coefficients for one plane of mesh points.
  *
- * <code>
- * blk->con[blk_off3(blk, pos)];
- * </code>
+ * Helper function for blk_coef_build(). If coefficients are equal for all
+ * (non-border) points in the plane they are stored in blk->c_k and no table 
+ * is kept.
  *
  * @param blk Pointer to the mesh block.
- * @param pos Block coordinates of the desired mesh point.
+ * @param p 0 for the plane z = 0 and 1 for planes with z > 0.
+ * @return 0 on success and -1 on error.
  */
-size_t blk_off3(struct block *blk, n_v3i pos) {
-	assert(pos.x >= 0);
-	assert(pos.x < blk->size.x);
+static int blk_coef_plane(struct block *blk, int p)
+{
+	n_float k[BLK_K_NUM];
+	n_float ex1y1z1, ex1y2z1, ex2y1z1, ex2y2z1;
+	n_float ex1y1z2, ex1y2z2, ex2y1z2, ex2y2z2;
+	n_float ax,ay,az;
+	n_float fx1,fx2,fy1,fy2,fz1,fz2;
 
-	assert(pos.y >= 0);
-	assert(pos.y < blk->size.y);
+	struct space *sp;
+
+	n_v3i pos;
+	int c, first, uniform;
+
+	sp=blk->sp;
+
+	for(c=0;c<BLK_K_NUM;c++) blk->c_k[p][c]=0.0;
+
+	if(blk->k[p]!=NULL) {
+		blk_release(blk, blk->k[p]);
+		blk->k[p]=NULL;
+	}
+
+	/* plane z = 0 of the bottom layer is on the border of the space */
+	if(p==0 && blk->zprev==NULL) return 0;
+	if(p==1 && blk->size.z < 2) return 0;
+
+	blk->k[p]=blk_calloc(blk, BLK_K_NUM * blk->size.x * blk->size.y, 
+							sizeof(*blk->k[p]));
+	if(blk->k[p]==NULL) return -1;
+
+	ax=sp->step.z * sp->step.y / 4 / sp->step.x;
+	ay=sp->step.z * sp->step.x / 4 / sp->step.y;
+	az=sp->step.x * sp->step.y / 4 / sp->step.z;
+
+	first=1;
+	uniform=1;
+
+	pos.z=p;
+	for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+		for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+			/* points on the border of the space are always constant
+			 * and have no neighbors on one side. */
+			if(pos.x==0 && blk->xprev==NULL) continue;
+			if(pos.y==0 && blk->yprev==NULL) continue;
+
+			ex1y1z1=blk_a_get(blk, v3i_sub(pos, v3i(1,1,1)));
+			ex1y2z1=blk_a_get(blk, v3i_sub(pos, v3i(1,0,1)));
+			ex2y1z1=blk_a_get(blk, v3i_sub(pos, v3i(0,1,1)));
+			ex2y2z1=blk_a_get(blk, v3i_sub(pos, v3i(0,0,1)));
+
+			ex1y1z2=blk_a_get(blk, v3i_sub(pos, v3i(1,1,0)));
+			ex1y2z2=blk_a_get(blk, v3i_sub(pos, v3i(1,0,0)));
+			ex2y1z2=blk_a_get(blk, v3i_sub(pos, v3i(0,1,0)));
+			ex2y2z2=blk_a_get(blk, v3i_sub(pos, v3i(0,0,0)));
+
+			/* distances to the neighbors. Each of the eight cells
+			 * around the point adds a quarter of its face to the 
+			 * faces between the point and its neighbors. Points 
+			 * with all distances 1 keep the plain sums, so that
+			 * uniform meshes get exactly the same coefficients. */
+
+			fx1=blk_dist(blk, v3i_sub(pos, v3i_x), pos);
+			fx2=blk_dist(blk, pos, v3i_add(pos, v3i_x));
+			fy1=blk_dist(blk, v3i_sub(pos, v3i_y), pos);
+			fy2=blk_dist(blk, pos, v3i_add(pos, v3i_y));
+			fz1=blk_dist(blk, v3i_sub(pos, v3i_z), pos);
+			fz2=blk_dist(blk, pos, v3i_add(pos, v3i_z));
+
+			if(fx1==1 && fx2==1 && fy1==1 && fy2==1 && 
+						fz1==1 && fz2==1) {
+				k[BLK_K_X1]=(ex1y1z1+ex1y1z2+
+						ex1y2z1+ex1y2z2)*ax;
+				k[BLK_K_X2]=(ex2y1z1+ex2y1z2+
+						ex2y2z1+ex2y2z2)*ax;
+
+				k[BLK_K_Y1]=(ex1y1z1+ex1y1z2+
+						ex2y1z1+ex2y1z2)*ay;
+				k[BLK_K_Y2]=(ex1y2z1+ex1y2z2+
+						ex2y2z1+ex2y2z2)*ay;
+
+				k[BLK_K_Z1]=(ex1y1z1+ex1y2z1+
+						ex2y1z1+ex2y2z1)*az;
+				k[BLK_K_Z2]=(ex1y1z2+ex1y2z2+
+						ex2y1z2+ex2y2z2)*az;
+			} else {
+				k[BLK_K_X1]=(ex1y1z1*fy1*fz1+ex1y1z2*fy1*fz2+
+					ex1y2z1*fy2*fz1+ex1y2z2*fy2*fz2)*ax/fx1;
+				k[BLK_K_X2]=(ex2y1z1*fy1*fz1+ex2y1z2*fy1*fz2+
+					ex2y2z1*fy2*fz1+ex2y2z2*fy2*fz2)*ax/fx2;
+
+				k[BLK_K_Y1]=(ex1y1z1*fx1*fz1+ex1y1z2*fx1*fz2+
+					ex2y1z1*fx2*fz1+ex2y1z2*fx2*fz2)*ay/fy1;
+				k[BLK_K_Y2]=(ex1y2z1*fx1*fz1+ex1y2z2*fx1*fz2+
+					ex2y2z1*fx2*fz1+ex2y2z2*fx2*fz2)*ay/fy2;
+
+				k[BLK_K_Z1]=(ex1y1z1*fx1*fy1+ex1y2z1*fx1*fy2+
+					ex2y1z1*fx2*fy1+ex2y2z1*fx2*fy2)*az/fz1;
+				k[BLK_K_Z2]=(ex1y1z2*fx1*fy1+ex1y2z2*fx1*fy2+
+					ex2y1z2*fx2*fy1+ex2y2z2*fx2*fy2)*az/fz2;
+			}
+
+			k[BLK_K_D]=1/(k[BLK_K_X1]+k[BLK_K_X2]+
+					k[BLK_K_Y1]+k[BLK_K_Y2]+
+					k[BLK_K_Z1]+k[BLK_K_Z2]);
 
-	assert(pos.z >= 0);
-	assert(pos.z < blk->size.z);
+			for(c=0;c<BLK_K_NUM;c++) {
+				BLK_K(blk, c, pos)=k[c];
 
-	return ((pos.z * blk->size.y) + pos.y) * blk->size.x + pos.x;
+				if(first) {
+					blk->c_k[p][c]=k[c];
+				} else if(blk->c_k[p][c]!=k[c]) {
+					uniform=0;
+				}
+			}
+
+			first=0;
+		}
+	}
+
+	/* uniform planes use the homogeneous row kernel, which needs
+	 * symmetric weights */
+
+	if(blk->c_k[p][BLK_K_X1]!=blk->c_k[p][BLK_K_X2]) uniform=0;
+	if(blk->c_k[p][BLK_K_Y1]!=blk->c_k[p][BLK_K_Y2]) uniform=0;
+	if(blk->c_k[p][BLK_K_Z1]!=blk->c_k[p][BLK_K_Z2]) uniform=0;
+
+	if(uniform) {
+		blk_release(blk, blk->k[p]);
+		blk->k[p]=NULL;
+	}
+
+	return 0;
 }
 
 /**
- * @brief Get array index of a material property value at position \a pos.
- *
- * To get material property value, use:
+ * @brief Calculates stencil coefficients for a variable mesh block.
  *
- * <code>
- * blk->a[blk_off2(blk, pos)];
- * </code>
+ * This must be called after the materials of this block and all 
+ * neighboring blocks are final. Coefficients are calculated for all points
+ * of the block, including those on the faces, except for the points on the
+ * border of the space (which are always constant).
  *
  * @param blk Pointer to the mesh block.
- * @param pos Block coordinates of the desired mesh point.
+ * @return 0 on success and -1 on error.
  */
-size_t blk_off2(struct block *blk, n_v3i pos) {
-	assert(pos.x >= 0);
-	assert(pos.x < blk->size.x);
+int blk_coef_build(struct block *blk)
+{
+	assert(blk!=NULL);
 
-	assert(pos.y >= 0);
-	assert(pos.y < blk->size.y);
+	if(blk_coef_plane(blk, 0)) return -1;
+	if(blk_coef_plane(blk, 1)) return -1;
 
-	return pos.y * blk->size.x + pos.x;
+	return 0;
 }
 
 /**
- * @brief Given a pointer to a mesh block and position in block coordinates
- * find a block where these block coordinates are valid.
+ * @brief Gets stencil coefficients for a row of mesh points.
  *
- * Example: if pos.x<0, then this function moves the block pointer to the
- * blk->xprev and updates the pos.x accordingly so that pos.x>=0.
+ * After this call, coefficient \a c of the point at x = pos.x + i is
+ * <code>k[c][i * stride]</code>, where \a stride is the return value.
  *
- * @param blk Pointer to a mesh block.
- * @param pos Position in block coordinates.
+ * @param blk Pointer to a variable mesh block.
+ * @param pos Block coordinates of the first point in the row.
+ * @param k Array of BLK_K_NUM pointers that is set to the coefficients.
+ * @return 1 if coefficients are taken from a table and 0 if they are equal
+ * for all points in the row.
  */
-inline static void blk_norm(struct block **blk, n_v3i *pos)
+int blk_coef_row(struct block *blk, n_v3i pos, n_float **k)
 {
-	if((*pos).x < 0) {
-		(*blk)=(*blk)->xprev;
-		assert((*blk)!=NULL);
-		(*pos).x+=(*blk)->size.x;
-	} else if((*pos).x >= (*blk)->size.x) {
-		(*pos).x-=(*blk)->size.x;
-		(*blk)=(*blk)->xnext;
-		assert((*blk)!=NULL);
-	}
+	int p, c;
 
-	if((*pos).y < 0) {
-		(*blk)=(*blk)->yprev;
-		assert((*blk)!=NULL);
-		(*pos).y+=(*blk)->size.y;
-	} else if((*pos).y >= (*blk)->size.y) {
-		(*pos).y-=(*blk)->size.y;
-		(*blk)=(*blk)->ynext;
-		assert((*blk)!=NULL);
-	}
+	p=(pos.z > 0);
 
-	if((*pos).z < 0) {
-		(*blk)=(*blk)->zprev;
-		assert((*blk)!=NULL);
-		(*pos).z+=(*blk)->size.z;
-	} else if((*pos).z >= (*blk)->size.z) {
-		(*pos).z-=(*blk)->size.z;
-		(*blk)=(*blk)->znext;
-		assert((*blk)!=NULL);
+	if(blk->k[p]==NULL) {
+		for(c=0;c<BLK_K_NUM;c++) k[c]=&blk->c_k[p][c];
+		return 0;
+	} else {
+		for(c=0;c<BLK_K_NUM;c++) k[c]=&BLK_K(blk, c, pos);
+		return 1;
 	}
 }
 
 /**
- * @brief Slow way of getting the value of a mesh point.
+ * @brief Finds runs of variable points in all rows of a variable mesh 
+ * block.
  *
- * @sa BLK_N()
+ * Loops over variable points can then skip constant points (for example 
+ * the inside of conductors) a whole run at a time, instead of checking 
+ * each point (see \a span in struct block). This must be called again if
+ * constant points of the block change.
  *
- * @param blk Pointer to a mesh block.
- * @param pos Position of the mesh point (can fall outside of the current 
- * block).
+ * @param blk Pointer to a variable mesh block.
+ * @return 0 on success and -1 on error.
  */
-n_float blk_n_get(struct block *blk, n_v3i pos)
+int blk_span_build(struct block *blk)
 {
-	assert(blk != NULL);
+	size_t off;
+	unsigned int num, row;
+	n_v3i pos;
+	int pass, con, prev;
 
-	blk_norm(&blk, &pos);
+	assert(blk!=NULL);
+	assert(blk->con!=NULL);
 
-	if(blk->n==NULL) {
-		return(blk->c_n);
-	} else {
-		return(BLK_N(blk, pos));
+	blk_span_free(blk);
+
+	blk->spanrow=n_calloc((size_t) blk->size.y * blk->size.z + 1,
+						sizeof(*blk->spanrow));
+	if(blk->spanrow==NULL) return -1;
+
+	/* the first pass counts runs, the second one stores them */
+
+	for(pass=0;pass<2;pass++) {
+		num=0;
+		row=0;
+
+		for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+			for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+				blk->spanrow[row++]=num;
+
+				pos.x=-1;
+				off=blk_off3(blk, pos);
+
+				/* the ghost point before the row is constant,
+				 * and so is the one after it */
+
+				prev=1;
+				for(pos.x=0;pos.x<=blk->size.x;pos.x++) {
+					off++;
+					con=BLK_CON_OFF(blk, off);
+
+					if(con==prev) continue;
+
+					if(blk->span!=NULL) {
+						blk->span[num * 2 + con]=pos.x;
+					}
+					if(con) num++;
+
+					prev=con;
+				}
+			}
+		}
+
+		blk->spanrow[row]=num;
+
+		if(pass==0) {
+			blk->span=n_calloc((size_t) num * 2 + 1, 
+							sizeof(*blk->span));
+			if(blk->span==NULL) return -1;
+		}
 	}
+
+	return 0;
 }
 
 /**
- * @brief Slow way of getting a material property.
+ * @brief Allocates a work array for solvers.
  *
- * @sa BLK_A()
+ * The array has the same layout as the array of mesh point values 
+ * (including the halo) and is initially filled with zeros. 
  *
- * @param blk Pointer to a mesh block.
- * @param pos Position of the mesh point (can fall outside of the current 
- * block).
+ * @param blk Pointer to a variable mesh block.
+ * @param v Index of the work array (0 ... BLK_VEC_NUM-1).
+ * @return 0 on success and -1 on error.
  */
-n_float blk_a_get(struct block *blk, n_v3i pos)
+int blk_vec_alloc(struct block *blk, int v)
 {
-	assert(blk != NULL);
+	size_t memsize;
 
-	blk_norm(&blk, &pos);
+	assert(blk!=NULL);
+	assert(blk->n!=NULL);
+	assert(v>=0 && v<BLK_VEC_NUM);
 
-	if(blk->a==NULL) {
-		return(blk->c_a);
+	if(blk->vec[v]!=NULL) return 0;
+
+	memsize=(blk->size.x + 2) * (blk->size.y + 2) * (blk->size.z + 2);
+	blk->vec[v]=blk_calloc(blk, memsize, sizeof(*blk->vec[v]));
+	if(blk->vec[v]==NULL) return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Index of a mesh point in the packed array of a block.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @param pos Position of the mesh point in block coordinates (ghost
+ * points are not valid).
+ */
+static inline size_t blk_pack_off(struct block *blk, n_v3i pos)
+{
+	assert(pos.x >= 0 && pos.x < blk->size.x);
+	assert(pos.y >= 0 && pos.y < blk->size.y);
+	assert(pos.z >= 0 && pos.z < blk->size.z);
+
+	return ((size_t) pos.z * blk->size.y + pos.y) * blk->size.x + pos.x;
+}
+
+/**
+ * @brief Unpacks one value of a packed block.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @param q Packed value.
+ */
+static inline n_float blk_pack_decode(struct block *blk, unsigned short q)
+{
+	n_float v;
+
+	v=blk->h_base + q * blk->h_step;
+
+	return (q==BLK_PACK_MAX) ? blk->h_top : v;
+}
+
+/**
+ * @brief Value of a mesh point in a packed block.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @param pos Position of the mesh point in block coordinates.
+ */
+static inline n_float blk_pack_get(struct block *blk, n_v3i pos)
+{
+	return blk_pack_decode(blk, blk->h[blk_pack_off(blk, pos)]);
+}
+
+/**
+ * @brief Array of a field in a mesh block.
+ *
+ * Helper function for blk_halo().
+ *
+ * @param blk Pointer to the mesh block.
+ * @param v Field (-1 for mesh point values, otherwise index of the work
+ * array).
+ * @return Pointer to the array or NULL if it is not allocated.
+ */
+static n_float *blk_field(struct block *blk, int v)
+{
+	if(v<0) {
+		return blk->n;
+	} else {
+		return blk->vec[v];
+	}
+}
+
+/**
+ * @brief Copies values from a neighboring block into one face of the halo.
+ *
+ * Helper function for blk_halo(). Ghost points at positions
+ * start + i*du + j*dv (0 <= i < nu, 0 <= j < nv) are updated from points at
+ * the same position plus \a off in the neighboring block.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param nb Pointer to the neighboring block.
+ * @param v Field to copy (-1 for mesh point values, otherwise index of the
+ * work array).
+ * @param start Block coordinates of the first ghost point.
+ * @param off Offset between block coordinates in \a blk and \a nb.
+ * @param du Unit vector along the rows of the face.
+ * @param dv Unit vector along the columns of the face.
+ * @param nu Number of ghost points in a row.
+ * @param nv Number of rows.
+ * @param color Color of the ghost points to update (-1 for all points).
+ * @param lines If set, \a color is the color of z-lines (see 
+ * blk_halo_update_lines()) instead of points.
+ * @return Largest absolute change of a ghost point value.
+ */
+static n_float blk_halo_face(struct block *blk, struct block *nb, int v,
+				n_v3i start, n_v3i off, n_v3i du, n_v3i dv, 
+				int nu, int nv, int color, int lines)
+{
+	n_float *dst, *src;
+	n_float c, d, change;
+	n_v3i pos, dun;
+	int i, j, step, o;
+
+	dst=blk_field(blk, v);
+	src=blk_field(nb, v);
+
+	/* work arrays are zero in constant blocks */
+	c=(v<0) ? nb->c_n : 0.0;
+
+	step=(color<0) ? 1 : 2;
+
+	dun=(color<0) ? du : v3i_add(du, du);
+
+	change=0.0;
+
+	for(j=0;j<nv;j++) {
+		pos=start;
+		start=v3i_add(start, dv);
+
+		i=0;
+		if((color>=0) && (((blk->pos.x + pos.x + blk->pos.y + pos.y + 
+			(lines ? 0 : blk->pos.z + pos.z)) & 1) != color)) {
+			i++;
+			pos=v3i_add(pos, du);
+		}
+
+		for(;i<nu;i+=step) {
+			o=blk_off3(blk, pos);
+
+			if(src!=NULL) {
+				c=src[blk_off3(nb, v3i_add(pos, off))];
+			} else if(v<0 && nb->h!=NULL) {
+				c=blk_pack_get(nb, v3i_add(pos, off));
+			}
+
+			d=(c > dst[o]) ? c - dst[o] : dst[o] - c;
+			if(d>change) change=d;
+
+			dst[o]=c;
+
+			pos=v3i_add(pos, dun);
+		}
+	}
+
+	return change;
+}
+
+/**
+ * @brief Checks whether ghost points towards a neighboring block are 
+ * interpolated.
+ *
+ * Helper function for blk_halo(). Blocks in the same column always have
+ * the same scale (see sp_refine()).
+ *
+ * @param blk Pointer to the mesh block.
+ * @param nb Pointer to the neighboring block along x or y.
+ * @return 1 if the face is refreshed by blk_link_update() instead.
+ */
+static inline int blk_linked(struct block *blk, struct block *nb)
+{
+	return (blk->scale > 1) || (nb->scale > 1);
+}
+
+/**
+ * @brief Refreshes ghost points of a field from neighboring blocks.
+ *
+ * Helper function for blk_halo_update(), blk_halo_update_plane() and
+ * blk_halo_update_vec(). Only ghost points used by the stencil of points in
+ * planes \a z0 to \a z1 (exclusive) are updated.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param v Field to update (-1 for mesh point values, otherwise index of
+ * the work array).
+ * @param color Color of the ghost points to update (-1 for all points).
+ * @param z0 First plane.
+ * @param z1 Plane after the last one.
+ * @param lines If set, \a color is the color of z-lines and ghost points
+ * above and below the block are not updated.
+ * @return Largest absolute change of a ghost point value.
+ */
+static n_float blk_halo(struct block *blk, int v, int color, int z0, int z1,
+								int lines)
+{
+	n_float d, change;
+	n_v3i s;
+
+	assert(blk!=NULL);
+	assert(blk_field(blk, v)!=NULL);
+
+	s=blk->size;
+
+	assert(z0>=0 && z0<z1 && z1<=s.z);
+
+	change=0.0;
+
+	if(blk->xprev!=NULL && !blk_linked(blk, blk->xprev)) {
+		assert(blk->xprev->size.y == s.y);
+		assert(blk->xprev->size.z == s.z);
+
+		d=blk_halo_face(blk, blk->xprev, v, v3i(-1, 0, z0), 
+				v3i(blk->xprev->size.x, 0, 0),
+				v3i_y, v3i_z, s.y, z1 - z0, color, lines);
+		if(d>change) change=d;
+	}
+	if(blk->xnext!=NULL && !blk_linked(blk, blk->xnext)) {
+		assert(blk->xnext->size.y == s.y);
+		assert(blk->xnext->size.z == s.z);
+
+		d=blk_halo_face(blk, blk->xnext, v, v3i(s.x, 0, z0), 
+				v3i(-s.x, 0, 0),
+				v3i_y, v3i_z, s.y, z1 - z0, color, lines);
+		if(d>change) change=d;
+	}
+	if(blk->yprev!=NULL && !blk_linked(blk, blk->yprev)) {
+		assert(blk->yprev->size.x == s.x);
+		assert(blk->yprev->size.z == s.z);
+
+		d=blk_halo_face(blk, blk->yprev, v, v3i(0, -1, z0), 
+				v3i(0, blk->yprev->size.y, 0),
+				v3i_x, v3i_z, s.x, z1 - z0, color, lines);
+		if(d>change) change=d;
+	}
+	if(blk->ynext!=NULL && !blk_linked(blk, blk->ynext)) {
+		assert(blk->ynext->size.x == s.x);
+		assert(blk->ynext->size.z == s.z);
+
+		d=blk_halo_face(blk, blk->ynext, v, v3i(0, s.y, z0), 
+				v3i(0, -s.y, 0),
+				v3i_x, v3i_z, s.x, z1 - z0, color, lines);
+		if(d>change) change=d;
+	}
+	if(blk->zprev!=NULL && z0==0 && !lines) {
+		assert(blk->zprev->size.x == s.x);
+		assert(blk->zprev->size.y == s.y);
+
+		d=blk_halo_face(blk, blk->zprev, v, v3i(0, 0, -1), 
+				v3i(0, 0, blk->zprev->size.z),
+				v3i_x, v3i_y, s.x, s.y, color, 0);
+		if(d>change) change=d;
+	}
+	if(blk->znext!=NULL && z1==s.z && !lines) {
+		assert(blk->znext->size.x == s.x);
+		assert(blk->znext->size.y == s.y);
+
+		d=blk_halo_face(blk, blk->znext, v, v3i(0, 0, s.z), 
+				v3i(0, 0, -s.z),
+				v3i_x, v3i_y, s.x, s.y, color, 0);
+		if(d>change) change=d;
+	}
+
+	return change;
+}
+
+/**
+ * @brief Refreshes ghost points of one color from neighboring blocks.
+ *
+ * Only ghost points on the six faces of the halo are updated. Those on the
+ * edges and corners are never used by the finite difference stencil.
+ *
+ * Ghost points on the border of the space (no neighboring block) are
+ * not changed. They are only read by constant points. Neither are ghost
+ * points that are interpolated (see blk_link_update()).
+ *
+ * Points of \a color in neighboring blocks must not change while this
+ * function runs. During a red-black sweep this means that ghost points of
+ * the color that is not being updated can be refreshed concurrently with
+ * the sweep.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param color Color of the ghost points to update (0 for red, 1 for
+ * black and -1 for all points).
+ * @return Largest absolute change of a ghost point value.
+ */
+n_float blk_halo_update(struct block *blk, int color)
+{
+	return blk_halo(blk, -1, color, 0, blk->size.z, 0);
+}
+
+/**
+ * @brief Refreshes interpolated ghost points.
+ *
+ * Ghost points towards blocks with a different scale (see \a link in 
+ * struct block) are set to the weighted sums of their sources. Sources 
+ * are never ghost points, so this can run for all blocks at the same 
+ * time, but not concurrently with a sweep.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @return Largest absolute change of a ghost point value.
+ */
+n_float blk_link_update(struct block *blk)
+{
+	n_float v, d, change;
+	unsigned int i;
+	int n;
+
+	assert(blk!=NULL);
+	assert(blk->n!=NULL);
+
+	change=0.0;
+
+	for(n=0;n<blk->linknum;n++) {
+		v=0.0;
+		for(i=blk->linkrow[n];i<blk->linkrow[n + 1];i++) {
+			v+=blk->linkw[i] * *blk->linksrc[i];
+		}
+
+		d=(v > blk->n[blk->link[n]]) ? v - blk->n[blk->link[n]] :
+						blk->n[blk->link[n]] - v;
+		if(d>change) change=d;
+
+		blk->n[blk->link[n]]=v;
+	}
+
+	return change;
+}
+
+/**
+ * @brief Frees interpolated ghost points of a mesh block.
+ *
+ * @param blk Pointer to the mesh block.
+ */
+void blk_link_free(struct block *blk)
+{
+	if(blk->link!=NULL) n_free(blk->link);
+	if(blk->linkrow!=NULL) n_free(blk->linkrow);
+	if(blk->linksrc!=NULL) n_free(blk->linksrc);
+	if(blk->linkw!=NULL) n_free(blk->linkw);
+
+	blk->link=NULL;
+	blk->linkrow=NULL;
+	blk->linksrc=NULL;
+	blk->linkw=NULL;
+	blk->linknum=0;
+}
+
+/**
+ * @brief Refreshes ghost points of one color used by one plane of a block.
+ *
+ * Same as blk_halo_update(), except that only ghost points next to the
+ * plane \a z are updated: those in the same plane and, for the first and
+ * last plane of the block, the neighboring plane in the block below or 
+ * above.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param z Block coordinate of the plane.
+ * @param color Color of the ghost points to update (0 for red, 1 for
+ * black and -1 for all points).
+ * @return Largest absolute change of a ghost point value.
+ */
+n_float blk_halo_update_plane(struct block *blk, int z, int color)
+{
+	return blk_halo(blk, -1, color, z, z + 1, 0);
+}
+
+/**
+ * @brief Refreshes ghost points of z-lines of one color.
+ *
+ * For line relaxation, all points on a line along the z axis are updated
+ * together. Lines are colored like a checkerboard: a line at absolute
+ * position (x,y) is red if x+y is even and black otherwise. This updates
+ * ghost points on the four side faces of the halo that belong to lines of
+ * \a color. Ghost points above and below the block are not changed.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param color Color of the lines to update (0 for red, 1 for black).
+ */
+void blk_halo_update_lines(struct block *blk, int color)
+{
+	blk_halo(blk, -1, color, 0, blk->size.z, 1);
+}
+
+/**
+ * @brief Refreshes ghost points of a work array from neighboring blocks.
+ *
+ * Same as blk_halo_update(), except that the work array \a v is updated.
+ * Ghost points in constant neighboring blocks are set to zero.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param v Index of the work array.
+ * @param color Color of the ghost points to update (0 for red, 1 for
+ * black and -1 for all points).
+ */
+void blk_halo_update_vec(struct block *blk, int v, int color)
+{
+	assert(v>=0 && v<BLK_VEC_NUM);
+
+	blk_halo(blk, v, color, 0, blk->size.z, 0);
+}
+
+/**
+ * @brief Applies the finite difference operator to a field.
+ *
+ * For each variable point: dst = s * (ks * src - sum(k * src')), where the 
+ * sum goes over the six neighbors src', k are their stencil coefficients
+ * and ks is the sum of coefficients. Constant points are set to zero.
+ *
+ * With \a src equal to the mesh point values and s = -1 this gives the 
+ * residual of the finite difference equations. Ghost points of \a src must
+ * be up to date (see blk_halo_update()).
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param src Field to apply the operator to (-1 for mesh point values,
+ * otherwise index of the work array).
+ * @param dst Index of the work array for the result. Must differ from
+ * \a src.
+ * @param s Scale factor.
+ */
+void blk_stencil(struct block *blk, int src, int dst, n_float s)
+{
+	n_float *o, *oy1, *oy2, *oz1, *oz2, *r;
+	n_float *k[BLK_K_NUM];
+	n_float ks, sum;
+
+	n_v3i pos;
+	size_t off;
+	int x, i, stride;
+
+	assert(blk!=NULL);
+	assert(blk_field(blk, src)!=NULL);
+	assert(dst>=0 && dst<BLK_VEC_NUM && dst!=src);
+	assert(blk->vec[dst]!=NULL);
+
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			pos.x=0;
+
+			off=blk_off3(blk, pos);
+
+			o=&blk_field(blk, src)[off];
+
+			oy1=o - (blk->size.x + 2);
+			oy2=o + (blk->size.x + 2);
+
+			oz1=o - (blk->size.x + 2) * (blk->size.y + 2);
+			oz2=o + (blk->size.x + 2) * (blk->size.y + 2);
+
+			r=&blk->vec[dst][off];
+
+			stride=blk_coef_row(blk, pos, k);
+
+			for(x=0;x<blk->size.x;x++) {
+				if(BLK_CON_OFF(blk, off + x)) {
+					r[x]=0.0;
+					continue;
+				}
+
+				i=x*stride;
+
+				sum=k[BLK_K_X1][i] * o[x - 1] +
+					k[BLK_K_X2][i] * o[x + 1] +
+					k[BLK_K_Y1][i] * oy1[x] +
+					k[BLK_K_Y2][i] * oy2[x] +
+					k[BLK_K_Z1][i] * oz1[x] +
+					k[BLK_K_Z2][i] * oz2[x];
+
+				ks=k[BLK_K_X1][i] + k[BLK_K_X2][i] +
+					k[BLK_K_Y1][i] + k[BLK_K_Y2][i] +
+					k[BLK_K_Z1][i] + k[BLK_K_Z2][i];
+
+				r[x]=s * (ks * o[x] - sum);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Sets the range of packed values of a block.
+ *
+ * The range is wider than the values in the block, so that they can 
+ * change a bit before they are clamped. Ends of the range that are taken 
+ * by constant points don't move.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param lo Smallest value of a variable point in the block.
+ * @param hi Largest value of a variable point in the block.
+ */
+static void blk_pack_scale(struct block *blk, n_float lo, n_float hi)
+{
+	n_float m;
+
+	m=(hi - lo) * BLK_PACK_MARGIN;
+	if(m < BLK_PACK_TINY) m=BLK_PACK_TINY;
+
+	blk->h_base=(blk->h_clo!=FLT_MAX) ? blk->h_clo : lo - m;
+	blk->h_top=(blk->h_chi!=-FLT_MAX) ? blk->h_chi : hi + m;
+	blk->h_step=(blk->h_top - blk->h_base) / BLK_PACK_MAX;
+
+	blk->h_min=FLT_MAX;
+	blk->h_max=-FLT_MAX;
+	blk->h_clamp=0;
+}
+
+/**
+ * @brief Packs one value.
+ *
+ * Values outside of the range are clamped. Clamping at an end that is 
+ * taken by constant points is expected (over-relaxation can push values 
+ * a bit past them) and doesn't require repacking. The range of packed 
+ * values in the block is updated.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param v Value to pack.
+ * @param inv Inverse of \a h_step of the block.
+ * @return Packed value.
+ */
+static inline unsigned short blk_pack_value(struct block *blk, n_float v,
+								n_float inv)
+{
+	n_float q;
+
+	if(v < blk->h_min) blk->h_min=v;
+	if(v > blk->h_max) blk->h_max=v;
+
+	q=(v - blk->h_base) * inv + 0.5;
+
+	if(q < 0.0) {
+		if(blk->h_clo==FLT_MAX) blk->h_clamp=1;
+		return 0;
+	}
+	if(q >= BLK_PACK_MAX + 1.0) {
+		if(blk->h_chi==-FLT_MAX) blk->h_clamp=1;
+		return BLK_PACK_MAX;
+	}
+
+	return (unsigned short) q;
+}
+
+/**
+ * @brief Packs mesh point values of a variable block into 16 bits.
+ *
+ * Values are rounded to BLK_PACK_MAX + 1 equally spaced levels that cover
+ * the values in the block (see \a h in struct block), which halves the 
+ * memory needed for them. The array of single precision values is freed.
+ *
+ * Values of constant points must not be changed by rounding, so they must
+ * be at the ends of the range: either no variable point is smaller or no 
+ * variable point is larger than a constant point. Only two values of 
+ * constant points are possible in a block. Usually this is true, since 
+ * the potential is largest and smallest on the conductors.
+ *
+ * The range also covers \a lo to \a hi. Values that grow beyond the range
+ * are clamped and lose the change, so the range should not be narrower 
+ * than the values the block will take during the solve. 
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param lo Smallest value expected in the block.
+ * @param hi Largest value expected in the block.
+ * @return 0 on success, 1 if values of constant points can't be packed 
+ * exactly and -1 on error.
+ */
+int blk_pack(struct block *blk, n_float lo, n_float hi)
+{
+	n_float v, vlo, vhi, clo, chi, inv;
+	n_v3i pos;
+	size_t i;
+
+	assert(blk!=NULL);
+	assert(blk->n!=NULL);
+	assert(blk->h==NULL);
+
+	vlo=FLT_MAX;
+	vhi=-FLT_MAX;
+	clo=FLT_MAX;
+	chi=-FLT_MAX;
+
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+				v=BLK_N(blk, pos);
+				if(BLK_CON(blk, pos)) {
+					if(v < clo) clo=v;
+					if(v > chi) chi=v;
+				} else {
+					if(v < vlo) vlo=v;
+					if(v > vhi) vhi=v;
+				}
+			}
+		}
+	}
+
+	if(vlo>vhi) return 1;
+
+	blk->h_clo=(clo <= vlo) ? clo : FLT_MAX;
+	blk->h_chi=(chi >= vhi) ? chi : -FLT_MAX;
+
+	if(blk->h_clo==blk->h_chi) {
+		/* all values are equal, leave room for them to change */
+		if(hi - clo >= clo - lo) {
+			blk->h_chi=-FLT_MAX;
+		} else {
+			blk->h_clo=FLT_MAX;
+		}
+	}
+
+	if(clo!=FLT_MAX) {
+		/* constant points must be at the ends of the range */
+		if(clo!=blk->h_clo && clo!=blk->h_chi) return 1;
+		if(chi!=blk->h_clo && chi!=blk->h_chi) return 1;
+
+		for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+			for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+				for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+					if(!BLK_CON(blk, pos)) continue;
+
+					v=BLK_N(blk, pos);
+					if(v!=clo && v!=chi) return 1;
+				}
+			}
+		}
+	}
+
+	blk->h=blk_calloc(blk, 
+			(size_t) blk->size.x * blk->size.y * blk->size.z,
+							sizeof(*blk->h));
+	if(blk->h==NULL) return -1;
+
+	if(vlo < lo) lo=vlo;
+	if(vhi > hi) hi=vhi;
+
+	blk_pack_scale(blk, lo, hi);
+	inv=1.0 / blk->h_step;
+
+	i=0;
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+				blk->h[i++]=blk_pack_value(blk, 
+						BLK_N(blk, pos), inv);
+			}
+		}
+	}
+
+	blk->h_min=FLT_MAX;
+	blk->h_max=-FLT_MAX;
+
+	blk_release(blk, blk->n);
+	blk->n=NULL;
+
+	return 0;
+}
+
+/**
+ * @brief Converts a packed block back to single precision values.
+ *
+ * Ghost points are set to zero and must be refreshed before they are used.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @return 0 on success and -1 on error.
+ */
+int blk_unpack(struct block *blk)
+{
+	size_t memsize;
+	n_v3i pos;
+
+	assert(blk!=NULL);
+	assert(blk->h!=NULL);
+
+	memsize=(blk->size.x + 2) * (blk->size.y + 2) * (blk->size.z + 2);
+	blk->n=blk_calloc(blk, memsize, sizeof(*blk->n));
+	if(blk->n==NULL) return -1;
+
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+				BLK_N(blk, pos)=blk_pack_get(blk, pos);
+			}
+		}
+	}
+
+	blk_release(blk, blk->h);
+	blk->h=NULL;
+
+	return 0;
+}
+
+/**
+ * @brief Value of a mesh point in a neighboring block.
+ *
+ * Helper function for blk_unpack_plane().
+ *
+ * @param nb Pointer to the neighboring block or NULL on the border of the
+ * space.
+ * @param pos Position of the mesh point in block coordinates of \a nb.
+ * @return Value of the mesh point. Zero on the border of the space.
+ */
+static n_float blk_pack_neighbor(struct block *nb, n_v3i pos)
+{
+	if(nb==NULL) {
+		return 0.0;
+	} else if(nb->h!=NULL) {
+		return blk_pack_get(nb, pos);
+	} else if(nb->n!=NULL) {
+		return BLK_N(nb, pos);
+	} else {
+		return nb->c_n;
+	}
+}
+
+/**
+ * @brief Unpacks one plane of a packed block.
+ *
+ * The plane is stored in a work array with the layout of one plane of 
+ * \a n, including ghost points, so that the SOR row kernels can be used
+ * on it. Ghost points of \a color are copied from neighboring blocks, 
+ * whether they are packed or not. For the planes below (z = -1) and above
+ * (z = size.z) the block, points of \a color are copied from the block
+ * below or above.
+ *
+ * Only points of \a color are read from neighboring blocks, so this is
+ * safe while they update points of the other color.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @param w Work array, (size.x + 2) * (size.y + 2) values.
+ * @param z Block coordinate of the plane, from -1 to size.z.
+ * @param color Color of ghost points to copy (0 for red, 1 for black).
+ */
+void blk_unpack_plane(struct block *blk, n_float *w, int z, int color)
+{
+	struct block *nb;
+	unsigned short *h;
+	n_float *o, *n, c;
+	n_v3i pos, off;
+	size_t row;
+	int x0;
+
+	assert(blk!=NULL);
+	assert(blk->h!=NULL);
+	assert(z>=-1 && z<=blk->size.z);
+
+	row=blk->size.x + 2;
+
+	pos.z=z;
+
+	if(z<0 || z>=blk->size.z) {
+		nb=(z<0) ? blk->zprev : blk->znext;
+
+		off=v3i_o;
+		if(nb!=NULL) {
+			off.z=(z<0) ? nb->size.z : -blk->size.z;
+		}
+
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			x0=(blk->pos.x + blk->pos.y + pos.y + 
+						blk->pos.z + z + color) & 1;
+
+			pos.x=0;
+			o=&w[(pos.y + 1) * row + 1];
+
+			if(nb!=NULL && nb->h!=NULL) {
+				h=&nb->h[blk_pack_off(nb, v3i_add(pos, off))];
+				for(pos.x=x0;pos.x<blk->size.x;pos.x+=2) {
+					o[pos.x]=blk_pack_decode(nb, h[pos.x]);
+				}
+			} else if(nb!=NULL && nb->n!=NULL) {
+				n=&BLK_N(nb, v3i_add(pos, off));
+				for(pos.x=x0;pos.x<blk->size.x;pos.x+=2) {
+					o[pos.x]=n[pos.x];
+				}
+			} else {
+				c=(nb!=NULL) ? nb->c_n : 0.0;
+				for(pos.x=x0;pos.x<blk->size.x;pos.x+=2) {
+					o[pos.x]=c;
+				}
+			}
+		}
+
+		return;
+	}
+
+	for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+		pos.x=0;
+		h=&blk->h[blk_pack_off(blk, pos)];
+		o=&w[(pos.y + 1) * row + 1];
+
+		for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+			o[pos.x]=blk_pack_decode(blk, h[pos.x]);
+		}
+	}
+
+	/* ghost points on the four sides */
+
+	for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+		if(((blk->pos.x - 1 + blk->pos.y + pos.y + blk->pos.z + z) & 1)
+								== color) {
+			nb=blk->xprev;
+			pos.x=(nb!=NULL) ? nb->size.x - 1 : 0;
+			w[(pos.y + 1) * row]=blk_pack_neighbor(nb, pos);
+		}
+		if(((blk->pos.x + blk->size.x + blk->pos.y + pos.y + 
+					blk->pos.z + z) & 1) == color) {
+			nb=blk->xnext;
+			pos.x=0;
+			w[(pos.y + 1) * row + blk->size.x + 1]=
+					blk_pack_neighbor(nb, pos);
+		}
+	}
+
+	for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+		if(((blk->pos.x + pos.x + blk->pos.y - 1 + blk->pos.z + z) & 1)
+								== color) {
+			nb=blk->yprev;
+			pos.y=(nb!=NULL) ? nb->size.y - 1 : 0;
+			w[pos.x + 1]=blk_pack_neighbor(nb, pos);
+		}
+		if(((blk->pos.x + pos.x + blk->pos.y + blk->size.y + 
+					blk->pos.z + z) & 1) == color) {
+			nb=blk->ynext;
+			pos.y=0;
+			w[(blk->size.y + 1) * row + pos.x + 1]=
+					blk_pack_neighbor(nb, pos);
+		}
+	}
+}
+
+/**
+ * @brief Packs points of one color in one plane of a block from a work 
+ * array.
+ *
+ * Counterpart of blk_unpack_plane(). Constant points are not changed.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @param w Work array with the layout of one plane of \a n.
+ * @param z Block coordinate of the plane.
+ * @param color Color of the points to pack (0 for red, 1 for black).
+ */
+void blk_pack_plane(struct block *blk, n_float *w, int z, int color)
+{
+	unsigned short *h, *span;
+	n_float *o, inv;
+	n_v3i pos;
+	size_t row;
+	unsigned int r, r1;
+	int x, x0;
+
+	assert(blk!=NULL);
+	assert(blk->h!=NULL);
+	assert(blk->span!=NULL);
+	assert(z>=0 && z<blk->size.z);
+
+	row=blk->size.x + 2;
+	inv=1.0 / blk->h_step;
+
+	pos.z=z;
+	for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+		pos.x=0;
+		h=&blk->h[blk_pack_off(blk, pos)];
+		o=&w[(pos.y + 1) * row + 1];
+
+		x0=(blk->pos.x + blk->pos.y + pos.y + blk->pos.z + z + 
+								color) & 1;
+
+		r1=blk->spanrow[z * blk->size.y + pos.y + 1];
+		for(r=blk->spanrow[z * blk->size.y + pos.y];r<r1;r++) {
+			span=&blk->span[r * 2];
+
+			x=span[0] + ((span[0] ^ x0) & 1);
+			for(;x<span[1];x+=2) {
+				h[x]=blk_pack_value(blk, o[x], inv);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Adjusts the range of packed values to the values in a block.
+ *
+ * Must be called after each sweep over a packed block, when all its 
+ * points were packed again with blk_pack_plane(). Values are repacked if
+ * one of them was clamped or if the range is more than four times wider 
+ * than necessary. Otherwise rounding would limit the accuracy more than
+ * needed. Repacking itself also rounds values, so it is not done more 
+ * often.
+ *
+ * @param blk Pointer to a packed mesh block.
+ * @return 1 if values were repacked and 0 otherwise.
+ */
+int blk_pack_rescale(struct block *blk)
+{
+	n_float base, step, top, inv, lo, hi, m, v;
+	size_t i, size;
+
+	assert(blk!=NULL);
+	assert(blk->h!=NULL);
+
+	lo=blk->h_min;
+	hi=blk->h_max;
+
+	if(lo>hi) return 0;
+
+	m=(hi - lo) * BLK_PACK_MARGIN;
+	if(m < BLK_PACK_TINY) m=BLK_PACK_TINY;
+
+	if(blk->h_clo!=FLT_MAX) lo=blk->h_clo + m;
+	if(blk->h_chi!=-FLT_MAX) hi=blk->h_chi - m;
+
+	if(!blk->h_clamp && 4 * (hi - lo + 2 * m) > 
+					blk->h_top - blk->h_base) {
+		blk->h_min=FLT_MAX;
+		blk->h_max=-FLT_MAX;
+		return 0;
+	}
+
+	base=blk->h_base;
+	step=blk->h_step;
+	top=blk->h_top;
+
+	blk_pack_scale(blk, blk->h_min, blk->h_max);
+	inv=1.0 / blk->h_step;
+
+	size=(size_t) blk->size.x * blk->size.y * blk->size.z;
+	for(i=0;i<size;i++) {
+		if(blk->h[i]==BLK_PACK_MAX) {
+			v=top;
+		} else {
+			v=base + blk->h[i] * step;
+		}
+		blk->h[i]=blk_pack_value(blk, v, inv);
+	}
+
+	blk->h_min=FLT_MAX;
+	blk->h_max=-FLT_MAX;
+	blk->h_clamp=0;
+
+	return 1;
+}
+
+/**
+ * @brief Frees any memory allocated for arrays in a mesh block 
+ *
+ * @param blk Pointer to the mesh block.
+ */
+void blk_free(struct block *blk) 
+{
+	int n;
+
+	if(blk->a!=NULL) {
+		blk_release(blk, blk->a);
+		blk->a=NULL;
+	}
+
+	if(blk->n!=NULL) {
+		blk_release(blk, blk->n);
+		blk->n=NULL;
+	}
+
+	if(blk->h!=NULL) {
+		blk_release(blk, blk->h);
+		blk->h=NULL;
+	}
+
+	if(blk->con!=NULL) {
+		blk_release(blk, blk->con);
+		blk->con=NULL;
+	}
+
+	blk_span_free(blk);
+	blk_link_free(blk);
+
+	for(n=0;n<2;n++) {
+		if(blk->k[n]!=NULL) {
+			blk_release(blk, blk->k[n]);
+			blk->k[n]=NULL;
+		}
+	}
+
+	for(n=0;n<BLK_VEC_NUM;n++) {
+		if(blk->vec[n]!=NULL) {
+			blk_release(blk, blk->vec[n]);
+			blk->vec[n]=NULL;
+		}
+	}
+}
+
+/**
+ * @brief Get array index of a mesh point value at position \a pos.
+ *
+ * To get value of a mesh point, use:
+ *
+ * <code>
+ * blk->n[blk_off3(blk, pos)];
+ * </code>
+ *
+ * To determine whether a mesh point is constant use:
+ *
+ * <code>
+ * BLK_CON_OFF(blk, blk_off3(blk, pos));
+ * </code>
+ *
+ * Positions of ghost points in the halo (see struct block) are also valid.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param pos Block coordinates of the desired mesh point.
+ */
+size_t blk_off3(struct block *blk, n_v3i pos) {
+	assert(pos.x >= -1);
+	assert(pos.x <= blk->size.x);
+
+	assert(pos.y >= -1);
+	assert(pos.y <= blk->size.y);
+
+	assert(pos.z >= -1);
+	assert(pos.z <= blk->size.z);
+
+	return (((pos.z + 1) * (blk->size.y + 2)) + pos.y + 1) * 
+					(blk->size.x + 2) + pos.x + 1;
+}
+
+/**
+ * @brief Get array index of a material property value at position \a pos.
+ *
+ * To get material property value, use:
+ *
+ * <code>
+ * blk->a[blk_off2(blk, pos)];
+ * </code>
+ *
+ * @param blk Pointer to the mesh block.
+ * @param pos Block coordinates of the desired mesh point.
+ */
+size_t blk_off2(struct block *blk, n_v3i pos) {
+	assert(pos.x >= 0);
+	assert(pos.x < blk->size.x);
+
+	assert(pos.y >= 0);
+	assert(pos.y < blk->size.y);
+
+	return pos.y * blk->size.x + pos.x;
+}
+
+/**
+ * @brief Given a pointer to a mesh block and position in block coordinates
+ * find a block where these block coordinates are valid.
+ *
+ * Example: if pos.x<0, then this function moves the block pointer to the
+ * blk->xprev and updates the pos.x accordingly so that pos.x>=0.
+ *
+ * @param blk Pointer to a mesh block.
+ * @param pos Position in block coordinates.
+ */
+inline static void blk_norm(struct block **blk, n_v3i *pos)
+{
+	struct block *nb;
+
+	nb=*blk;
+
+	if((*pos).x < 0) {
+		nb=nb->xprev;
+	} else if((*pos).x >= (*blk)->size.x) {
+		nb=nb->xnext;
+	}
+	assert(nb!=NULL);
+
+	if((*pos).y < 0) {
+		nb=nb->yprev;
+	} else if((*pos).y >= (*blk)->size.y) {
+		nb=nb->ynext;
+	}
+	assert(nb!=NULL);
+
+	if(nb!=*blk) {
+		/* neighbors can have a different scale (see blk_coarsen()), 
+		 * so move through absolute coordinates. Positions between 
+		 * the points of a coarse block round down. */
+		*pos=v3i_sub(blk_abs(*blk, *pos), nb->pos);
+		(*pos).x/=nb->scale;
+		(*pos).y/=nb->scale;
+		(*blk)=nb;
+	}
+
+	if((*pos).z < 0) {
+		(*blk)=(*blk)->zprev;
+		assert((*blk)!=NULL);
+		(*pos).z+=(*blk)->size.z;
+	} else if((*pos).z >= (*blk)->size.z) {
+		(*pos).z-=(*blk)->size.z;
+		(*blk)=(*blk)->znext;
+		assert((*blk)!=NULL);
+	}
+}
+
+/**
+ * @brief Slow way of getting the value of a mesh point.
+ *
+ * @sa BLK_N()
+ *
+ * @param blk Pointer to a mesh block.
+ * @param pos Position of the mesh point (can fall outside of the current 
+ * block).
+ */
+n_float blk_n_get(struct block *blk, n_v3i pos)
+{
+	assert(blk != NULL);
+
+	blk_norm(&blk, &pos);
+
+	if(blk->n==NULL) {
+		return(blk->c_n);
+	} else {
+		return(BLK_N(blk, pos));
+	}
+}
+
+/**
+ * @brief Slow way of getting a material property.
+ *
+ * @sa BLK_A()
+ *
+ * @param blk Pointer to a mesh block.
+ * @param pos Position of the mesh point (can fall outside of the current 
+ * block).
+ */
+n_float blk_a_get(struct block *blk, n_v3i pos)
+{
+	assert(blk != NULL);
+
+	blk_norm(&blk, &pos);
+
+	if(blk->a==NULL) {
+		return(blk->c_a);
 	} else {
 		return(BLK_A(blk, pos));
 	}
 }
+
+/**
+ * @brief Slow way to check if a mesh point is constant.
+ *
+ * @sa BLK_CON_OFF()
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param pos Position of the mesh point in valid block coordinates.
+ * @return 1 if the mesh point is constant and 0 otherwise.
+ */
+int blk_con_get(struct block *blk, n_v3i pos)
+{
+	size_t off;
+
+	assert(blk != NULL);
+	assert(blk->con != NULL);
+
+	off=blk_off3(blk, pos);
+
+	return BLK_CON_OFF(blk, off);
+}
+
+/**
+ * @brief Marks a mesh point as constant or variable.
+ *
+ * Runs of variable points (see blk_span_build()) are not updated.
+ *
+ * @param blk Pointer to a variable mesh block.
+ * @param off Array index of the mesh point (see blk_off3()).
+ * @param con 1 for a constant and 0 for a variable mesh point.
+ */
+void blk_con_set(struct block *blk, size_t off, int con)
+{
+	assert(blk != NULL);
+	assert(blk->con != NULL);
+
+	if(con) {
+		blk->con[off >> 3]|=1 << (off & 7);
+	} else {
+		blk->con[off >> 3]&=~(1 << (off & 7));
+	}
+}
@@ -22,10 +22,32 @@
 /**
  * @brief Fast way to check if a mesh point is constant.
  *
+ * @sa blk_con_get()
+ *
+ * @param _blk_ Pointer to a mesh block.
+ * @param _pos_ Position of the mesh point in valid block coordinates.
+ */
+#define BLK_CON(_blk_, _pos_)	blk_con_get((_blk_), (_pos_))
+
+/**
+ * @brief Fast way to check if a mesh point is constant, by its array index.
+ *
+ * \a _off_ is evaluated twice.
+ *
+ * @param _blk_ Pointer to a variable mesh block.
+ * @param _off_ Array index of the mesh point (see blk_off3()).
+ */
+#define BLK_CON_OFF(_blk_, _off_)	\
+		(((_blk_)->con[(_off_) >> 3] >> ((_off_) & 7)) & 1)
+
+/**
+ * @brief Fast way of getting or setting a value in a work array.
+ *
  * @param _blk_ Pointer to a mesh block.
+ * @param _v_ Index of the work array (see blk_vec_alloc()).
  * @param _pos_ Position of the mesh point in valid block coordinates.
  */
-#define BLK_CON(_blk_, _pos_)	((_blk_)->con[blk_off3((_blk_), (_pos_))])
+#define BLK_V(_blk_, _v_, _pos_) ((_blk_)->vec[(_v_)][blk_off3((_blk_), (_pos_))])
 
 /**
  * @brief Fast way to get material property.
@@ -37,8 +59,22 @@
  */
 #define BLK_A(_blk_, _pos_)	((_blk_)->a[blk_off2((_blk_), (_pos_))])
 
+/**
+ * @brief Fast way to get a stencil coefficient.
+ *
+ * The table for the plane of the mesh point must be allocated.
+ *
+ * @param _blk_ Pointer to the mesh block.
+ * @param _c_ Coefficient (one of BLK_K_X1 ... BLK_K_D)
+ * @param _pos_ Position in valid block coordinates.
+ */
+#define BLK_K(_blk_, _c_, _pos_)	((_blk_)->k[(_pos_).z > 0][(_c_) * \
+		(_blk_)->size.x * (_blk_)->size.y + blk_off2((_blk_), (_pos_))])
+
 n_float blk_n_get(struct block *blk, n_v3i pos);
 n_float blk_a_get(struct block *blk, n_v3i pos);
+int blk_con_get(struct block *blk, n_v3i pos);
+void blk_con_set(struct block *blk, size_t off, int con);
 
 size_t blk_off3(struct block *blk, n_v3i pos);
 size_t blk_off2(struct block *blk, n_v3i pos);
@@ -49,6 +85,24 @@ int blk_convert_heterogeneous(struct block *blk);
 int blk_convert_homogeneous(struct block *blk);
 
 int blk_convert_variable(struct block *blk);
+int blk_coarsen(struct block *blk, int scale, n_v3i size);
+n_v3i blk_abs(struct block *blk, n_v3i pos);
+int blk_coef_build(struct block *blk);
+int blk_span_build(struct block *blk);
+n_float blk_halo_update(struct block *blk, int color);
+n_float blk_halo_update_plane(struct block *blk, int z, int color);
+void blk_halo_update_lines(struct block *blk, int color);
+void blk_halo_update_vec(struct block *blk, int v, int color);
+n_float blk_link_update(struct block *blk);
+void blk_link_free(struct block *blk);
+int blk_coef_row(struct block *blk, n_v3i pos, n_float **k);
+void blk_stencil(struct block *blk, int src, int dst, n_float s);
+int blk_vec_alloc(struct block *blk, int v);
+int blk_pack(struct block *blk, n_float lo, n_float hi);
+int blk_unpack(struct block *blk);
+void blk_unpack_plane(struct block *blk, n_float *w, int z, int color);
+void blk_pack_plane(struct block *blk, n_float *w, int z, int color);
+int blk_pack_rescale(struct block *blk);
 int blk_convert_constant(struct block *blk);
 
 void blk_free(struct block *blk);
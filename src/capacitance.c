@@ -9,6 +9,8 @@
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "assert.h"
 #include "lists.h"
@@ -19,14 +21,25 @@
 #include "sor.h"
 #include "space.h"
 #include "malloc.h"
+#include "pool.h"
+#include "multigrid.h"
+#include "pcg.h"
+#include "mrhs.h"
+#include "capacitance.h"
 
 struct result {
 	n_float c;
 	struct net *net1, *net2;
 };
 
-static struct result **results;
-static n_int resultnum;
+/** @brief Capacitances between all pairs of nets. */
+struct result_table {
+	/** @brief Row n holds the results of the solve with net n connected
+	 * to 1 V, one for each net. Nets are counted in net_list order. */
+	struct result **r;
+	/** @brief Number of nets (rows and columns). */
+	n_int num;
+};
 
 int a_standoff=50;
 int a_iterations=100;
@@ -36,11 +49,89 @@ n_float a_maxerror=0.10;
 int a_restore=0;
 int a_interrupt=0;
 
+int a_threads=1;
+
+/** @brief Number of nets that are evaluated at the same time. */
+int a_nets=1;
+/** @brief Memory budget for nets evaluated at the same time in MB (0 for
+ * no limit). */
+int a_memory=0;
+/** @brief Start SOR from the potentials of nets evaluated before. */
+int a_warmstart=0;
+
+enum solver_type a_solver=solver_sor;
+
+enum pcg_precond a_precond=pcg_ssor;
+
+/** @brief SOR starts checking the capacitances when the relative residual
+ * norm drops below this fraction of the maximum relative error. The 
+ * residual doesn't bound the error of the capacitances, it only tells 
+ * when checking them starts to make sense (see cap_error_estimate()). */
+#define CAP_RESIDUAL_FACTOR	0.5
+
+/** @brief A solve is stopped as diverging when the relative change of the
+ * capacitances doesn't decrease for this many checks in a row. */
+#define CAP_DIVERGE_CHECKS	5
+
+/** @brief Values per mesh point that are always allocated (potential and
+ * permittivity). Used to estimate the memory needed for a net. */
+#define CAP_POINT_VALUES	2.0
+
+/** @brief Potential of an evaluated net, kept for warm starts. */
+struct cap_field {
+	/** @brief Absolute position of the mesh. */
+	n_v3i pos;
+
+	/** @brief Size of the mesh. */
+	n_v3i size;
+
+	/** @brief Values of all mesh points, x index running fastest. */
+	n_float *u;
+};
+
+/** @brief Potentials of all nets evaluated so far (see cap_warm_apply()). */
+struct cap_warm {
+	struct cap_field *field;
+	int num;
+};
+
+/** @brief A net waiting to be evaluated by cap_schedule(). */
+struct cap_job {
+	struct net *net;
+
+	/** @brief Results of the net (row of the result table). */
+	struct result *r;
+
+	/** @brief Estimated memory for the mesh in bytes. */
+	double mem;
+};
+
+/** @brief Nets evaluated at the same time by cap_schedule(). */
+struct cap_sched {
+	/** @brief Jobs, largest first. */
+	struct cap_job *job;
+	int jobnum;
+
+	/** @brief Memory budget in bytes (0 for no limit). */
+	double budget;
+
+	/** @brief Estimated memory of the meshes that are being evaluated. */
+	double used;
+
+	/** @brief Number of nets that are being evaluated. */
+	int running;
+
+	pthread_mutex_t lock;
+
+	/** @brief Signalled when a net is finished. */
+	pthread_cond_t freed;
+};
+
 /**
  * @todo move result handling logic to a separate module: this isn't specific
  * to capacitance calculation.
  */
-static int cap_save_results(char *filename)
+static int cap_save_results(struct result_table *t, char *filename)
 {
 	FILE *f;
 
@@ -52,20 +143,20 @@ static int cap_save_results(char *filename)
 		return -1;
 	}
 
-	for(n=0;n<resultnum;n++) {
-		for(m=0;m<resultnum;m++) {
-			fprintf(f, "%e ", results[n][m].c);
+	for(n=0;n<t->num;n++) {
+		for(m=0;m<t->num;m++) {
+			fprintf(f, "%e ", t->r[n][m].c);
 
-			if(results[n][m].net1==NULL) {
+			if(t->r[n][m].net1==NULL) {
 				fprintf(f, " _NULL_");
 			} else {
-				fprintf(f, " %s", results[n][m].net1->name);
+				fprintf(f, " %s", t->r[n][m].net1->name);
 			}
 
-			if(results[n][m].net2==NULL) {
+			if(t->r[n][m].net2==NULL) {
 				fprintf(f, " _NULL_\n");
 			} else {
-				fprintf(f, " %s\n", results[n][m].net2->name);
+				fprintf(f, " %s\n", t->r[n][m].net2->name);
 			}
 		}
 	}
@@ -75,7 +166,7 @@ static int cap_save_results(char *filename)
 	return 0;
 }
 
-static int cap_load_results(char *filename)
+static int cap_load_results(struct result_table *t, char *filename)
 {
 	FILE *f;
 	char netname1[1024], netname2[1024];
@@ -88,21 +179,21 @@ static int cap_load_results(char *filename)
 		return -1;
 	}
 
-	for(n=0;n<resultnum;n++) {
-		for(m=0;m<resultnum;m++) {
-			fscanf(f, "%e %s %s", &results[n][m].c, 
+	for(n=0;n<t->num;n++) {
+		for(m=0;m<t->num;m++) {
+			fscanf(f, "%e %s %s", &t->r[n][m].c, 
 							netname1, netname2);
 
 			if(!strcmp(netname1, "_NULL_")) {
-				results[n][m].net1=NULL;
+				t->r[n][m].net1=NULL;
 			} else {
-				results[n][m].net1=net_find(netname1);
+				t->r[n][m].net1=net_find(netname1);
 			}
 
 			if(!strcmp(netname2, "_NULL_")) {
-				results[n][m].net2=NULL;
+				t->r[n][m].net2=NULL;
 			} else {
-				results[n][m].net2=net_find(netname2);
+				t->r[n][m].net2=net_find(netname2);
 			}
 		}
 	}
@@ -112,56 +203,120 @@ static int cap_load_results(char *filename)
 	return 0;
 }
 
-static int cap_alloc_results()
+static int cap_alloc_results(struct result_table *t)
 {
 	int n,m;
 	struct net *net;
 
-	resultnum=0;
+	t->num=0;
 
 	net=net_list;
 	while(net!=NULL) {
-		resultnum++;
+		t->num++;
 		net=net->next;
 	}
 
-	results=calloc(resultnum, sizeof(*results));
+	t->r=calloc(t->num, sizeof(*t->r));
 
-	if(results==NULL) return -1;
+	if(t->r==NULL) return -1;
 
-	for(n=0;n<resultnum;n++) {
-		results[n]=calloc(resultnum, sizeof(*results[n]));
-		if(results[n]==NULL) return -1;
+	for(n=0;n<t->num;n++) {
+		t->r[n]=calloc(t->num, sizeof(*t->r[n]));
+		if(t->r[n]==NULL) return -1;
 
-		for(m=0;m<resultnum;m++) {
-			results[n][m].net1=NULL;
-			results[n][m].net2=NULL;
+		for(m=0;m<t->num;m++) {
+			t->r[n][m].net1=NULL;
+			t->r[n][m].net2=NULL;
 		}
 	}
 
 	return 0;
 }
 
-static void cap_free_results()
+static void cap_free_results(struct result_table *t)
 {
 	int n;
 
-	for(n=0;n<resultnum;n++) {
-		free(results[n]);
+	for(n=0;n<t->num;n++) {
+		free(t->r[n]);
+	}
+	free(t->r);
+}
+
+/** @brief Checks that all solves gave a result.
+ *
+ * Solves that diverge set their results to NaN (see cap_one()).
+ *
+ * @param t Pointer to the result table.
+ * @return 0 if all results are finite or -1 if not. */
+static int cap_check_results(struct result_table *t)
+{
+	struct net *net;
+	int n, m, r;
+
+	r=0;
+
+	n=0;
+	net=net_list;
+	while(net!=NULL) {
+		for(m=0;m<t->num;m++) {
+			if(!num_finite(t->r[n][m].c)) {
+				error("No result for net %s", net->name);
+				r=-1;
+				break;
+			}
+		}
+		n++;
+		net=net->next;
 	}
-	free(results);
+
+	return r;
+}
+
+/** @brief Estimates the relative error of the capacitances that is left
+ * after a check.
+ *
+ * The solvers converge geometrically, so the change of the capacitances
+ * between two checks shrinks by about the same ratio from one check to 
+ * the next. The error that is left is the sum of all changes that are 
+ * still to come. When the ratio is close to 1 this is many times the last
+ * change, so the change alone is not a safe stopping criterion.
+ *
+ * @param change Largest relative change of a capacitance since the last
+ * check.
+ * @param last The same for the check before or a negative number if it is
+ * not known.
+ * @return Estimated relative error or a negative number if it can't be 
+ * estimated. */
+static double cap_error_estimate(double change, double last)
+{
+	double ratio;
+
+	if(change<=0.0) return 0.0;
+	if(last<=0.0) return -1.0;
+
+	ratio=change/last;
+	if(ratio>=1.0) return -1.0;
+
+	return change*ratio/(1.0-ratio);
 }
 
 #define OBJ_IS_NET(obj)	((obj->role==net)&&(obj->mat->type==metal))
 
-n_float face_flow(struct face *f, struct space *sp)
+/**
+ * @brief Electric flux through a face.
+ *
+ * Computed in double precision, also when mesh point values are stored in
+ * single precision, so that the sum over many faces does not lose digits.
+ */
+double face_flow(struct face *f, struct space *sp)
 {
 	n_v3i p, p1, p2;
 	n_v3i pos;
 
-	n_float h, a, b;
-	n_float e1, e2, e3, e4, ex;
-	n_float flow;
+	double h, a, b;
+	double e1, e2, e3, e4, ex;
+	double flow;
 
 	pos=f->pos;
 
@@ -173,31 +328,35 @@ n_float face_flow(struct face *f, struct space *sp)
 
 	// debug("lay: %s mat: %s e: %e", lay->name, mat->name, mat->e);
 
-	h=fabs(f->n.x * sp->step.x + f->n.y * sp->step.y + f->n.z * sp->step.z);
+	/* h is the distance between the points on both sides of the face,
+	 * a and b are the sides of the face (local distances in a graded 
+	 * mesh, see sp_dist()) */
 
-	a=f->e1.x * sp->step.x + f->e1.y * sp->step.y + f->e1.z * sp->step.z;
-	b=f->e2.x * sp->step.x + f->e2.y * sp->step.y + f->e2.z * sp->step.z;
+	h=fabs(sp_dist(sp, v3i_sub(pos, f->n), v3i_add(pos, f->n)));
+
+	a=sp_dist(sp, pos, v3i_add(pos, f->e1));
+	b=sp_dist(sp, pos, v3i_add(pos, f->e2));
 
 	p=pos;
 	p1=v3i_add(p, f->n);
 	p2=v3i_sub(p, f->n);
-	e1=(sp_n_get(sp, p1) - sp_n_get(sp, p2))/2/h;
+	e1=(sp_n_get_double(sp, p1) - sp_n_get_double(sp, p2))/h;
 
 	p=v3i_add(pos, f->e1);
 	p1=v3i_add(p, f->n);
 	p2=v3i_sub(p, f->n);
-	e2=(sp_n_get(sp, p1) - sp_n_get(sp, p2))/2/h;
+	e2=(sp_n_get_double(sp, p1) - sp_n_get_double(sp, p2))/h;
 
 	p=v3i_add(pos, f->e2);
 	p1=v3i_add(p, f->n);
 	p2=v3i_sub(p, f->n);
-	e3=(sp_n_get(sp, p1) - sp_n_get(sp, p2))/2/h;
+	e3=(sp_n_get_double(sp, p1) - sp_n_get_double(sp, p2))/h;
 
 	p=v3i_add(pos, f->e1);
 	p=v3i_add(p, f->e2);
 	p1=v3i_add(p, f->n);
 	p2=v3i_sub(p, f->n);
-	e4=(sp_n_get(sp, p1) - sp_n_get(sp, p2))/2/h;
+	e4=(sp_n_get_double(sp, p1) - sp_n_get_double(sp, p2))/h;
 
 	ex=(e1+e2+e3+e4)/4;
 
@@ -206,10 +365,10 @@ n_float face_flow(struct face *f, struct space *sp)
 	return flow;
 }
 
-n_float face_flow_sum(struct face *list, struct space *sp)
+double face_flow_sum(struct face *list, struct space *sp)
 {
 	struct face *cur;
-	n_float sum,h;
+	double sum,h;
 
 	/*
 	n_float fgx1,fgy1,fgz1;
@@ -264,6 +423,222 @@ n_float face_flow_sum(struct face *list, struct space *sp)
 	return sum;
 }
 
+/** @brief Mesh point that contributes to the electric flux through the
+ * surface around a net. */
+struct cap_flux_point {
+	/** @brief Mesh block of the point. */
+	struct block *blk;
+
+	/** @brief Index of the point in the arrays of the block (see 
+	 * blk_off3()). */
+	size_t off;
+
+	/** @brief Weight of the point value in the flux. */
+	double w;
+};
+
+/** @brief Electric flux through the surface around a net, as a weighted 
+ * sum of mesh point values.
+ *
+ * face_flow() takes the difference of eight mesh point values for each 
+ * face. Faces share most of their points, so the weights of all faces 
+ * are summed per point once and the flux is then a single pass over 
+ * this array (see cap_flux_sum()). Points are sorted by block and index,
+ * so the array is read in memory order. */
+struct cap_flux {
+	struct cap_flux_point *p;
+	int num;
+};
+
+/** @brief Compares flux points by block and index (for qsort()). */
+static int cap_flux_compare(const void *a, const void *b)
+{
+	const struct cap_flux_point *pa=a, *pb=b;
+
+	if(pa->blk!=pb->blk) return (pa->blk < pb->blk) ? -1 : 1;
+	if(pa->off!=pb->off) return (pa->off < pb->off) ? -1 : 1;
+
+	return 0;
+}
+
+/** @brief Builds the weighted sum for the flux through the surface around
+ * a net.
+ *
+ * Gives the same flux as face_flow_sum() with the faces from 
+ * net_get_face_sp() with standoff 1. The mesh must be optimized (see 
+ * sp_optimize()). Values of mesh points are only read by cap_flux_sum(),
+ * so the same array can be used during the whole solve.
+ *
+ * @param net Pointer to the net.
+ * @param sp Pointer to the mesh.
+ * @return Pointer to the weighted sum or NULL on error. */
+static struct cap_flux *cap_flux_build(struct net *net, struct space *sp)
+{
+	struct cap_flux *fl;
+	struct cap_flux_point *p;
+	struct face *list, *f;
+	n_v3i pos, c;
+	double h, w;
+	int num, n, m;
+
+	fl=calloc(1, sizeof(*fl));
+	if(fl==NULL) return NULL;
+
+	list=net_get_face_sp(net, sp, 1);
+
+	num=0;
+	for(f=list;f!=NULL;f=f->next) num++;
+
+	fl->p=calloc((size_t) num * 8 + 1, sizeof(*fl->p));
+	if(fl->p==NULL) {
+		face_done(list);
+		free(fl);
+		return NULL;
+	}
+
+	n=0;
+	for(f=list;f!=NULL;f=f->next) {
+		pos=f->pos;
+
+		/* same as face_flow() */
+
+		if(pos.x <= sp->pos.x) continue;
+		if(pos.x >= sp->pos.x + sp->size.x - 1) continue;
+
+		if(pos.y <= sp->pos.y) continue;
+		if(pos.y >= sp->pos.y + sp->size.y - 1) continue;
+
+		h=fabs(sp_dist(sp, v3i_sub(pos, f->n), v3i_add(pos, f->n)));
+
+		w=sp_a_get(sp, pos) * 
+			sp_dist(sp, pos, v3i_add(pos, f->e1)) *
+			sp_dist(sp, pos, v3i_add(pos, f->e2)) /
+			(4.0 * h);
+
+		for(m=0;m<4;m++) {
+			c=pos;
+			if(m & 1) c=v3i_add(c, f->e1);
+			if(m & 2) c=v3i_add(c, f->e2);
+
+			p=&fl->p[n++];
+			p->blk=sp_point_find(sp, v3i_add(c, f->n), &p->off);
+			p->w=w;
+			assert(p->blk!=NULL);
+
+			p=&fl->p[n++];
+			p->blk=sp_point_find(sp, v3i_sub(c, f->n), &p->off);
+			p->w=-w;
+			assert(p->blk!=NULL);
+		}
+	}
+
+	face_done(list);
+
+	qsort(fl->p, n, sizeof(*fl->p), cap_flux_compare);
+
+	/* merge equal points */
+
+	num=0;
+	for(m=0;m<n;m++) {
+		if(num>0 && !cap_flux_compare(&fl->p[num-1], &fl->p[m])) {
+			fl->p[num-1].w+=fl->p[m].w;
+		} else {
+			fl->p[num++]=fl->p[m];
+		}
+	}
+
+	fl->num=num;
+
+	return fl;
+}
+
+/** @brief Electric flux through the surface around a net.
+ *
+ * Computed in double precision, including the low order part of mesh 
+ * point values in mixed precision (see sp_n_get_double()).
+ *
+ * @param fl Pointer to the weighted sum from cap_flux_build().
+ * @return Flux. */
+static double cap_flux_sum(struct cap_flux *fl)
+{
+	struct cap_flux_point *p;
+	struct block *blk;
+	double sum, u;
+	int n;
+
+	sum=0.0;
+	for(n=0;n<fl->num;n++) {
+		p=&fl->p[n];
+		blk=p->blk;
+
+		if(blk->n==NULL) {
+			u=blk->c_n;
+		} else if(blk->vec[BLK_VEC_LO]==NULL) {
+			u=blk->n[p->off];
+		} else {
+			u=(double) blk->n[p->off] + blk->vec[BLK_VEC_LO][p->off];
+		}
+
+		sum+=p->w * u;
+	}
+
+	return sum;
+}
+
+/** @brief Frees a weighted sum from cap_flux_build().
+ *
+ * @param fl Pointer to the weighted sum or NULL. */
+static void cap_flux_done(struct cap_flux *fl)
+{
+	if(fl==NULL) return;
+
+	free(fl->p);
+	free(fl);
+}
+
+/** @brief Builds the weighted sums for the flux around all nets.
+ *
+ * @param sp Pointer to the mesh.
+ * @param num Number of nets in net_list.
+ * @return Array with one weighted sum for each net in net_list or NULL on
+ * error. */
+static struct cap_flux **cap_flux_build_all(struct space *sp, int num)
+{
+	struct cap_flux **flux;
+	struct net *net;
+	int n;
+
+	flux=calloc(num, sizeof(*flux));
+	if(flux==NULL) return NULL;
+
+	n=0;
+	for(net=net_list;net!=NULL;net=net->next) {
+		flux[n]=cap_flux_build(net, sp);
+		if(flux[n]==NULL) {
+			while(n>0) cap_flux_done(flux[--n]);
+			free(flux);
+			return NULL;
+		}
+		n++;
+	}
+
+	return flux;
+}
+
+/** @brief Frees weighted sums from cap_flux_build_all().
+ *
+ * @param flux Array of weighted sums or NULL.
+ * @param num Number of nets in net_list. */
+static void cap_flux_done_all(struct cap_flux **flux, int num)
+{
+	int n;
+
+	if(flux==NULL) return;
+
+	for(n=0;n<num;n++) cap_flux_done(flux[n]);
+	free(flux);
+}
+
 static void cap_dump_sp(struct space *sp, char *name)
 {
 	char dumpfile[256];
@@ -300,30 +675,158 @@ static void cap_dump_sp(struct space *sp, char *name)
 	}
 }
 
-static void cap_one(struct space *sp, struct net *net, struct result *r)
+/** @brief Keeps the potential of an evaluated net for warm starts.
+ *
+ * @param warm Pointer to the saved potentials.
+ * @param sp Pointer to the mesh with the final potential. */
+static void cap_warm_save(struct cap_warm *warm, struct space *sp)
+{
+	struct cap_field *f;
+	n_v3i pos;
+	size_t i;
+
+	f=realloc(warm->field, sizeof(*warm->field) * (warm->num + 1));
+	if(f==NULL) return;
+	warm->field=f;
+
+	f=&warm->field[warm->num];
+
+	f->pos=sp->pos;
+	f->size=sp->size;
+	f->u=calloc((size_t) sp->size.x * sp->size.y * sp->size.z, 
+							sizeof(*f->u));
+	if(f->u==NULL) return;
+
+	i=0;
+	for(pos.z=0;pos.z<sp->size.z;pos.z++) {
+		for(pos.y=0;pos.y<sp->size.y;pos.y++) {
+			for(pos.x=0;pos.x<sp->size.x;pos.x++) {
+				f->u[i++]=sp_n_get(sp, v3i_add(pos, sp->pos));
+			}
+		}
+	}
+
+	warm->num++;
+}
+
+/** @brief Frees the saved potentials.
+ *
+ * @param warm Pointer to the saved potentials. */
+static void cap_warm_free(struct cap_warm *warm)
+{
+	int n;
+
+	for(n=0;n<warm->num;n++) free(warm->field[n].u);
+	if(warm->field!=NULL) free(warm->field);
+
+	warm->field=NULL;
+	warm->num=0;
+}
+
+/** @brief Sum of the saved potentials at a mesh point. 
+ *
+ * Potentials are zero outside of the meshes they were computed in.
+ *
+ * @param warm Pointer to the saved potentials.
+ * @param pos Absolute position of the mesh point.
+ * @return Sum of the potentials. */
+static double cap_warm_sum(struct cap_warm *warm, n_v3i pos)
+{
+	struct cap_field *f;
+	double sum;
+	int n, x, y, z;
+
+	sum=0.0;
+	for(n=0;n<warm->num;n++) {
+		f=&warm->field[n];
+
+		x=pos.x - f->pos.x;
+		y=pos.y - f->pos.y;
+		z=pos.z - f->pos.z;
+
+		if(x<0 || y<0 || z<0) continue;
+		if(x>=f->size.x || y>=f->size.y || z>=f->size.z) continue;
+
+		sum+=f->u[((size_t) z * f->size.y + y) * f->size.x + x];
+	}
+
+	return sum;
+}
+
+/** @brief Writes a starting guess built from the saved potentials into 
+ * the variable mesh points.
+ *
+ * Potentials of all nets and of the grounded box add up to 1 V, so the 
+ * potential of this net is guessed as 1 V minus the potentials of the 
+ * nets evaluated before. The potential of the box is not known and the 
+ * guess is too large far from the nets, so it must be scaled with 
+ * sor_guess_scale() afterwards.
+ *
+ * @param warm Pointer to the saved potentials.
+ * @param sp Pointer to the mesh, after sp_optimize(). */
+static void cap_warm_apply(struct cap_warm *warm, struct space *sp)
+{
+	struct block *blk;
+	n_v3i pos;
+	double u;
+	int n;
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		if(blk->n==NULL) continue;
+
+		for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+			for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+				for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+					if(BLK_CON(blk, pos)) continue;
+
+					u=cap_warm_sum(warm, 
+						blk_abs(blk, pos));
+					u=1.0-u;
+					if(u<0.0) u=0.0;
+
+					BLK_N(blk, pos)=u;
+				}
+			}
+		}
+	}
+}
+
+/** @brief Calculates capacitances between one net and all nets.
+ *
+ * Uses only the mesh \a sp and the results \a r, so different nets can 
+ * be evaluated at the same time in different meshes. Objects must already
+ * be loaded and all nets set as grounded constants (see cap_main()).
+ *
+ * @param sp Pointer to an empty mesh with the layers of c_space (see 
+ * sp_dup()). Its \a net is set to \a net.
+ * @param net Net that is connected to 1 V.
+ * @param r Results, one for each net in net_list.
+ * @param warm Potentials of nets evaluated before for a warm start or 
+ * NULL. The potential of this net is added to them. */
+static void cap_one(struct space *sp, struct net *net, struct result *r,
+							struct cap_warm *warm)
 {
 	struct net *cur;
 	struct object *cp;
-	struct face *f;
+	struct cap_flux **flux;
+	struct mg *mg;
+	struct pcg *pcg;
+	struct sor *sor;
 
-	n_float error, max_error;
+	n_float change, max_error, last_error, last_change;
 
-	n_float q;
+	double q, estimate;
 
 	n_v2i pos, size;
 
-	int n, iterations;
+	int n, netnum, iterations, checking, checks, sweeps, growing, failed;
 
-	cur=net_list;
-	while(cur!=NULL) {
-		if(cur==net) {
-			net_set(cur, 1.0, 1);
-		} else {
-			net_set(cur, 0.0, 1);
-		}
+	struct timespec start, stop;
+	double points, seconds;
 
-		cur=cur->next;
-	}
+	sp->net=net;
 
 	info("Evaluating net %s", net->name);
 	info("Standoff = %d", a_standoff);
@@ -358,48 +861,173 @@ static void cap_one(struct space *sp, struct net *net, struct result *r)
 	sp_border(sp);
 
 	sp_optimize(sp);
+	sp_refine(sp);
 
 	// sp_optimize(sp);
 
+	mg=NULL;
+	if(a_solver==solver_mg) {
+		mg=mg_init(sp);
+		if(mg==NULL) {
+			warning("Can't initialize multigrid solver, using SOR");
+		} else {
+			mg_fmg(mg);
+		}
+	}
+
+	pcg=NULL;
+	if(a_solver==solver_pcg) {
+		pcg=pcg_init(sp, a_precond);
+		if(pcg==NULL) {
+			warning("Can't initialize conjugate gradient solver, "
+								"using SOR");
+		}
+	}
+
+	sor=NULL;
+	if(mg==NULL && pcg==NULL) {
+		sor=sor_init(sp, a_maxerror);
+		if(sor==NULL) {
+			warning("Can't initialize SOR solver");
+			sp_unload(sp);
+			return;
+		}
+
+		if(warm!=NULL && warm->num>0) {
+			/* the stopping criterion must not depend on the 
+			 * starting guess */
+			sor_reference(sor);
+			cap_warm_apply(warm, sp);
+			info("Warm start from %d nets, scale %.2f", 
+						warm->num, sor_guess_scale(sor));
+		}
+	}
+
 	mem_info();
 
+	netnum=0;
+	for(cur=net_list;cur!=NULL;cur=cur->next) netnum++;
+
+	/* surfaces around nets are built at the first check and then
+	 * reused by all following checks */
+	flux=NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	iterations=0;
+	checking=(sor==NULL);
+	checks=0;
+	last_change=-1.0;
+	last_error=-1.0;
+	growing=0;
+	failed=0;
 	while(1) {
-		for(n=0;n<a_iterations;n++) {
-			sor_iterate(sp);
+		if(mg!=NULL) {
+			/* multigrid converges in a few cycles, so check
+			 * after each one */
+			mg_cycle(mg);
 			iterations++;
 
 			fprintf(stderr, ".");
 			fflush(stderr);
+		} else {
+			for(n=0;n<a_iterations;) {
+				/* flux is only computed from a sweep that 
+				 * updated all blocks */
+				if(sor!=NULL && checking && 
+					n + a_sorsweeps >= a_iterations) {
+					sor_wake(sor);
+				}
+
+				if(pcg!=NULL) {
+					pcg_iterate(pcg);
+					sweeps=1;
+				} else {
+					sweeps=sor_iterate(sor);
+				}
+				n+=sweeps;
+				iterations+=sweeps;
+
+				fprintf(stderr, ".");
+				fflush(stderr);
+
+				if(pcg!=NULL) continue;
+
+				/* NaN compares false and would never stop */
+				if(!num_finite(sor_residual(sor))) {
+					failed=1;
+					break;
+				}
+
+				if(checking) continue;
+
+				if(sor_residual(sor) < 
+					a_maxerror*CAP_RESIDUAL_FACTOR) {
+					if(sor_awake(sor)) {
+						checking=1;
+						break;
+					}
+
+					/* sleeping blocks count with an old
+					 * residual, check it once with all
+					 * blocks updated */
+					sor_wake(sor);
+				}
+			}
+		}
+
+		if(failed) {
+			fprintf(stderr, "\n");
+			error("Residual for net %s is not finite", net->name);
+
+			for(n=0;n<netnum;n++) r[n].c=NAN;
+			break;
+		}
+
+		if(!checking) {
+			/* the residual norm is accumulated by the sweeps, 
+			 * so flux is only computed once it is small */
+			fprintf(stderr, "[%.2e]", sor_residual(sor));
+			fflush(stderr);
+			continue;
 		}
+
+		if(sor!=NULL) {
+			sor_finish(sor);
+		}
+
 		fprintf(stderr, "o");
 		fflush(stderr);
 
+		if(flux==NULL) {
+			flux=cap_flux_build_all(sp, netnum);
+			if(flux==NULL) {
+				warning("Can't allocate flux surfaces");
+				break;
+			}
+		}
+
 		max_error=-1.0;
 
 		n=0;
 		cur=net_list;
 		while(cur!=NULL) {
-			f=net_get_face_sp(cur, sp, 1);
-
-			// face_dump(f, cur->name); 
-
-			q=face_flow_sum(f, sp);
+			q=cap_flux_sum(flux[n]);
 
 			r[n].net1=net;
 			r[n].net2=cur;
 
 			//printf("%le\n", q);
 
+			if(!num_finite(q)) failed=1;
+
 			if(q!=0.0) {
-				error=fabs((r[n].c-q)/q);
-				if(error>max_error) max_error=error;
+				change=fabs((r[n].c-q)/q);
+				if(change>max_error) max_error=change;
 			}
 
 			r[n].c=q;
 
-			face_done(f);
-
 			n++;
 
 			cur=cur->next;
@@ -408,18 +1036,89 @@ static void cap_one(struct space *sp, struct net *net, struct result *r)
 		fprintf(stderr, "[%4.2f]", max_error);
 		fflush(stderr);
 
-		if(max_error<a_maxerror) break;
+		/* the first check compares with zero */
+		checks++;
+		estimate=-1.0;
+		if(checks>1) {
+			estimate=cap_error_estimate(max_error, last_change);
+			last_change=max_error;
+		}
+
+		if(pcg!=NULL) {
+			debug("Relative residual norm %e", pcg_residual(pcg));
+		}
+
+		/* a solver that diverges can still pass the test below, 
+		 * since NaN compares false */
+		if(last_error>=0.0 && max_error>=last_error) {
+			growing++;
+		} else {
+			growing=0;
+		}
+		last_error=max_error;
+
+		if(failed||growing>=CAP_DIVERGE_CHECKS) {
+			fprintf(stderr, "\n");
+			error("Solution for net %s diverges", net->name);
+
+			for(n=0;n<netnum;n++) r[n].c=NAN;
+			break;
+		}
+
+		if(estimate>=0.0 && estimate<a_maxerror && 
+						max_error<a_maxerror) break;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	cap_flux_done_all(flux, netnum);
+
 	fprintf(stderr, "\n");
 	fflush(stderr);
 
-	info("Finished after total %d iterations", iterations);
+	if(mg!=NULL) {
+		mg_done(mg);
+		info("Finished after total %d multigrid cycles", iterations);
+	} else if(pcg!=NULL) {
+		info("Finished after total %d conjugate gradient iterations, "
+			"relative residual norm %e", iterations,
+			pcg_residual(pcg));
+		pcg_done(pcg);
+	} else {
+		info("Finished after total %d iterations, "
+			"relative residual norm %e", iterations,
+			sor_residual(sor));
+
+		if(a_soromega_auto) {
+			info("Estimated SOR omega %.3f", sor_get_omega(sor));
+		}
+
+		points=0.0;
+		for(n=0;n<sp->varnum;n++) {
+			points+=(double) sp->var[n]->size.x * 
+						sp->var[n]->size.y *
+						sp->var[n]->size.z;
+		}
+
+		seconds=(stop.tv_sec-start.tv_sec)+
+					(stop.tv_nsec-start.tv_nsec)*1e-9;
+		if(seconds>0.0) {
+			info("SOR speed %.3g mesh points per second "
+					"(%d sweeps per block)", 
+					points*iterations/seconds, a_sorsweeps);
+		}
+
+		sor_done(sor);
+	}
 
 	if(a_dump) {
 		cap_dump_sp(sp, net->name);
 	}
 
+	if(warm!=NULL) {
+		cap_warm_save(warm, sp);
+	}
+
 	/*
 	for(n=0;n<sp->laynum;n++) {
 		lay_dump(sp->lay[n], sp->lay[n]->name);
@@ -429,57 +1128,557 @@ static void cap_one(struct space *sp, struct net *net, struct result *r)
 	sp_unload(sp);
 }
 
-int cap_main()
+/** @brief Prepares shared data for the per-net solves.
+ *
+ * Loads the bitmaps of all objects and sets all nets as grounded 
+ * constants. The net that is connected to 1 V is then only chosen by the
+ * \a net of each mesh, so solves don't change any shared data.
+ *
+ * @return 0 on success and -1 on error. */
+static int cap_prepare()
 {
+	struct layer *lay;
 	struct net *net;
-	n_float c,d;
-	int n,m;
+	int n, m;
 
-	if(cap_alloc_results()) {
-		return -1;
+	for(n=0;n<c_space->laynum;n++) {
+		lay=c_space->lay[n];
+
+		for(m=0;m<lay->objnum;m++) {
+			if(obj_load(lay->obj[m])) {
+				error("Can't load object %s", lay->obj[m]->name);
+				return -1;
+			}
+		}
 	}
 
-	if(a_restore) {
-		cap_load_results("nelma.save");
+	net=net_list;
+	while(net!=NULL) {
+		net_set(net, 0.0, 1);
+		net=net->next;
+	}
+
+	return 0;
+}
+
+/** @brief Evaluates one net in a new mesh.
+ *
+ * @param net Net that is connected to 1 V.
+ * @param r Results, one for each net in net_list.
+ * @param pool Thread pool for iterating the mesh or NULL.
+ * @param warm Potentials for a warm start or NULL (see cap_one()). */
+static void cap_net(struct net *net, struct result *r, struct pool *pool,
+							struct cap_warm *warm)
+{
+	struct space *sp;
+
+	sp=sp_dup(c_space);
+	if(sp==NULL) {
+		error("Can't allocate mesh for net %s", net->name);
+		return;
+	}
+
+	sp->pool=pool;
+	cap_one(sp, net, r, warm);
+	sp_done(sp);
+}
+
+/** @brief Computes the capacitances between all nets from the current 
+ * solution of the all-nets solver.
+ *
+ * @param mrhs Pointer to the solver state.
+ * @param flux Surfaces around all nets (see cap_flux_build_all()).
+ * @param c Capacitances from the last check, \a num for each net. They are
+ * replaced with the new ones.
+ * @param num Number of nets.
+ * @return Largest relative change of a capacitance. */
+static double cap_all_check(struct mrhs *mrhs, struct cap_flux **flux,
+							n_float *c, int num)
+{
+	double q, change, max_error;
+	int n, m;
+
+	max_error=-1.0;
+
+	for(n=0;n<num;n++) {
+		mrhs_extract(mrhs, n);
+
+		for(m=0;m<num;m++) {
+			q=cap_flux_sum(flux[m]);
+
+			if(q!=0.0) {
+				change=fabs((c[n*num+m]-q)/q);
+				if(change>max_error) max_error=change;
+			}
+
+			c[n*num+m]=q;
+		}
+	}
+
+	return max_error;
+}
+
+/** @brief Calculates capacitances between all nets in one mesh.
+ *
+ * The mesh covers the standoff around all nets. The objects of the net
+ * with index n get the value n + 1 while the mesh is built, so that the
+ * solver can tell the nets apart (see mrhs.c). All nets are then solved 
+ * together and the flux is summed for each of them in turn.
+ *
+ * Meshes of separate solves only cover the standoff around one net, so
+ * results differ a little from the other solvers.
+ *
+ * @param results Results of all nets. */
+static void cap_all(struct result_table *results)
+{
+	struct space *sp;
+	struct mrhs *mrhs;
+	struct object **cp;
+	struct cap_flux **flux;
+	struct net *net, *cur;
+	n_float *c;
+	n_v2i pos, end;
+	double max_error, last_change, estimate;
+	int n, m, iterations, checking, checks, converged;
+
+	cp=calloc(results->num, sizeof(*cp));
+	c=calloc((size_t) results->num * results->num, sizeof(*c));
+	sp=sp_dup(c_space);
+	if(cp==NULL || c==NULL || sp==NULL) {
+		error("Can't allocate mesh for all nets");
+		if(sp!=NULL) sp_done(sp);
+		if(cp!=NULL) free(cp);
+		if(c!=NULL) free(c);
+		return;
+	}
+
+	sp->pool=NULL;
+	if(a_threads>1) {
+		sp->pool=pool_init(a_threads);
+		info("Using %d threads", pool_threads(sp->pool));
+	}
+
+	info("Evaluating all %d nets", results->num);
+	info("Standoff = %d", a_standoff);
+
+	n=0;
+	net=net_list;
+	while(net!=NULL) {
+		net_set(net, n + 1, 1);
+
+		cp[n]=net_get_composite(net);
+		obj_grow(cp[n], a_standoff, GROW_ROUND);
+
+		if(n==0) {
+			pos=cp[n]->pos;
+			end=v2i_add(cp[n]->pos, cp[n]->size);
+		} else {
+			if(cp[n]->pos.x<pos.x) pos.x=cp[n]->pos.x;
+			if(cp[n]->pos.y<pos.y) pos.y=cp[n]->pos.y;
+			if(cp[n]->pos.x+cp[n]->size.x>end.x) 
+				end.x=cp[n]->pos.x+cp[n]->size.x;
+			if(cp[n]->pos.y+cp[n]->size.y>end.y) 
+				end.y=cp[n]->pos.y+cp[n]->size.y;
+		}
+
+		n++;
+		net=net->next;
+	}
+
+	sp_load(sp, pos, v2i_add(v2i_sub(end, pos), v2i(1, 1)));
+
+	for(n=0;n<results->num;n++) {
+		cp[n]->con=0;
+		cp[n]->n=0.0;
+
+		for(m=0;m<sp->laynum;m++) {
+			sp_add_obj(sp, cp[n], sp->lay[m]);
+		}
+
+		obj_unload(cp[n]);
+		obj_done(cp[n]);
+	}
+
+	info("Grid is size (%d, %d, %d) and position (%d, %d, %d)", 
+					sp->size.x, sp->size.y, sp->size.z,
+					sp->pos.x, sp->pos.y, 0);
+
+	sp_add_obj_all(sp);
+	sp_border(sp);
+	sp_optimize(sp);
+
+	net=net_list;
+	while(net!=NULL) {
+		net_set(net, 0.0, 1);
+		net=net->next;
+	}
+
+	mrhs=mrhs_init(sp, results->num);
+	if(mrhs==NULL) {
+		error("Can't initialize solver for all nets");
+		pool_done(sp->pool);
+		sp_done(sp);
+		free(cp);
+		free(c);
+		return;
+	}
+
+	mem_info();
+
+	/* capacitances are checked like in cap_one(), but only go into the
+	 * results when they are accurate enough */
+	flux=NULL;
+
+	iterations=0;
+	checking=0;
+	checks=0;
+	last_change=-1.0;
+	converged=0;
+	while(!converged && !a_interrupt) {
+		for(n=0;n<a_iterations;n++) {
+			mrhs_iterate(mrhs);
+			iterations++;
+
+			fprintf(stderr, ".");
+			fflush(stderr);
+
+			if(!num_finite(mrhs_residual(mrhs))) break;
+
+			if(!checking && mrhs_residual(mrhs) < 
+					a_maxerror*CAP_RESIDUAL_FACTOR) {
+				checking=1;
+				break;
+			}
+		}
+
+		fprintf(stderr, "[%.2e]", mrhs_residual(mrhs));
+		fflush(stderr);
+
+		if(!num_finite(mrhs_residual(mrhs))) {
+			fprintf(stderr, "\n");
+			error("Residual is not finite");
+
+			for(n=0;n<results->num;n++) {
+				for(m=0;m<results->num;m++) {
+					results->r[n][m].c=NAN;
+				}
+			}
+			break;
+		}
+
+		if(!checking) continue;
+
+		if(flux==NULL) {
+			flux=cap_flux_build_all(sp, results->num);
+			if(flux==NULL) {
+				error("Can't allocate flux surfaces");
+				break;
+			}
+		}
+
+		fprintf(stderr, "o");
+		fflush(stderr);
+
+		max_error=cap_all_check(mrhs, flux, c, results->num);
+
+		fprintf(stderr, "[%4.2f]", max_error);
+		fflush(stderr);
+
+		/* the first check compares with zero */
+		checks++;
+		estimate=-1.0;
+		if(checks>1) {
+			estimate=cap_error_estimate(max_error, last_change);
+			last_change=max_error;
+		}
+
+		if(estimate>=0.0 && estimate<a_maxerror && 
+						max_error<a_maxerror) {
+			converged=1;
+		}
+	}
+
+	fprintf(stderr, "\n");
+	fflush(stderr);
+
+	if(converged) {
+		info("Finished after total %d iterations, "
+			"relative residual norm %e", iterations,
+			mrhs_residual(mrhs));
+
+		n=0;
+		net=net_list;
+		while(net!=NULL) {
+			m=0;
+			cur=net_list;
+			while(cur!=NULL) {
+				results->r[n][m].net1=net;
+				results->r[n][m].net2=cur;
+				results->r[n][m].c=c[n*results->num+m];
+
+				m++;
+				cur=cur->next;
+			}
+
+			if(a_dump) {
+				mrhs_extract(mrhs, n);
+				cap_dump_sp(sp, net->name);
+			}
+
+			n++;
+			net=net->next;
+		}
 	}
 
+	if(flux!=NULL) cap_flux_done_all(flux, results->num);
+
+	mrhs_done(mrhs);
+	pool_done(sp->pool);
+	sp_done(sp);
+
+	free(cp);
+	free(c);
+}
+
+/** @brief Estimates the memory needed to evaluate a net.
+ *
+ * The mesh covers the objects of the net grown by the standoff (see 
+ * cap_one()). Blocks outside of the objects' bounding box are usually
+ * freed by sp_optimize(), so this is an upper limit.
+ *
+ * @param net Pointer to the net.
+ * @return Estimated memory in bytes. */
+static double cap_mem_estimate(struct net *net)
+{
+	struct object *cp;
+	double points, values;
+
+	cp=net_get_composite(net);
+	obj_grow(cp, a_standoff, GROW_ROUND);
+
+	points=(double) (cp->size.x + 1) * (cp->size.y + 1) * 
+							c_space->size.z;
+
+	obj_unload(cp);
+	obj_done(cp);
+
+	values=CAP_POINT_VALUES;
+	if(a_solver==solver_pcg) {
+		values+=4.0;
+	} else if(a_solver==solver_mg) {
+		values+=1.0 + 1.0/8.0;
+	} else if(a_sorprecision==sor_mixed) {
+		values+=3.0;
+	}
+
+	return points * values * sizeof(n_float);
+}
+
+/** @brief Orders jobs by decreasing memory estimate. */
+static int cap_job_compare(const void *a, const void *b)
+{
+	const struct cap_job *ja=a, *jb=b;
+
+	if(ja->mem > jb->mem) return -1;
+	if(ja->mem < jb->mem) return 1;
+
+	return 0;
+}
+
+/** @brief Work item for the thread pool: evaluates one net.
+ *
+ * Waits until the estimated memory of the net fits in the budget next to
+ * the nets that are already being evaluated. A net that doesn't fit on its
+ * own is evaluated alone. */
+static void cap_job_pass(void *arg, int n)
+{
+	struct cap_sched *sched;
+	struct cap_job *job;
+	struct pool *pool;
+
+	sched=arg;
+	job=&sched->job[n];
+
+	pthread_mutex_lock(&sched->lock);
+	while(sched->running>0 && sched->budget>0.0 &&
+			sched->used + job->mem > sched->budget) {
+		pthread_cond_wait(&sched->freed, &sched->lock);
+	}
+	sched->used+=job->mem;
+	sched->running++;
+	pthread_mutex_unlock(&sched->lock);
+
+	if(!a_interrupt) {
+		pool=NULL;
+		if(a_threads>1) pool=pool_init(a_threads);
+
+		cap_net(job->net, job->r, pool, NULL);
+
+		pool_done(pool);
+	}
+
+	pthread_mutex_lock(&sched->lock);
+	sched->used-=job->mem;
+	sched->running--;
+	pthread_cond_broadcast(&sched->freed);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/** @brief Evaluates up to a_nets nets at the same time.
+ *
+ * Nets are started largest first (by their estimated memory), so that
+ * the last nets to finish are small ones. Each net is evaluated in its own
+ * mesh with its own thread pool of a_threads threads, exactly as it would
+ * be evaluated alone, so results don't depend on the order.
+ *
+ * @param results Result table. Nets that already have results are 
+ * skipped. */
+static void cap_schedule(struct result_table *results)
+{
+	struct cap_sched sched;
+	struct pool *pool;
+	struct net *net;
+	int n;
+
+	sched.job=calloc(results->num, sizeof(*sched.job));
+	if(sched.job==NULL) {
+		error("Can't allocate memory for the net scheduler");
+		return;
+	}
+
+	sched.jobnum=0;
+
 	n=0;
 	net=net_list;
 	while(net!=NULL) {
-		if(results[n][0].net1==NULL) {
-			cap_one(c_space, net, results[n]);
+		if(results->r[n][0].net1==NULL) {
+			sched.job[sched.jobnum].net=net;
+			sched.job[sched.jobnum].r=results->r[n];
+			sched.job[sched.jobnum].mem=cap_mem_estimate(net);
+			sched.jobnum++;
 		}
 		n++;
 		net=net->next;
+	}
+
+	qsort(sched.job, sched.jobnum, sizeof(*sched.job), cap_job_compare);
+
+	sched.budget=(double) a_memory * 1024.0 * 1024.0;
+	sched.used=0.0;
+	sched.running=0;
+
+	pthread_mutex_init(&sched.lock, NULL);
+	pthread_cond_init(&sched.freed, NULL);
 
-		if(a_interrupt) {
-			cap_save_results("nelma.save");
-			cap_free_results();
-			return 0;
+	pool=pool_init(a_nets);
+	info("Evaluating %d nets at the same time", pool_threads(pool));
+
+	pool_run(pool, cap_job_pass, &sched, sched.jobnum);
+
+	pool_done(pool);
+
+	pthread_cond_destroy(&sched.freed);
+	pthread_mutex_destroy(&sched.lock);
+
+	free(sched.job);
+}
+
+int cap_main()
+{
+	struct result_table results;
+	struct net *net;
+	struct pool *pool;
+	struct cap_warm warm;
+	n_float c,d;
+	int n,m;
+
+	if(cap_alloc_results(&results)) {
+		return -1;
+	}
+
+	if(a_restore) {
+		cap_load_results(&results, "nelma.save");
+	}
+
+	if(cap_prepare()) {
+		cap_free_results(&results);
+		return -1;
+	}
+
+	if(a_sprefine>0 && (a_solver!=solver_sor || 
+				a_sorrelax!=sor_point || 
+				a_sorprecision!=sor_single || 
+				a_sorstorage!=sor_float || a_sorsweeps>1)) {
+		warning("Coarse mesh blocks are only used with the default "
+							"SOR solver");
+		a_sprefine=0;
+	}
+
+	if(a_solver==solver_mrhs) {
+		cap_all(&results);
+	} else if(a_nets>1) {
+		if(a_warmstart) {
+			warning("Warm start is not used with more than one net "
+							"at the same time");
+		}
+		cap_schedule(&results);
+	} else {
+		warm.field=NULL;
+		warm.num=0;
+
+		pool=NULL;
+		if(a_threads>1) {
+			pool=pool_init(a_threads);
+			info("Using %d threads", pool_threads(pool));
+		}
+
+		n=0;
+		net=net_list;
+		while(net!=NULL && !a_interrupt) {
+			if(results.r[n][0].net1==NULL) {
+				cap_net(net, results.r[n], pool, 
+						a_warmstart ? &warm : NULL);
+			}
+			n++;
+			net=net->next;
 		}
+
+		pool_done(pool);
+		cap_warm_free(&warm);
+	}
+
+	if(a_interrupt) {
+		cap_save_results(&results, "nelma.save");
+		cap_free_results(&results);
+		return 0;
+	}
+
+	if(cap_check_results(&results)) {
+		cap_free_results(&results);
+		return -1;
 	}
 
-	for(n=0;n<resultnum;n++) {
-		for(m=0;m<resultnum;m++) if(n<m) {
-			c=(results[n][m].c+results[m][n].c)/2;
-			d=fabs(results[n][m].c-c);
+	for(n=0;n<results.num;n++) {
+		for(m=0;m<results.num;m++) if(n<m) {
+			c=(results.r[n][m].c+results.r[m][n].c)/2;
+			d=fabs(results.r[n][m].c-c);
 			printf("C%02d%02d %s %s %e\n", n, m, 
-						results[n][m].net1->name, 
-						results[n][m].net2->name, c);						
+						results.r[n][m].net1->name, 
+						results.r[n][m].net2->name, c);						
 			/*
-			printf("* %s -> %s %e\n", results[n][m].net1->name,
-						  results[n][m].net2->name, 
-						  results[n][m].c);
-			printf("* %s -> %s %e\n", results[m][n].net1->name,
-						  results[m][n].net2->name, 
-						  results[m][n].c);
+			printf("* %s -> %s %e\n", results.r[n][m].net1->name,
+						  results.r[n][m].net2->name, 
+						  results.r[n][m].c);
+			printf("* %s -> %s %e\n", results.r[m][n].net1->name,
+						  results.r[m][n].net2->name, 
+						  results.r[m][n].c);
 			*/
 			printf("* numerical error: +/- %.2e (%5.0f %%)\n", 
 						d, d/c*100.0);
 		}
 	}
 
-	cap_free_results();
+	cap_free_results(&results);
 
 	return 0;
 }
@@ -8,6 +8,7 @@
 #define _CAPACITANCE_H
 
 #include "struct.h"
+#include "pcg.h"
 
 extern int a_standoff;
 extern int a_iterations;
@@ -17,6 +18,27 @@ extern n_float a_maxerror;
 extern int a_restore;
 extern int a_interrupt;
 
+extern int a_threads;
+extern int a_nets;
+extern int a_memory;
+extern int a_warmstart;
+
+/** @brief Method used to solve the finite difference equations. */
+enum solver_type {
+	/** @brief Red-black successive over-relaxation (see sor.c). */
+	solver_sor,
+	/** @brief Geometric multigrid (see multigrid.c). */
+	solver_mg,
+	/** @brief Preconditioned conjugate gradient (see pcg.c). */
+	solver_pcg,
+	/** @brief Red-black successive over-relaxation for all nets at once
+	 * in one mesh (see mrhs.c). */
+	solver_mrhs
+};
+
+extern enum solver_type a_solver;
+extern enum pcg_precond a_precond;
+
 int cap_main();
 
 #endif
@@ -45,6 +45,7 @@ static cfg_opt_t opts_material[] = {
 static cfg_opt_t opts_layer[] = {
 	CFG_INT("height", -1, CFGF_NONE),
 	CFG_INT("z-order", -1, CFGF_NONE),
+	CFG_FLOAT("step", 0.0, CFGF_NONE),
 	CFG_STR_LIST("objects", NULL, CFGF_NODEFAULT),
 	CFG_STR("material", NULL, CFGF_NODEFAULT),
 	CFG_END()
@@ -52,6 +53,9 @@ static cfg_opt_t opts_layer[] = {
 
 static cfg_opt_t opts_space[] = {
 	CFG_FLOAT_LIST("step", NULL, CFGF_NODEFAULT),
+	CFG_FLOAT("grading", 1.0, CFGF_NONE),
+	CFG_FLOAT("grading-limit", 8.0, CFGF_NONE),
+	CFG_INT("grading-margin", 5, CFGF_NONE),
 	CFG_STR_LIST("layers", NULL, CFGF_NODEFAULT),
 	CFG_END()
 };
@@ -187,6 +191,7 @@ static void parse_net(cfg_t *cfg)
 static void parse_layer(cfg_t *cfg) 
 {
 	n_int height, order;
+	n_float step;
 	struct material *mat;
 	const char *name;
 
@@ -209,6 +214,12 @@ static void parse_layer(cfg_t *cfg)
 		return;
 	}
 
+	step=cfg_getfloat(cfg, "step");
+	if(step<0.0) {
+		error("layer: %s: invalid step %e", cfg_title(cfg), step);
+		return;
+	}
+
 	mat=mat_find(cfg_getstr(cfg, "material"));
 	if(mat==NULL) {
 		error("layer %s: unknown material %s", 
@@ -217,6 +228,7 @@ static void parse_layer(cfg_t *cfg)
 	}
 
 	lay=lay_init(height, order, mat);
+	lay->step=step;
 
 	name=cfg_title(cfg);
 	lay->name=strdup(name);
@@ -238,6 +250,9 @@ static void parse_layer(cfg_t *cfg)
 
 	info("Layer '%s': height=%d z-order=%d material=%s", 
 			lay->name, lay->height, lay->order, lay->mat->name);
+	if(lay->step>0.0) {
+		info("Layer '%s': step=%.2e", lay->name, lay->step);
+	}
 
 	return;
 }
@@ -265,6 +280,17 @@ static void parse_space(cfg_t *cfg)
 
 	name=cfg_title(cfg);
 	sp->name=strdup(name);
+
+	sp->grading=cfg_getfloat(cfg, "grading");
+	sp->gradmax=cfg_getfloat(cfg, "grading-limit");
+	sp->gradmargin=cfg_getint(cfg, "grading-margin");
+	if(sp->grading<1.0 || sp->gradmax<1.0 || sp->gradmargin<0) {
+		error("space %s: invalid grading %f up to %f after %d points",
+			sp->name, sp->grading, sp->gradmax, sp->gradmargin);
+		sp->grading=1.0;
+		sp->gradmax=1.0;
+		sp->gradmargin=0;
+	}
 	
 	n=cfg_size(cfg, "layers");
 	for(i=0;i<n;i++) {
@@ -284,6 +310,11 @@ static void parse_space(cfg_t *cfg)
 
 	info("Space '%s': step=(%.2e,%.2e,%.2e)",
 		sp->name, step.x, step.y, step.z);
+	if(sp_graded(sp, X)) {
+		info("Space '%s': grading=%.3f up to %.1f times step after "
+				"%d points", sp->name, sp->grading, sp->gradmax,
+				sp->gradmargin);
+	}
 
 	return;
 }
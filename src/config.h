@@ -9,9 +9,40 @@
 
 #define	VERSION		"3.2"
 
-/** @todo make this run-time configurable */
+/** @brief Width and depth of mesh blocks with --blocks=fixed. */
 #define ALLOC_BLOCK_SIZE	64
 
+/** @brief Smallest width and depth of mesh blocks with --blocks=auto.
+ * Larger sizes are multiples of this. */
+#define ALLOC_BLOCK_MIN		16
+/** @brief Largest width and depth of mesh blocks with --blocks=auto. */
+#define ALLOC_BLOCK_MAX		256
+
+/** @brief Cache size in bytes if it can't be read from the system. */
+#define ALLOC_CACHE_SIZE	(1024*1024)
+
+/** @brief Bytes per mesh point that are used by every sweep (value and
+ * constant point mask, rounded up). */
+#define ALLOC_POINT_BYTES	5
+
+/** @brief Number of planes of a mesh block that a sweep works on at the
+ * same time (the plane that is updated and its neighbors). */
+#define ALLOC_PLANES		4
+
+/** @brief Smallest number of mesh blocks per thread with --blocks=auto. */
+#define ALLOC_BLOCKS_PER_THREAD	4
+
+/** @brief Largest number of times the mesh step can be doubled in coarse
+ * mesh blocks with --refine. */
+#define ALLOC_REFINE_MAX	3
+/** @brief Smallest distance between objects and a coarse mesh block, in
+ * steps of the coarse mesh. */
+#define ALLOC_REFINE_DIST	8
+
+/** @brief Size of slabs that mesh blocks and their arrays are carved
+ * from, in bytes. */
+#define ALLOC_ARENA_SLAB	(32*1024*1024)
+
 int parse_main(char *file);
 
 #endif
@@ -147,6 +147,7 @@ struct layer *lay_init(n_int height, n_int order, struct material *mat)
 	lay->order=order;
 
 	lay->z=-1;
+	lay->step=0.0;
 
 	/* v2i_sub(v2i_cz(sp->size), v2i(1, 1)); */
 
@@ -337,10 +338,38 @@ void map_set_circle(char *map, n_v2i center, int r, n_v2i size, char c)
 	}
 }
 
+/** @brief Value of the mesh points occupied by an object.
+ *
+ * Objects of the net set in \a net of the mesh are at 1 V, others have the
+ * value set in the object. 
+ *
+ * @param sp Pointer to the grid structure.
+ * @param obj Pointer to the object.
+ * @param con Set to 1 if the mesh points are constant or 0 otherwise.
+ * @return Value of the mesh points. */
+static n_float sp_obj_value(struct space *sp, struct object *obj, int *con)
+{
+	int n;
+
+	if(sp->net!=NULL) {
+		for(n=0;n<sp->net->objnum;n++) {
+			if(sp->net->obj[n]==obj) {
+				*con=1;
+				return 1.0;
+			}
+		}
+	}
+
+	*con=obj->con;
+	return obj->n;
+}
+
 void sp_add_obj(struct space *sp, struct object *obj, struct layer *lay)
 {
 	n_v3i pos;
 	n_v3i abspos;
+	n_float n;
+	int con;
 	
 	assert(sp!=NULL);
 	assert(obj!=NULL);
@@ -366,6 +395,8 @@ void sp_add_obj(struct space *sp, struct object *obj, struct layer *lay)
 		return;
 	}
 
+	n=sp_obj_value(sp, obj, &con);
+
 	for(pos.z=lay->z;pos.z<=lay->z+lay->height;pos.z++) {
 		for(pos.y=0;pos.y<obj->size.y;pos.y++) {
 			for(pos.x=0;pos.x<obj->size.x;pos.x++) {
@@ -378,28 +409,28 @@ void sp_add_obj(struct space *sp, struct object *obj, struct layer *lay)
 				abspos=v3i_add(pos, abspos);
 
 				if(sp_pos_inside(sp, abspos)) {
-					sp_n_set(sp, abspos, obj->n, obj->con);
+					sp_n_set(sp, abspos, n, con);
 				}
 
 				abspos=v3i(obj->pos.x+1, obj->pos.y, 0);
 				abspos=v3i_add(pos, abspos);
 
 				if(sp_pos_inside(sp, abspos)) {
-					sp_n_set(sp, abspos, obj->n, obj->con);
+					sp_n_set(sp, abspos, n, con);
 				}
 
 				abspos=v3i(obj->pos.x, obj->pos.y+1, 0);
 				abspos=v3i_add(pos, abspos);
 
 				if(sp_pos_inside(sp, abspos)) {
-					sp_n_set(sp, abspos, obj->n, obj->con);
+					sp_n_set(sp, abspos, n, con);
 				}
 
 				abspos=v3i(obj->pos.x+1, obj->pos.y+1, 0);
 				abspos=v3i_add(pos, abspos);
 
 				if(sp_pos_inside(sp, abspos)) {
-					sp_n_set(sp, abspos, obj->n, obj->con);
+					sp_n_set(sp, abspos, n, con);
 				}
 			}
 		}
@@ -418,7 +449,8 @@ void sp_add_obj(struct space *sp, struct object *obj, struct layer *lay)
 				abspos=v3i_add(pos, abspos);
 
 				if(sp_pos_inside(sp, abspos)) {
-					sp_a_set(sp, abspos, obj->mat->e);
+					sp_a_set_layer(sp, v2i_cz(abspos), lay,
+								obj->mat->e);
 				}
 			}
 		}
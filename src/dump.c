@@ -29,22 +29,19 @@ n_float get_field(struct space *sp, n_v3i pos)
 	if(pos.y > sp->pos.y + sp->size.y - 2) return 0.0;
 	if(pos.z > sp->pos.z + sp->size.z - 2) return 0.0;
 
-	h=sp->step.x*2;
-
 	p1=v3i_add(pos, v3i_x);
 	p2=v3i_sub(pos, v3i_x);
+	h=sp_dist(sp, p2, p1);
 	ex=(sp_n_get(sp, p2) - sp_n_get(sp, p1))/h;
 
-	h=sp->step.y*2;
-
 	p1=v3i_add(pos, v3i_y);
 	p2=v3i_sub(pos, v3i_y);
+	h=sp_dist(sp, p2, p1);
 	ey=(sp_n_get(sp, p2) - sp_n_get(sp, p1))/h;
 
-	h=sp->step.z*2;
-
 	p1=v3i_add(pos, v3i_z);
 	p2=v3i_sub(pos, v3i_z);
+	h=sp_dist(sp, p2, p1);
 	ez=(sp_n_get(sp, p2) - sp_n_get(sp, p1))/h;
 
 	e=sqrt(ex * ex + ey * ey + ez * ez);
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <string.h>
 #include <signal.h>
 #include <time.h>
 
@@ -17,9 +19,47 @@
 #include "config.h"
 #include "capacitance.h"
 #include "sor.h"
+#include "space.h"
 
 char *a_configfile=NULL;
 
+/** @brief Value returned by getopt_long() for the --solver option. */
+#define MAIN_OPT_SOLVER	256
+/** @brief Value returned by getopt_long() for the --precond option. */
+#define MAIN_OPT_PRECOND	257
+/** @brief Value returned by getopt_long() for the --relax option. */
+#define MAIN_OPT_RELAX		258
+/** @brief Value returned by getopt_long() for the --precision option. */
+#define MAIN_OPT_PRECISION	259
+/** @brief Value returned by getopt_long() for the --storage option. */
+#define MAIN_OPT_STORAGE	260
+/** @brief Value returned by getopt_long() for the --nets option. */
+#define MAIN_OPT_NETS		261
+/** @brief Value returned by getopt_long() for the --memory option. */
+#define MAIN_OPT_MEMORY		262
+/** @brief Value returned by getopt_long() for the --warm-start option. */
+#define MAIN_OPT_WARM		263
+/** @brief Value returned by getopt_long() for the --blocks option. */
+#define MAIN_OPT_BLOCKS		264
+/** @brief Value returned by getopt_long() for the --refine option. */
+#define MAIN_OPT_REFINE		265
+
+/** @brief Long command line options. */
+static struct option main_options[] = {
+	{ "solver",	required_argument,	NULL, MAIN_OPT_SOLVER },
+	{ "precond",	required_argument,	NULL, MAIN_OPT_PRECOND },
+	{ "relax",	required_argument,	NULL, MAIN_OPT_RELAX },
+	{ "precision",	required_argument,	NULL, MAIN_OPT_PRECISION },
+	{ "storage",	required_argument,	NULL, MAIN_OPT_STORAGE },
+	{ "nets",	required_argument,	NULL, MAIN_OPT_NETS },
+	{ "memory",	required_argument,	NULL, MAIN_OPT_MEMORY },
+	{ "warm-start",	no_argument,		NULL, MAIN_OPT_WARM },
+	{ "blocks",	required_argument,	NULL, MAIN_OPT_BLOCKS },
+	{ "refine",	required_argument,	NULL, MAIN_OPT_REFINE },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ NULL,		0,			NULL, 0 }
+};
+
 /**
  * @brief Interrupt handler.
  */
@@ -42,8 +82,20 @@ void main_syntax()
 
 	printf("SYNTAX: nelma-cap [ -s STANDOFF ]\n");
 	printf("                  [ -n ITERATIONS ]\n");
-	printf("                  [ -w SOR_OMEGA ]\n");
+	printf("                  [ -w SOR_OMEGA|auto ]\n");
+	printf("                  [ -k SWEEPS ]\n");
+	printf("                  [ --relax=point|line ]\n");
+	printf("                  [ --precision=single|mixed ]\n");
+	printf("                  [ --storage=float|half ]\n");
+	printf("                  [ --blocks=fixed|auto ]\n");
+	printf("                  [ --refine=LEVELS ]\n");
 	printf("                  [ -e MAX_ERROR_%% ]\n");
+	printf("                  [ -j THREADS ]\n");
+	printf("                  [ --nets=NETS ]\n");
+	printf("                  [ --memory=MB ]\n");
+	printf("                  [ --warm-start ]\n");
+	printf("                  [ --solver=sor|mg|pcg|mrhs ]\n");
+	printf("                  [ --precond=jacobi|ssor ]\n");
 	printf("                  [ -d ]\n");
 	printf("                  [ -v VERBOSITY ]\n");
 	printf("                  [ -r ]\n");
@@ -82,7 +134,8 @@ void main_args(int argc, char **argv)
 {
 	int c,r;
 
-        while ((c=getopt(argc, argv, "hs:n:dv:w:e:r"))!=-1) {
+        while ((c=getopt_long(argc, argv, "hs:n:dv:w:e:rj:k:", main_options,
+								NULL))!=-1) {
                 switch (c) {
 			case 'e': r=sscanf(optarg, "%f", &a_maxerror);
 				  if(r!=1) {
@@ -90,12 +143,25 @@ void main_args(int argc, char **argv)
 								optarg);
 				  }
 				  break;
-			case 'w': r=sscanf(optarg, "%f", &a_soromega);
+			case 'w': if(!strcmp(optarg, "auto")) {
+					  a_soromega_auto=1;
+					  break;
+				  }
+				  a_soromega_auto=0;
+				  r=sscanf(optarg, "%f", &a_soromega);
 				  if(r!=1) {
 				  	error("Invalid omega setting '%s'",
 								optarg);
 				  }
 				  break;
+			case 'k': r=sscanf(optarg, "%d", &a_sorsweeps);
+				  if((r!=1)||(a_sorsweeps<1)||
+					(a_sorsweeps>SOR_SWEEPS_MAX)) {
+				  	error("Invalid sweeps setting '%s'",
+								optarg);
+				  	a_sorsweeps=1;
+				  }
+				  break;
 			case 'v': r=sscanf(optarg, "%d", &a_verbosity);
 				  if(r!=1) {
 				  	error("Invalid verbosity setting '%s'",
@@ -114,6 +180,105 @@ void main_args(int argc, char **argv)
 								optarg);
 				  }
 				  break;
+			case 'j': r=sscanf(optarg, "%d", &a_threads);
+				  if((r!=1)||(a_threads<1)) {
+				  	error("Invalid threads setting '%s'",
+								optarg);
+				  	a_threads=1;
+				  }
+				  break;
+			case MAIN_OPT_NETS:
+				  r=sscanf(optarg, "%d", &a_nets);
+				  if((r!=1)||(a_nets<1)) {
+				  	error("Invalid nets setting '%s'",
+								optarg);
+				  	a_nets=1;
+				  }
+				  break;
+			case MAIN_OPT_MEMORY:
+				  r=sscanf(optarg, "%d", &a_memory);
+				  if((r!=1)||(a_memory<0)) {
+				  	error("Invalid memory setting '%s'",
+								optarg);
+				  	a_memory=0;
+				  }
+				  break;
+			case MAIN_OPT_WARM:
+				  a_warmstart=1;
+				  break;
+			case MAIN_OPT_SOLVER:
+				  if(!strcmp(optarg, "sor")) {
+					  a_solver=solver_sor;
+				  } else if(!strcmp(optarg, "mg")) {
+					  a_solver=solver_mg;
+				  } else if(!strcmp(optarg, "pcg")) {
+					  a_solver=solver_pcg;
+				  } else if(!strcmp(optarg, "mrhs")) {
+					  a_solver=solver_mrhs;
+				  } else {
+				  	error("Invalid solver setting '%s'",
+								optarg);
+				  }
+				  break;
+			case MAIN_OPT_PRECOND:
+				  if(!strcmp(optarg, "jacobi")) {
+					  a_precond=pcg_jacobi;
+				  } else if(!strcmp(optarg, "ssor")) {
+					  a_precond=pcg_ssor;
+				  } else {
+				  	error("Invalid preconditioner setting "
+							"'%s'", optarg);
+				  }
+				  break;
+			case MAIN_OPT_RELAX:
+				  if(!strcmp(optarg, "point")) {
+					  a_sorrelax=sor_point;
+				  } else if(!strcmp(optarg, "line")) {
+					  a_sorrelax=sor_line;
+				  } else {
+				  	error("Invalid relaxation setting '%s'",
+								optarg);
+				  }
+				  break;
+			case MAIN_OPT_PRECISION:
+				  if(!strcmp(optarg, "single")) {
+					  a_sorprecision=sor_single;
+				  } else if(!strcmp(optarg, "mixed")) {
+					  a_sorprecision=sor_mixed;
+				  } else {
+				  	error("Invalid precision setting '%s'",
+								optarg);
+				  }
+				  break;
+			case MAIN_OPT_BLOCKS:
+				  if(!strcmp(optarg, "fixed")) {
+					  a_spblocks=sp_blocks_fixed;
+				  } else if(!strcmp(optarg, "auto")) {
+					  a_spblocks=sp_blocks_auto;
+				  } else {
+				  	error("Invalid blocks setting '%s'",
+								optarg);
+				  }
+				  break;
+			case MAIN_OPT_REFINE:
+				  r=sscanf(optarg, "%d", &a_sprefine);
+				  if((r!=1)||(a_sprefine<0)||
+				  		(a_sprefine>ALLOC_REFINE_MAX)) {
+				  	error("Invalid refine setting '%s'",
+								optarg);
+				  	a_sprefine=0;
+				  }
+				  break;
+			case MAIN_OPT_STORAGE:
+				  if(!strcmp(optarg, "float")) {
+					  a_sorstorage=sor_float;
+				  } else if(!strcmp(optarg, "half")) {
+					  a_sorstorage=sor_half;
+				  } else {
+				  	error("Invalid storage setting '%s'",
+								optarg);
+				  }
+				  break;
                         case 'd': a_dump=1;
                                   break;
 			case 'r': a_restore=1;
@@ -156,7 +321,7 @@ int main(int argc, char **argv)
 
         signal(SIGINT, main_interrupt);
 
-	cap_main();
+	if(cap_main()) return 1;
 
 	return 0;
 }
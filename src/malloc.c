@@ -5,6 +5,9 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "assert.h"
 #include "error.h"
@@ -25,6 +28,10 @@ struct malloc_block_info {
 
 static struct code_module *code_modules=NULL;
 
+/* nets are evaluated in parallel with --nets, so the list and the byte
+ * counters are shared between threads */
+static pthread_mutex_t code_modules_lock=PTHREAD_MUTEX_INITIALIZER;
+
 static struct code_module *mem_block_find(char *name)
 {
 	struct code_module *dest;
@@ -58,8 +65,10 @@ void *mem_calloc(size_t nmemb, size_t size, char *block)
 
 	r=calloc(1, nmemb*size+sizeof(*info));
 	if(r!=NULL) {
+		pthread_mutex_lock(&code_modules_lock);
 		dest=mem_block_find(block);
 		dest->bytes+=nmemb*size;
+		pthread_mutex_unlock(&code_modules_lock);
 
 		info=r;
 
@@ -80,7 +89,9 @@ void mem_free(void *ptr)
 
 	assert(info->owner!=NULL);
 
+	pthread_mutex_lock(&code_modules_lock);
 	info->owner->bytes-=info->bytes;
+	pthread_mutex_unlock(&code_modules_lock);
 
 	free(info);
 }
@@ -91,11 +102,13 @@ void mem_info()
 
 	info("Memory allocation info:");
 
+	pthread_mutex_lock(&code_modules_lock);
 	cur=code_modules;
 	while(cur!=NULL) {
 		info("   %16d bytes - %s", cur->bytes, cur->name);
 		cur=cur->next;
 	}
+	pthread_mutex_unlock(&code_modules_lock);
 }
 
 #else
@@ -115,3 +128,353 @@ void mem_info()
 }
 
 #endif
+
+/** @brief Alignment of arrays carved from an arena, in bytes. One cache
+ * line, which is also enough for any SIMD load. */
+#define ARENA_ALIGN		64
+
+/** @brief Size of a huge page, in bytes. Slabs are aligned to this so that
+ * the kernel can back them with huge pages. */
+#define ARENA_HUGE		(2*1024*1024)
+
+/** @brief A large piece of memory that arrays are carved from. */
+struct arena_slab {
+	/** @brief Start of the memory returned by mmap() or calloc(). */
+	void *mem;
+	/** @brief Length of \a mem in bytes. */
+	size_t len;
+
+	/** @brief First usable byte (aligned to ARENA_ALIGN). */
+	char *base;
+	/** @brief Number of usable bytes from \a base on. */
+	size_t size;
+	/** @brief Number of bytes already carved from \a base on. */
+	size_t used;
+
+	/** @brief 1 if the slab was mapped with mmap(). */
+	int mapped;
+
+	struct arena_slab *next;
+};
+
+/** @brief Header in front of each array carved from an arena. */
+struct arena_chunk {
+	/** @brief Size of the array in bytes. */
+	size_t bytes;
+
+	/** @brief Size of the array rounded up to ARENA_ALIGN. */
+	size_t size;
+
+	/** @brief Range of bytes of a free array that were returned to the
+	 * system and are zero again (see mem_arena_free()). */
+	size_t clean_start, clean_end;
+
+	/** @brief Next free array of the same size. */
+	struct arena_chunk *next;
+};
+
+/** @brief Freed arrays of one size. */
+struct arena_bin {
+	/** @brief Size of the arrays rounded up to ARENA_ALIGN. */
+	size_t size;
+
+	/** @brief List of free arrays. */
+	struct arena_chunk *chunks;
+
+	struct arena_bin *next;
+};
+
+/** @brief Arena allocator.
+ *
+ * Arrays are carved one after another from large slabs. A freed array
+ * returns the whole pages that it covers to the system and is kept in a 
+ * list of free arrays of its size, from which the next array of the same
+ * size is taken. Meshes only use a few different sizes (block shapes 
+ * times element sizes), so arrays that are freed and allocated again while
+ * solving, for example when blocks are packed and unpacked, don't make 
+ * the arena grow. The slabs themselves are released all at once by 
+ * mem_arena_done(). */
+struct arena {
+	/** @brief Usual size of a slab in bytes. */
+	size_t slab;
+
+	/** @brief List of slabs, the one arrays are currently carved from
+	 * first. */
+	struct arena_slab *slabs;
+
+	/** @brief Lists of free arrays, one for each size. */
+	struct arena_bin *bins;
+};
+
+static size_t arena_round(size_t n, size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+/** @brief Allocates a new slab.
+ *
+ * Slabs are mapped anonymously, so they come zeroed from the system, and
+ * are aligned to ARENA_HUGE. Where mmap() isn't available a slab is 
+ * allocated with calloc().
+ *
+ * @param size Number of usable bytes.
+ * @return Pointer to the slab or NULL on error. */
+static struct arena_slab *arena_slab_new(size_t size)
+{
+	struct arena_slab *sl;
+	char *mem;
+
+	sl=calloc(1, sizeof(*sl));
+	if(sl==NULL) return NULL;
+
+	size=arena_round(size, ARENA_HUGE);
+
+#ifdef MAP_ANONYMOUS
+	sl->len=size + ARENA_HUGE;
+	mem=mmap(NULL, sl->len, PROT_READ | PROT_WRITE, 
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem!=MAP_FAILED) {
+		sl->mem=mem;
+		sl->base=(char *) arena_round((size_t) mem, ARENA_HUGE);
+		sl->mapped=1;
+#ifdef MADV_HUGEPAGE
+		madvise(sl->base, size, MADV_HUGEPAGE);
+#endif
+	}
+#endif
+	if(!sl->mapped) {
+		sl->len=size + ARENA_ALIGN;
+		mem=calloc(1, sl->len);
+		if(mem==NULL) {
+			free(sl);
+			return NULL;
+		}
+		sl->mem=mem;
+		sl->base=(char *) arena_round((size_t) mem, ARENA_ALIGN);
+	}
+
+	sl->size=size;
+	sl->used=0;
+
+	return sl;
+}
+
+static void arena_slab_free(struct arena_slab *sl)
+{
+#ifdef MAP_ANONYMOUS
+	if(sl->mapped) {
+		munmap(sl->mem, sl->len);
+	} else {
+		free(sl->mem);
+	}
+#else
+	free(sl->mem);
+#endif
+	free(sl);
+}
+
+/** @brief Creates an empty arena.
+ *
+ * @param slab Usual size of a slab in bytes. Larger arrays get a slab of
+ * their own.
+ * @return Pointer to the arena or NULL on error. */
+struct arena *mem_arena_init(size_t slab)
+{
+	struct arena *ar;
+
+	ar=calloc(1, sizeof(*ar));
+	if(ar==NULL) return NULL;
+
+	ar->slab=slab;
+	ar->slabs=NULL;
+	ar->bins=NULL;
+
+	return ar;
+}
+
+/** @brief Frees an arena together with all arrays carved from it.
+ *
+ * @param ar Pointer to the arena. */
+void mem_arena_done(struct arena *ar)
+{
+	struct arena_slab *sl, *next;
+	struct arena_bin *bin, *nbin;
+
+	assert(ar!=NULL);
+
+	bin=ar->bins;
+	while(bin!=NULL) {
+		nbin=bin->next;
+		free(bin);
+		bin=nbin;
+	}
+
+	sl=ar->slabs;
+	while(sl!=NULL) {
+		next=sl->next;
+		arena_slab_free(sl);
+		sl=next;
+	}
+
+	free(ar);
+}
+
+/** @brief Finds the list of free arrays of one size.
+ *
+ * @param ar Pointer to the arena.
+ * @param size Size of the arrays rounded up to ARENA_ALIGN.
+ * @param add If set, a new empty list is added when there is none yet.
+ * @return Pointer to the list or NULL if not found or on error. */
+static struct arena_bin *arena_bin_find(struct arena *ar, size_t size, 
+									int add)
+{
+	struct arena_bin *bin;
+
+	for(bin=ar->bins;bin!=NULL;bin=bin->next) {
+		if(bin->size==size) return bin;
+	}
+
+	if(!add) return NULL;
+
+	bin=calloc(1, sizeof(*bin));
+	if(bin==NULL) return NULL;
+
+	bin->size=size;
+	bin->chunks=NULL;
+
+	bin->next=ar->bins;
+	ar->bins=bin;
+
+	return bin;
+}
+
+/** @brief Allocates a zeroed array from an arena.
+ *
+ * The array is aligned to ARENA_ALIGN bytes. A free array of the same 
+ * size is used if there is one.
+ *
+ * @param ar Pointer to the arena.
+ * @param nmemb Number of elements.
+ * @param size Size of an element in bytes.
+ * @return Pointer to the array or NULL on error. */
+void *mem_arena_calloc(struct arena *ar, size_t nmemb, size_t size)
+{
+	struct arena_slab *sl;
+	struct arena_chunk *chunk;
+	struct arena_bin *bin;
+	size_t bytes, need;
+	char *p;
+
+	assert(ar!=NULL);
+
+	bytes=nmemb * size;
+	need=ARENA_ALIGN + arena_round(bytes, ARENA_ALIGN);
+
+	bin=arena_bin_find(ar, need - ARENA_ALIGN, 0);
+	if(bin!=NULL && bin->chunks!=NULL) {
+		chunk=bin->chunks;
+		bin->chunks=chunk->next;
+
+		chunk->bytes=bytes;
+		chunk->next=NULL;
+
+		/* pages that were returned to the system come back zeroed
+		 * when they are touched, so only the rest is cleared */
+		p=(char *) (chunk + 1);
+		if(chunk->clean_start < chunk->clean_end && 
+					chunk->clean_start < bytes) {
+			memset(p, 0, chunk->clean_start);
+			if(chunk->clean_end < bytes) {
+				memset(p + chunk->clean_end, 0, 
+						bytes - chunk->clean_end);
+			}
+		} else {
+			memset(p, 0, bytes);
+		}
+
+		return p;
+	}
+
+	sl=ar->slabs;
+	if(sl==NULL || sl->used + need > sl->size) {
+		sl=arena_slab_new(need > ar->slab ? need : ar->slab);
+		if(sl==NULL) return NULL;
+
+		sl->next=ar->slabs;
+		ar->slabs=sl;
+	}
+
+	/* the header is placed right in front of the array */
+	chunk=(struct arena_chunk *) (sl->base + sl->used + ARENA_ALIGN - 
+							sizeof(*chunk));
+	chunk->bytes=bytes;
+	chunk->size=need - ARENA_ALIGN;
+	chunk->clean_start=0;
+	chunk->clean_end=0;
+	chunk->next=NULL;
+
+	sl->used+=need;
+
+	return chunk + 1;
+}
+
+/** @brief Frees an array carved from an arena.
+ *
+ * The pages that lie completely inside the array are returned to the 
+ * system and the array is kept for the next array of the same size.
+ *
+ * @param ar Pointer to the arena.
+ * @param ptr Pointer to the array.
+ * @return 0 on success or -1 if \a ptr wasn't carved from \a ar. */
+int mem_arena_free(struct arena *ar, void *ptr)
+{
+	struct arena_slab *sl;
+	struct arena_chunk *chunk;
+	struct arena_bin *bin;
+	size_t page, start, end;
+	char *p;
+
+	assert(ar!=NULL);
+
+	p=ptr;
+
+	sl=ar->slabs;
+	while(sl!=NULL) {
+		if(p >= sl->base && p < sl->base + sl->used) break;
+		sl=sl->next;
+	}
+
+	if(sl==NULL) return -1;
+
+	chunk=(struct arena_chunk *) ptr - 1;
+
+	bin=arena_bin_find(ar, chunk->size, 1);
+
+	chunk->clean_start=0;
+	chunk->clean_end=0;
+
+#if defined(MAP_ANONYMOUS) && defined(MADV_DONTNEED)
+	if(sl->mapped) {
+		page=sysconf(_SC_PAGESIZE);
+
+		start=arena_round((size_t) p, page);
+		end=((size_t) p + chunk->bytes) / page * page;
+
+		if(end > start && 
+			!madvise((void *) start, end - start, MADV_DONTNEED)) {
+			chunk->clean_start=start - (size_t) p;
+			chunk->clean_end=end - (size_t) p;
+		}
+	}
+#endif
+
+	chunk->bytes=0;
+
+	/* without a list the array is simply not reused */
+	if(bin!=NULL) {
+		chunk->next=bin->chunks;
+		bin->chunks=chunk;
+	}
+
+	return 0;
+}
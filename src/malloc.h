@@ -10,6 +10,13 @@ void *mem_calloc(size_t nmemb, size_t size, char *block);
 void mem_free(void *ptr);
 void mem_info();
 
+struct arena;
+
+struct arena *mem_arena_init(size_t slab);
+void mem_arena_done(struct arena *ar);
+void *mem_arena_calloc(struct arena *ar, size_t nmemb, size_t size);
+int mem_arena_free(struct arena *ar, void *ptr);
+
 #define n_calloc(_nmemb_, _size_)mem_calloc((_nmemb_), (_size_), __FILE__)
 #define n_free(_ptr_) mem_free((_ptr_))
 
@@ -0,0 +1,597 @@
+/**
+ * @file src/mrhs.c
+ *
+ * @brief SOR solver for multiple right hand sides, code.
+ *
+ * Capacitances between N nets need N solutions of the finite difference
+ * equations with the same mesh, materials and constant points. Only the
+ * values of constant points differ: in solution i the objects of net i
+ * are at 1 V and all other constant points at 0 V. This module iterates
+ * all N solutions together in one mesh, so the stencil coefficients, the
+ * constant point masks and the traversal of blocks are shared between
+ * them.
+ *
+ * The values of all solutions are kept interleaved in one array per
+ * variable mesh block: the N values of a mesh point follow each other and
+ * the points are in the same order as in \a n of the block, including the
+ * halo. N is rounded up to a multiple of MRHS_WIDTH, so that the values of
+ * a point fill whole vectors (GCC vector extensions). The innermost loop of
+ * a sweep runs over these vectors, with the stencil coefficients of the 
+ * point loaded only once.
+ *
+ * Nets are told apart by the values of constant points in the mesh: the
+ * objects of the net with index i must have the value i + 1 when the mesh
+ * is built (see cap_all() in capacitance.c). All other constant points
+ * must be 0.
+ *
+ * The mesh covers all nets, so the potential of a net decays to tiny values
+ * far away from it. Denormal numbers are very slow on most processors, so
+ * sweeps flush them to zero where the processor supports it.
+ *
+ * Iteration is red-black SOR with Chebyshev acceleration, like the point
+ * SOR solver in sor.c. Each work item of the thread pool updates one
+ * variable mesh block. Residuals are summed per block first and then in
+ * block order, so results do not depend on the number of threads.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "assert.h"
+#include "error.h"
+#include "block.h"
+#include "space.h"
+#include "pool.h"
+#include "malloc.h"
+#include "sor.h"
+#include "mrhs.h"
+
+/** @brief Number of n_float values in a vector. */
+#define MRHS_WIDTH	4
+
+/** @brief Flush-to-zero and denormals-are-zero bits of the SSE control
+ * register. */
+#define MRHS_FTZ	0x8040
+
+/** @brief Vector of n_float values of consecutive right hand sides. */
+typedef n_float mrhs_vf __attribute__((vector_size(MRHS_WIDTH*sizeof(n_float)),
+						aligned(sizeof(n_float)),
+						__may_alias__));
+
+/** @brief Solver state for multiple right hand sides in one finite
+ * difference mesh. */
+struct mrhs {
+	/** @brief Pointer to the finite difference mesh. */
+	struct space *sp;
+
+	/** @brief Number of right hand sides (nets). */
+	int num;
+
+	/** @brief Number of values per mesh point in \a u: \a num rounded 
+	 * up to a multiple of MRHS_WIDTH. Values past \a num are always 
+	 * zero. */
+	int stride;
+
+	/** @brief Interleaved values of all right hand sides, one array for
+	 * each variable mesh block. */
+	n_float **u;
+
+	/** @brief Index of each mesh block in \a var of the space struct or
+	 * -1 for constant blocks. Same order as \a blk of the space
+	 * struct. */
+	int *index;
+
+	/** @brief Values of constant blocks when the mesh was built (see the
+	 * description of this file). Same order as \a blk of the space
+	 * struct. */
+	n_float *code;
+
+	/** @brief Sums of squared residuals of the last sweep, \a stride 
+	 * for each variable mesh block. */
+	double *sum;
+
+	/** @brief Work space for sums of squared residuals of one row, 
+	 * \a stride for each variable mesh block. */
+	n_float *acc;
+
+	/** @brief Sums of squared residuals of the last sweep for each right
+	 * hand side. */
+	double *resid;
+
+	/** @brief Sums of squared residuals of the first sweep for each right
+	 * hand side. */
+	double *resid_first;
+
+	/** @brief Extrapolation parameter of the last half-sweep (Chebyshev
+	 * acceleration) or 0 before the first one. */
+	n_float cheb;
+};
+
+/** @brief Arguments for mrhs_pass(). */
+struct mrhs_pass {
+	struct mrhs *mrhs;
+	int color;
+	n_float omega;
+};
+
+/** @brief Number of mesh blocks in a mesh.
+ *
+ * @param sp Pointer to the space struct.
+ * @return Number of blocks. */
+static int mrhs_blocks(struct space *sp)
+{
+	return sp->blknum.x * sp->blknum.y * sp->blknum.z;
+}
+
+/** @brief Copies values of all right hand sides from a neighboring block
+ * into one face of the halo.
+ *
+ * Same as blk_halo_face() in block.c, except that the interleaved arrays
+ * are copied. Constant neighbors are skipped, their ghost points are set
+ * once by mrhs_init().
+ *
+ * @param mrhs Pointer to the solver state.
+ * @param blk Pointer to the mesh block.
+ * @param u Interleaved values of \a blk.
+ * @param nb Pointer to the neighboring block or NULL.
+ * @param start Block coordinates of the first ghost point.
+ * @param off Offset between block coordinates in \a blk and \a nb.
+ * @param du Unit vector along the rows of the face.
+ * @param dv Unit vector along the columns of the face.
+ * @param nu Number of ghost points in a row.
+ * @param nv Number of rows.
+ * @param color Color of the ghost points to update. */
+static void mrhs_halo_face(struct mrhs *mrhs, struct block *blk, n_float *u,
+				struct block *nb, n_v3i start, n_v3i off,
+				n_v3i du, n_v3i dv, int nu, int nv, int color)
+{
+	n_float *src;
+	n_v3i pos;
+	size_t len;
+	int i, j, n;
+
+	if(nb==NULL) return;
+
+	n=mrhs->index[nb - mrhs->sp->blk];
+	if(n<0) return;
+
+	src=mrhs->u[n];
+	len=mrhs->stride * sizeof(*u);
+
+	for(j=0;j<nv;j++) {
+		pos=start;
+		start=v3i_add(start, dv);
+
+		for(i=0;i<nu;i++) {
+			if(((blk->pos.x + pos.x + blk->pos.y + pos.y +
+				blk->pos.z + pos.z) & 1) == color) {
+				memcpy(&u[blk_off3(blk, pos) * mrhs->stride],
+					&src[blk_off3(nb, v3i_add(pos, off)) *
+							mrhs->stride], len);
+			}
+
+			pos=v3i_add(pos, du);
+		}
+	}
+}
+
+/** @brief Refreshes ghost points of one color of all right hand sides
+ * from neighboring blocks.
+ *
+ * @param mrhs Pointer to the solver state.
+ * @param n Index of the block in \a var of the space struct.
+ * @param color Color of the ghost points to update. */
+static void mrhs_halo(struct mrhs *mrhs, int n, int color)
+{
+	struct block *blk;
+	n_float *u;
+	n_v3i s;
+
+	blk=mrhs->sp->var[n];
+	u=mrhs->u[n];
+	s=blk->size;
+
+	mrhs_halo_face(mrhs, blk, u, blk->xprev, v3i(-1, 0, 0),
+			v3i(blk->xprev ? blk->xprev->size.x : 0, 0, 0),
+			v3i_y, v3i_z, s.y, s.z, color);
+	mrhs_halo_face(mrhs, blk, u, blk->xnext, v3i(s.x, 0, 0),
+			v3i(-s.x, 0, 0), v3i_y, v3i_z, s.y, s.z, color);
+	mrhs_halo_face(mrhs, blk, u, blk->yprev, v3i(0, -1, 0),
+			v3i(0, blk->yprev ? blk->yprev->size.y : 0, 0),
+			v3i_x, v3i_z, s.x, s.z, color);
+	mrhs_halo_face(mrhs, blk, u, blk->ynext, v3i(0, s.y, 0),
+			v3i(0, -s.y, 0), v3i_x, v3i_z, s.x, s.z, color);
+	mrhs_halo_face(mrhs, blk, u, blk->zprev, v3i(0, 0, -1),
+			v3i(0, 0, blk->zprev ? blk->zprev->size.z : 0),
+			v3i_x, v3i_y, s.x, s.y, color);
+	mrhs_halo_face(mrhs, blk, u, blk->znext, v3i(0, 0, s.z),
+			v3i(0, 0, -s.z), v3i_x, v3i_y, s.x, s.y, color);
+}
+
+/** @brief Updates every other point of a run of variable points for all
+ * right hand sides.
+ *
+ * @param o Values of the first point to update.
+ * @param num Number of points to update.
+ * @param vnum Number of vectors per point.
+ * @param sy Distance between rows in vectors.
+ * @param sz Distance between planes in vectors.
+ * @param k Stencil coefficients of the first point to update (see 
+ * blk_coef_row()) or NULL if \a c is used.
+ * @param c Stencil weights for planes with uniform coefficients, already
+ * divided by the sum of weights (x, y, z).
+ * @param w SOR extrapolation parameter.
+ * @param acc Sums of squared residuals, one vector for each vector of a
+ * point. */
+static void mrhs_run(mrhs_vf *o, int num, int vnum, size_t sy, size_t sz,
+			n_float **k, n_float *c, mrhs_vf w, mrhs_vf *acc)
+{
+	mrhs_vf kx1, kx2, ky1, ky2, kz1, kz2, kd, r;
+	int x, i, j;
+
+	if(k==NULL) {
+		kx1=(mrhs_vf) {} + c[0];
+		ky1=(mrhs_vf) {} + c[1];
+		kz1=(mrhs_vf) {} + c[2];
+
+		for(x=0;x<num;x++) {
+			for(j=0;j<vnum;j++) {
+				r=kx1 * (o[j-vnum] + o[j+vnum]) +
+				  ky1 * (o[j-sy] + o[j+sy]) +
+				  kz1 * (o[j-sz] + o[j+sz]) - o[j];
+
+				o[j]+=w * r;
+				acc[j]+=r * r;
+			}
+
+			o+=2*vnum;
+		}
+
+		return;
+	}
+
+	for(x=0;x<num;x++) {
+		i=2*x;
+
+		kx1=(mrhs_vf) {} + k[BLK_K_X1][i];
+		kx2=(mrhs_vf) {} + k[BLK_K_X2][i];
+		ky1=(mrhs_vf) {} + k[BLK_K_Y1][i];
+		ky2=(mrhs_vf) {} + k[BLK_K_Y2][i];
+		kz1=(mrhs_vf) {} + k[BLK_K_Z1][i];
+		kz2=(mrhs_vf) {} + k[BLK_K_Z2][i];
+		kd=(mrhs_vf) {} + k[BLK_K_D][i];
+
+		for(j=0;j<vnum;j++) {
+			r=kx1 * o[j-vnum] + kx2 * o[j+vnum] +
+			  ky1 * o[j-sy] + ky2 * o[j+sy] +
+			  kz1 * o[j-sz] + kz2 * o[j+sz];
+
+			r=r * kd - o[j];
+
+			o[j]+=w * r;
+			acc[j]+=r * r;
+		}
+
+		o+=2*vnum;
+	}
+}
+
+/** @brief Work item for the thread pool: updates mesh points of one color
+ * in one variable mesh block for all right hand sides.
+ *
+ * Ghost points of the other color are refreshed first. Rows are split
+ * into runs of variable points (see \a span in struct block). */
+static void mrhs_pass(void *arg, int n)
+{
+	struct mrhs_pass *pass;
+	struct mrhs *mrhs;
+	struct block *blk;
+	n_float *k[BLK_K_NUM], *kp[BLK_K_NUM];
+	n_float c[3], *ck;
+	mrhs_vf *u, *acc, w;
+	unsigned short *span;
+	double *sum;
+
+	n_v3i pos;
+	size_t off, sy, sz;
+	int x0, start, j, r, r1, vnum, uniform;
+#ifdef __SSE__
+	unsigned int csr;
+
+	csr=_mm_getcsr();
+	_mm_setcsr(csr | MRHS_FTZ);
+#endif
+
+	pass=arg;
+	mrhs=pass->mrhs;
+
+	blk=mrhs->sp->var[n];
+	u=(mrhs_vf *) mrhs->u[n];
+	sum=&mrhs->sum[(size_t) n * mrhs->stride];
+	acc=(mrhs_vf *) &mrhs->acc[(size_t) n * mrhs->stride];
+
+	mrhs_halo(mrhs, n, !pass->color);
+
+	if(pass->color==0) {
+		for(j=0;j<mrhs->stride;j++) sum[j]=0.0;
+	}
+
+	/* distances between neighbors in vectors */
+	vnum=mrhs->stride / MRHS_WIDTH;
+	sy=(blk->size.x + 2) * vnum;
+	sz=sy * (blk->size.y + 2);
+
+	w=(mrhs_vf) {} + pass->omega;
+
+	c[0]=c[1]=c[2]=0.0;
+
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			pos.x=0;
+
+			off=blk_off3(blk, pos);
+			uniform=!blk_coef_row(blk, pos, k);
+
+			if(uniform) {
+				ck=blk->c_k[pos.z > 0];
+
+				c[0]=ck[BLK_K_X1] * ck[BLK_K_D];
+				c[1]=ck[BLK_K_Y1] * ck[BLK_K_D];
+				c[2]=ck[BLK_K_Z1] * ck[BLK_K_D];
+			}
+
+			for(j=0;j<vnum;j++) acc[j]=(mrhs_vf) {};
+
+			x0=(pass->color + blk->pos.x + blk->pos.y + pos.y +
+						blk->pos.z + pos.z) & 1;
+
+			r1=blk->spanrow[pos.z * blk->size.y + pos.y + 1];
+			for(r=blk->spanrow[pos.z * blk->size.y + pos.y];r<r1;r++) {
+				span=&blk->span[r * 2];
+
+				start=span[0] + ((span[0] ^ x0) & 1);
+				if(start>=span[1]) continue;
+
+				if(!uniform) {
+					for(j=0;j<BLK_K_NUM;j++) {
+						kp[j]=k[j] + start;
+					}
+				}
+
+				mrhs_run(u + (off + start) * vnum, 
+					(span[1] - start + 1) / 2, vnum, 
+					sy, sz, uniform ? NULL : kp, c, w, 
+					acc);
+			}
+
+			for(j=0;j<mrhs->stride;j++) {
+				sum[j]+=mrhs->acc[(size_t) n * mrhs->stride + j];
+			}
+		}
+	}
+
+#ifdef __SSE__
+	_mm_setcsr(csr);
+#endif
+}
+
+/** @brief Initializes the solver for a mesh.
+ *
+ * The mesh must be optimized (see sp_optimize()) and its constant points
+ * must tell the nets apart (see the description of this file). The
+ * values of all right hand sides start at zero in variable points.
+ *
+ * @param sp Pointer to the space struct.
+ * @param num Number of right hand sides (nets).
+ * @return Pointer to the solver state or NULL on error. */
+struct mrhs *mrhs_init(struct space *sp, int num)
+{
+	struct mrhs *mrhs;
+	struct block *blk;
+	size_t memsize, p;
+	int n, j, blknum;
+
+	assert(sp!=NULL);
+	assert(num>0);
+
+	mrhs=n_calloc(1, sizeof(*mrhs));
+	if(mrhs==NULL) return NULL;
+
+	mrhs->sp=sp;
+	mrhs->num=num;
+	mrhs->stride=(num + MRHS_WIDTH - 1) / MRHS_WIDTH * MRHS_WIDTH;
+
+	blknum=mrhs_blocks(sp);
+
+	mrhs->u=n_calloc(sp->varnum + 1, sizeof(*mrhs->u));
+	mrhs->index=n_calloc(blknum, sizeof(*mrhs->index));
+	mrhs->code=n_calloc(blknum, sizeof(*mrhs->code));
+	mrhs->sum=n_calloc((size_t) (sp->varnum + 1) * mrhs->stride,
+						sizeof(*mrhs->sum));
+	mrhs->acc=n_calloc((size_t) (sp->varnum + 1) * mrhs->stride,
+						sizeof(*mrhs->acc));
+	mrhs->resid=n_calloc(num, sizeof(*mrhs->resid));
+	mrhs->resid_first=n_calloc(num, sizeof(*mrhs->resid_first));
+
+	if(mrhs->u==NULL || mrhs->index==NULL || mrhs->code==NULL ||
+			mrhs->sum==NULL || mrhs->acc==NULL || 
+			mrhs->resid==NULL ||
+			mrhs->resid_first==NULL) {
+		mrhs_done(mrhs);
+		return NULL;
+	}
+
+	for(n=0;n<blknum;n++) {
+		mrhs->index[n]=-1;
+		mrhs->code[n]=sp->blk[n].c_n;
+	}
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		mrhs->index[blk - sp->blk]=n;
+
+		memsize=(size_t) (blk->size.x + 2) * (blk->size.y + 2) *
+							(blk->size.z + 2);
+
+		mrhs->u[n]=n_calloc(memsize * mrhs->stride, 
+							sizeof(**mrhs->u));
+		if(mrhs->u[n]==NULL) {
+			mrhs_done(mrhs);
+			return NULL;
+		}
+
+		/* ghost points next to constant blocks never change */
+		blk_halo_update(blk, -1);
+
+		for(p=0;p<memsize;p++) {
+			for(j=0;j<num;j++) {
+				mrhs->u[n][p * mrhs->stride + j]=
+					(blk->n[p] == j + 1) ? 1.0 : 0.0;
+			}
+		}
+	}
+
+	if(a_soromega_auto) {
+		warning("Automatic SOR omega is not supported with multiple "
+			"right hand sides, using %.2f", a_soromega);
+	}
+
+	return mrhs;
+}
+
+/** @brief Frees the solver state.
+ *
+ * @param mrhs Pointer to the solver state. */
+void mrhs_done(struct mrhs *mrhs)
+{
+	int n;
+
+	if(mrhs==NULL) return;
+
+	if(mrhs->u!=NULL) {
+		for(n=0;n<mrhs->sp->varnum;n++) {
+			if(mrhs->u[n]!=NULL) n_free(mrhs->u[n]);
+		}
+		n_free(mrhs->u);
+	}
+
+	if(mrhs->index!=NULL) n_free(mrhs->index);
+	if(mrhs->code!=NULL) n_free(mrhs->code);
+	if(mrhs->sum!=NULL) n_free(mrhs->sum);
+	if(mrhs->acc!=NULL) n_free(mrhs->acc);
+	if(mrhs->resid!=NULL) n_free(mrhs->resid);
+	if(mrhs->resid_first!=NULL) n_free(mrhs->resid_first);
+
+	n_free(mrhs);
+}
+
+/** @brief Performs a single red-black SOR sweep for all right hand sides.
+ *
+ * With a_soromega larger than 1 the extrapolation parameter follows the
+ * same Chebyshev schedule as in sor_iterate().
+ *
+ * @param mrhs Pointer to the solver state. */
+void mrhs_iterate(struct mrhs *mrhs)
+{
+	struct mrhs_pass pass;
+	struct space *sp;
+	double rho2;
+	int n, j;
+
+	sp=mrhs->sp;
+
+	rho2=0.0;
+	if(a_soromega>1.0) {
+		rho2=1.0-(2.0/a_soromega-1.0)*(2.0/a_soromega-1.0);
+	}
+
+	pass.mrhs=mrhs;
+
+	for(pass.color=0;pass.color<2;pass.color++) {
+		if(a_soromega>1.0) {
+			mrhs->cheb=sor_cheb_next(rho2, mrhs->cheb);
+			pass.omega=mrhs->cheb;
+		} else {
+			pass.omega=a_soromega;
+		}
+
+		pool_run(sp->pool, mrhs_pass, &pass, sp->varnum);
+	}
+
+	for(j=0;j<mrhs->num;j++) mrhs->resid[j]=0.0;
+
+	for(n=0;n<sp->varnum;n++) {
+		for(j=0;j<mrhs->num;j++) {
+			mrhs->resid[j]+=mrhs->sum[(size_t) n * mrhs->stride + 
+									j];
+		}
+	}
+
+	for(j=0;j<mrhs->num;j++) {
+		if(mrhs->resid_first[j]<=0.0) {
+			mrhs->resid_first[j]=mrhs->resid[j];
+		}
+	}
+}
+
+/** @brief Largest residual norm of all right hand sides, each relative to
+ * its residual after the first sweep.
+ *
+ * @param mrhs Pointer to the solver state.
+ * @return Relative residual norm. */
+n_float mrhs_residual(struct mrhs *mrhs)
+{
+	double r, max;
+	int j;
+
+	max=0.0;
+	for(j=0;j<mrhs->num;j++) {
+		if(mrhs->resid_first[j]<=0.0) continue;
+
+		r=mrhs->resid[j]/mrhs->resid_first[j];
+		if(r>max) max=r;
+	}
+
+	return sqrt(max);
+}
+
+/** @brief Copies the solution for one right hand side into the mesh
+ * point values, so that it can be used like the result of any other
+ * solver (for example by face_flow_sum()).
+ *
+ * @param mrhs Pointer to the solver state.
+ * @param i Index of the right hand side (net). */
+void mrhs_extract(struct mrhs *mrhs, int i)
+{
+	struct space *sp;
+	struct block *blk;
+	size_t memsize, p;
+	int n, blknum;
+
+	assert(i>=0 && i<mrhs->num);
+
+	sp=mrhs->sp;
+
+	blknum=mrhs_blocks(sp);
+	for(n=0;n<blknum;n++) {
+		if(mrhs->index[n]<0) {
+			sp->blk[n].c_n=(mrhs->code[n] == i + 1) ? 1.0 : 0.0;
+		}
+	}
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		memsize=(size_t) (blk->size.x + 2) * (blk->size.y + 2) *
+							(blk->size.z + 2);
+
+		for(p=0;p<memsize;p++) {
+			blk->n[p]=mrhs->u[n][p * mrhs->stride + i];
+		}
+	}
+}
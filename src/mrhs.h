@@ -0,0 +1,22 @@
+/**
+ * @file src/mrhs.h
+ *
+ * @brief SOR solver for multiple right hand sides, header.
+ */
+
+#ifndef _MRHS_H
+#define _MRHS_H
+
+#include "struct.h"
+
+struct mrhs;
+
+struct mrhs *mrhs_init(struct space *sp, int num);
+void mrhs_done(struct mrhs *mrhs);
+
+void mrhs_iterate(struct mrhs *mrhs);
+n_float mrhs_residual(struct mrhs *mrhs);
+
+void mrhs_extract(struct mrhs *mrhs, int i);
+
+#endif
@@ -0,0 +1,1088 @@
+/**
+ * @file src/multigrid.c
+ *
+ * @brief Geometric multigrid solver, code.
+ *
+ * Level 0 is the finite difference mesh itself (struct space). Coarser
+ * levels are stored as dense three-dimensional arrays. Point (i,j,k) of a
+ * coarse level lies at the position of point (f.x*i, f.y*j, f.z*k) of the
+ * next finer level, where f is the coarsening factor (1 or 2) for each axis.
+ * Axes with MG_MIN_SIZE points or less are no longer coarsened, so that a
+ * thin stack of layers is only coarsened in x and y direction.
+ *
+ * Materials of coarse cells are averages of the finer cells they cover and
+ * constant points are taken from the finer level (see mg_level_con()).
+ * Stencil coefficients of coarse levels are then calculated from these
+ * materials in the same way as on level 0 (see blk_coef_build()).
+ * Coarse points that fall outside of the finer level are constant.
+ *
+ * Residuals are restricted with full weighting (transpose of the trilinear
+ * interpolation) and corrections are prolongated with trilinear
+ * interpolation. Red-black Gauss-Seidel sweeps are used as the smoother on
+ * all levels. On level 0 this is sor_sweep() with omega equal to 1.
+ *
+ * Each level runs through the thread pool of the space. Dense levels are
+ * split into rows along the x axis. Level 0 is split into mesh blocks.
+ */
+
+#include <string.h>
+
+#include "assert.h"
+#include "error.h"
+#include "block.h"
+#include "space.h"
+#include "sor.h"
+#include "pool.h"
+#include "malloc.h"
+#include "multigrid.h"
+
+/** @brief Axes with this number of points or less are not coarsened. */
+#define MG_MIN_SIZE		5
+
+/** @brief Maximum number of levels, including level 0. */
+#define MG_MAX_LEVELS		24
+
+/** @brief Number of smoothing sweeps before and after the coarse grid
+ * correction. */
+#define MG_SMOOTH		2
+
+/** @brief Number of smoothing sweeps on the coarsest level. */
+#define MG_COARSE_SWEEPS	50
+
+/** @brief Work array in mesh blocks that holds the residual on level 0. */
+#define MG_VEC_R		0
+
+/** @brief Index of a mesh point in the arrays of a dense level. */
+#define MG_OFF(_l_, _x_, _y_, _z_)	((((_z_) * (_l_)->size.y) + (_y_)) * \
+						(_l_)->size.x + (_x_))
+
+/** @brief Index of a cell in the material array of a dense level. */
+#define MG_OFFA(_l_, _x_, _y_, _z_)	((((_z_) * ((_l_)->size.y - 1)) + \
+				(_y_)) * ((_l_)->size.x - 1) + (_x_))
+
+/** @brief One level of the multigrid hierarchy. */
+struct mg_level {
+	/** @brief Number of mesh points in the X, Y and Z direction. */
+	n_v3i size;
+
+	/** @brief Coarsening factor relative to the next finer level. */
+	n_v3i f;
+
+	/** @brief Physical distance between mesh points. */
+	n_v3f step;
+
+	/** @brief Solution (or correction) in each mesh point. */
+	n_float *u;
+
+	/** @brief Right hand side (restricted residual of the finer
+	 * level). */
+	n_float *rhs;
+
+	/** @brief Residual. */
+	n_float *r;
+
+	/** @brief Constant point flags. */
+	char *con;
+
+	/** @brief Stencil coefficients (see BLK_K_X1 ... BLK_K_D). Zero for
+	 * constant points. */
+	n_float *k[BLK_K_NUM];
+
+	/** @brief Material property of each cell. Only used while the
+	 * hierarchy is built.
+	 *
+	 * Size: (size.x - 1) * (size.y - 1) * (size.z - 1) */
+	n_float *a;
+};
+
+/** @brief Multigrid solver state for one finite difference mesh. */
+struct mg {
+	/** @brief Pointer to the finite difference mesh (level 0). */
+	struct space *sp;
+
+	/** @brief Levels. Only size, factor and step are used for level 0. */
+	struct mg_level lev[MG_MAX_LEVELS];
+
+	/** @brief Number of levels, including level 0. */
+	int levnum;
+};
+
+/** @brief Arguments for work items passed to the thread pool. */
+struct mg_pass {
+	struct mg *mg;
+
+	/** @brief Level. */
+	int l;
+
+	/** @brief Color of the mesh points to update (smoothing). */
+	int color;
+
+	/** @brief Add the correction to the finer level instead of
+	 * replacing its values (prolongation). */
+	int add;
+};
+
+/** @brief Number of rows of interior points on a dense level. */
+static int mg_rows(struct mg_level *c)
+{
+	if((c->size.y < 3) || (c->size.z < 3)) return 0;
+
+	return (c->size.y - 2) * (c->size.z - 2);
+}
+
+/** @brief Position of a row of interior points on a dense level.
+ *
+ * @param c Pointer to the level.
+ * @param n Index of the row (0 ... mg_rows(c)-1).
+ * @param y Set to the y coordinate of the row.
+ * @param z Set to the z coordinate of the row. */
+static void mg_row(struct mg_level *c, int n, int *y, int *z)
+{
+	*y = 1 + n % (c->size.y - 2);
+	*z = 1 + n / (c->size.y - 2);
+}
+
+/** @brief Interpolation weights along one axis.
+ *
+ * @param x Coordinate on the finer level.
+ * @param f Coarsening factor.
+ * @param i Set to coordinates on the coarser level.
+ * @param w Set to weights.
+ * @return Number of coarse points used. */
+static int mg_interp_axis(int x, int f, int *i, n_float *w)
+{
+	if(f == 1) {
+		i[0] = x;
+		w[0] = 1.0;
+		return 1;
+	}
+
+	if(x % 2 == 0) {
+		i[0] = x / 2;
+		w[0] = 1.0;
+		return 1;
+	}
+
+	i[0] = (x - 1) / 2;
+	i[1] = (x + 1) / 2;
+	w[0] = 0.5;
+	w[1] = 0.5;
+
+	return 2;
+}
+
+/** @brief Restriction weights along one axis.
+ *
+ * @param f Coarsening factor.
+ * @param d Set to offsets on the finer level.
+ * @param w Set to weights.
+ * @return Number of fine points used. */
+static int mg_restrict_axis(int f, int *d, n_float *w)
+{
+	if(f == 1) {
+		d[0] = 0;
+		w[0] = 1.0;
+		return 1;
+	}
+
+	d[0] = -1;
+	d[1] = 0;
+	d[2] = 1;
+	w[0] = 0.5;
+	w[1] = 1.0;
+	w[2] = 0.5;
+
+	return 3;
+}
+
+/** @brief Interpolates the solution of a dense level.
+ *
+ * @param c Pointer to the coarse level.
+ * @param s Position on the next finer level.
+ * @return Interpolated value. */
+static n_float mg_interp(struct mg_level *c, n_v3i s)
+{
+	int ix[2], iy[2], iz[2];
+	n_float wx[2], wy[2], wz[2];
+	int nx, ny, nz, a, b, d;
+	n_float e;
+
+	nx = mg_interp_axis(s.x, c->f.x, ix, wx);
+	ny = mg_interp_axis(s.y, c->f.y, iy, wy);
+	nz = mg_interp_axis(s.z, c->f.z, iz, wz);
+
+	e = 0.0;
+	for(d = 0; d < nz; d++) {
+		for(b = 0; b < ny; b++) {
+			for(a = 0; a < nx; a++) {
+				e += wx[a] * wy[b] * wz[d] *
+					c->u[MG_OFF(c, ix[a], iy[b], iz[d])];
+			}
+		}
+	}
+
+	return e;
+}
+
+/** @brief Allocates arrays of a dense level.
+ *
+ * @param c Pointer to the level.
+ * @return 0 on success and -1 on error. */
+static int mg_level_alloc(struct mg_level *c)
+{
+	size_t np, na;
+	int n;
+
+	np = c->size.x * c->size.y * c->size.z;
+	na = (c->size.x - 1) * (c->size.y - 1) * (c->size.z - 1);
+
+	c->u = n_calloc(np, sizeof(*c->u));
+	if(c->u == NULL) return -1;
+
+	c->rhs = n_calloc(np, sizeof(*c->rhs));
+	if(c->rhs == NULL) return -1;
+
+	c->r = n_calloc(np, sizeof(*c->r));
+	if(c->r == NULL) return -1;
+
+	c->con = n_calloc(np, sizeof(*c->con));
+	if(c->con == NULL) return -1;
+
+	for(n = 0; n < BLK_K_NUM; n++) {
+		c->k[n] = n_calloc(np, sizeof(*c->k[n]));
+		if(c->k[n] == NULL) return -1;
+	}
+
+	c->a = n_calloc(na, sizeof(*c->a));
+	if(c->a == NULL) return -1;
+
+	return 0;
+}
+
+/** @brief Frees arrays of a dense level.
+ *
+ * @param c Pointer to the level. */
+static void mg_level_free(struct mg_level *c)
+{
+	int n;
+
+	if(c->u != NULL) n_free(c->u);
+	if(c->rhs != NULL) n_free(c->rhs);
+	if(c->r != NULL) n_free(c->r);
+	if(c->con != NULL) n_free(c->con);
+	if(c->a != NULL) n_free(c->a);
+
+	for(n = 0; n < BLK_K_NUM; n++) {
+		if(c->k[n] != NULL) n_free(c->k[n]);
+	}
+
+	memset(c, 0, sizeof(*c));
+}
+
+/** @brief Material property of a cell on level \a l.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level.
+ * @param pos Position of the cell. */
+static n_float mg_cell_a(struct mg *mg, int l, n_v3i pos)
+{
+	struct mg_level *c;
+
+	if(l == 0) {
+		return sp_a_get(mg->sp, v3i_add(pos, mg->sp->pos));
+	}
+
+	c = &mg->lev[l];
+
+	return c->a[MG_OFFA(c, pos.x, pos.y, pos.z)];
+}
+
+/** @brief Calculates materials of a dense level by averaging the cells of
+ * the next finer level.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level. */
+static void mg_level_materials(struct mg *mg, int l)
+{
+	struct mg_level *c, *p;
+	n_v3i pos, d, fpos;
+	n_float s;
+	int n;
+
+	c = &mg->lev[l];
+	p = &mg->lev[l - 1];
+
+	for(pos.z = 0; pos.z < c->size.z - 1; pos.z++) {
+	for(pos.y = 0; pos.y < c->size.y - 1; pos.y++) {
+	for(pos.x = 0; pos.x < c->size.x - 1; pos.x++) {
+		s = 0.0;
+		n = 0;
+
+		for(d.z = 0; d.z < c->f.z; d.z++) {
+		for(d.y = 0; d.y < c->f.y; d.y++) {
+		for(d.x = 0; d.x < c->f.x; d.x++) {
+			fpos.x = pos.x * c->f.x + d.x;
+			fpos.y = pos.y * c->f.y + d.y;
+			fpos.z = pos.z * c->f.z + d.z;
+
+			/* coarse cells at the edge can reach out of the
+			 * finer level */
+
+			if(fpos.x > p->size.x - 2) fpos.x = p->size.x - 2;
+			if(fpos.y > p->size.y - 2) fpos.y = p->size.y - 2;
+			if(fpos.z > p->size.z - 2) fpos.z = p->size.z - 2;
+
+			s += mg_cell_a(mg, l - 1, fpos);
+			n++;
+		}
+		}
+		}
+
+		c->a[MG_OFFA(c, pos.x, pos.y, pos.z)] = s / n;
+	}
+	}
+	}
+}
+
+/** @brief Constant point flag of a point on level \a l.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level.
+ * @param pos Position of the point. Positions outside of the level are
+ * constant. */
+static int mg_point_con(struct mg *mg, int l, n_v3i pos)
+{
+	struct mg_level *c;
+
+	c = &mg->lev[l];
+
+	if((pos.x < 0) || (pos.x >= c->size.x) ||
+	   (pos.y < 0) || (pos.y >= c->size.y) ||
+	   (pos.z < 0) || (pos.z >= c->size.z)) return 1;
+
+	if(l == 0) return sp_con_get(mg->sp, v3i_add(pos, mg->sp->pos));
+
+	return c->con[MG_OFF(c, pos.x, pos.y, pos.z)];
+}
+
+/** @brief Finds a constant point of the finer level that makes a point of
+ * level \a l constant.
+ *
+ * A coarse point is constant if the point of the finer level at the same
+ * position is constant (injection). Along each coarsened axis it is also 
+ * constant if one of the two finer points next to it along that axis is.
+ * Copper is often only a few mesh points thick and would otherwise 
+ * disappear from coarse levels when it falls between two coarse points. 
+ * The coarse correction then doesn't see the conductor and the cycle 
+ * diverges (for example between two plates a few points apart, once the
+ * standoff puts them at odd positions). 
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level.
+ * @param pos Position of the point on level \a l.
+ * @param fpos Set to the position of the constant point on level 
+ * \a l - 1. 
+ * @return 1 if a constant point was found or 0 if not. */
+static int mg_con_find(struct mg *mg, int l, n_v3i pos, n_v3i *fpos)
+{
+	struct mg_level *c;
+	n_v3i base, d;
+
+	c = &mg->lev[l];
+
+	base.x = pos.x * c->f.x;
+	base.y = pos.y * c->f.y;
+	base.z = pos.z * c->f.z;
+
+	if(mg_point_con(mg, l - 1, base)) {
+		*fpos = base;
+		return 1;
+	}
+
+	for(d.z = 1 - c->f.z; d.z < c->f.z; d.z++) {
+	for(d.y = 1 - c->f.y; d.y < c->f.y; d.y++) {
+	for(d.x = 1 - c->f.x; d.x < c->f.x; d.x++) {
+		/* only neighbors along one axis, diagonal ones would widen
+		 * conductors even more */
+		if((d.x != 0) + (d.y != 0) + (d.z != 0) > 1) continue;
+
+		*fpos = v3i_add(base, d);
+
+		/* points outside of the finer level only count at the 
+		 * same position */
+		if((fpos->x < 0) || (fpos->x >= mg->lev[l - 1].size.x) ||
+		   (fpos->y < 0) || (fpos->y >= mg->lev[l - 1].size.y) ||
+		   (fpos->z < 0) || (fpos->z >= mg->lev[l - 1].size.z)) {
+			continue;
+		}
+
+		if(mg_point_con(mg, l - 1, *fpos)) return 1;
+	}
+	}
+	}
+
+	return 0;
+}
+
+/** @brief Sets constant point flags of a dense level (see mg_con_find()).
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level. */
+static void mg_level_con(struct mg *mg, int l)
+{
+	struct mg_level *c;
+	n_v3i pos, fpos;
+	int con;
+
+	c = &mg->lev[l];
+
+	for(pos.z = 0; pos.z < c->size.z; pos.z++) {
+	for(pos.y = 0; pos.y < c->size.y; pos.y++) {
+	for(pos.x = 0; pos.x < c->size.x; pos.x++) {
+		con = (pos.x == 0) || (pos.x == c->size.x - 1) ||
+		      (pos.y == 0) || (pos.y == c->size.y - 1) ||
+		      (pos.z == 0) || (pos.z == c->size.z - 1);
+
+		if(!con) con = mg_con_find(mg, l, pos, &fpos);
+
+		c->con[MG_OFF(c, pos.x, pos.y, pos.z)] = con;
+	}
+	}
+	}
+}
+
+/** @brief Calculates stencil coefficients of a dense level.
+ *
+ * @param c Pointer to the level. */
+static void mg_level_coef(struct mg_level *c)
+{
+	n_float ex1y1z1, ex1y2z1, ex2y1z1, ex2y2z1;
+	n_float ex1y1z2, ex1y2z2, ex2y1z2, ex2y2z2;
+	n_float ax, ay, az;
+	n_float **k;
+
+	int x, y, z;
+	size_t i;
+
+	k = c->k;
+
+	ax = c->step.z * c->step.y / 4 / c->step.x;
+	ay = c->step.z * c->step.x / 4 / c->step.y;
+	az = c->step.x * c->step.y / 4 / c->step.z;
+
+	for(z = 1; z < c->size.z - 1; z++) {
+	for(y = 1; y < c->size.y - 1; y++) {
+	for(x = 1; x < c->size.x - 1; x++) {
+		i = MG_OFF(c, x, y, z);
+
+		if(c->con[i]) continue;
+
+		ex1y1z1 = c->a[MG_OFFA(c, x - 1, y - 1, z - 1)];
+		ex1y2z1 = c->a[MG_OFFA(c, x - 1, y, z - 1)];
+		ex2y1z1 = c->a[MG_OFFA(c, x, y - 1, z - 1)];
+		ex2y2z1 = c->a[MG_OFFA(c, x, y, z - 1)];
+
+		ex1y1z2 = c->a[MG_OFFA(c, x - 1, y - 1, z)];
+		ex1y2z2 = c->a[MG_OFFA(c, x - 1, y, z)];
+		ex2y1z2 = c->a[MG_OFFA(c, x, y - 1, z)];
+		ex2y2z2 = c->a[MG_OFFA(c, x, y, z)];
+
+		k[BLK_K_X1][i] = (ex1y1z1 + ex1y1z2 + ex1y2z1 + ex1y2z2) * ax;
+		k[BLK_K_X2][i] = (ex2y1z1 + ex2y1z2 + ex2y2z1 + ex2y2z2) * ax;
+
+		k[BLK_K_Y1][i] = (ex1y1z1 + ex1y1z2 + ex2y1z1 + ex2y1z2) * ay;
+		k[BLK_K_Y2][i] = (ex1y2z1 + ex1y2z2 + ex2y2z1 + ex2y2z2) * ay;
+
+		k[BLK_K_Z1][i] = (ex1y1z1 + ex1y2z1 + ex2y1z1 + ex2y2z1) * az;
+		k[BLK_K_Z2][i] = (ex1y1z2 + ex1y2z2 + ex2y1z2 + ex2y2z2) * az;
+
+		k[BLK_K_D][i] = 1 / (k[BLK_K_X1][i] + k[BLK_K_X2][i] +
+					k[BLK_K_Y1][i] + k[BLK_K_Y2][i] +
+					k[BLK_K_Z1][i] + k[BLK_K_Z2][i]);
+	}
+	}
+	}
+}
+
+/** @brief Work item: red-black Gauss-Seidel on one row of a dense level. */
+static void mg_smooth_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct mg_level *c;
+	n_float **k;
+	n_float *u;
+	size_t i, sx, sxy;
+	int x, y, z;
+
+	pass = arg;
+	c = &pass->mg->lev[pass->l];
+
+	k = c->k;
+	u = c->u;
+
+	sx = c->size.x;
+	sxy = c->size.x * c->size.y;
+
+	mg_row(c, n, &y, &z);
+
+	x = 1;
+	if(((x + y + z) & 1) != pass->color) x++;
+
+	for(; x < c->size.x - 1; x += 2) {
+		i = MG_OFF(c, x, y, z);
+
+		if(c->con[i]) continue;
+
+		u[i] = (c->rhs[i] +
+			k[BLK_K_X1][i] * u[i - 1] + k[BLK_K_X2][i] * u[i + 1] +
+			k[BLK_K_Y1][i] * u[i - sx] + k[BLK_K_Y2][i] * u[i + sx] +
+			k[BLK_K_Z1][i] * u[i - sxy] + k[BLK_K_Z2][i] * u[i + sxy]
+			) * k[BLK_K_D][i];
+	}
+}
+
+/** @brief Work item: residual of one row of a dense level. */
+static void mg_residual_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct mg_level *c;
+	n_float **k;
+	n_float *u;
+	n_float s, ks;
+	size_t i, sx, sxy;
+	int x, y, z;
+
+	pass = arg;
+	c = &pass->mg->lev[pass->l];
+
+	k = c->k;
+	u = c->u;
+
+	sx = c->size.x;
+	sxy = c->size.x * c->size.y;
+
+	mg_row(c, n, &y, &z);
+
+	for(x = 1; x < c->size.x - 1; x++) {
+		i = MG_OFF(c, x, y, z);
+
+		if(c->con[i]) {
+			c->r[i] = 0.0;
+			continue;
+		}
+
+		s = c->rhs[i] +
+			k[BLK_K_X1][i] * u[i - 1] + k[BLK_K_X2][i] * u[i + 1] +
+			k[BLK_K_Y1][i] * u[i - sx] + k[BLK_K_Y2][i] * u[i + sx] +
+			k[BLK_K_Z1][i] * u[i - sxy] + k[BLK_K_Z2][i] * u[i + sxy];
+
+		ks = k[BLK_K_X1][i] + k[BLK_K_X2][i] + k[BLK_K_Y1][i] +
+			k[BLK_K_Y2][i] + k[BLK_K_Z1][i] + k[BLK_K_Z2][i];
+
+		c->r[i] = s - ks * u[i];
+	}
+}
+
+/** @brief Work item: restriction of the residual into one row of a dense
+ * level from the next finer dense level. */
+static void mg_restrict_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct mg_level *c, *p;
+	int dx[3], dy[3], dz[3];
+	n_float wx[3], wy[3], wz[3];
+	int nx, ny, nz, a, b, d;
+	n_float s;
+	size_t i;
+	int x, y, z;
+
+	pass = arg;
+	c = &pass->mg->lev[pass->l];
+	p = &pass->mg->lev[pass->l - 1];
+
+	nx = mg_restrict_axis(c->f.x, dx, wx);
+	ny = mg_restrict_axis(c->f.y, dy, wy);
+	nz = mg_restrict_axis(c->f.z, dz, wz);
+
+	mg_row(c, n, &y, &z);
+
+	for(x = 1; x < c->size.x - 1; x++) {
+		i = MG_OFF(c, x, y, z);
+
+		if(c->con[i]) continue;
+
+		s = 0.0;
+		for(d = 0; d < nz; d++) {
+			for(b = 0; b < ny; b++) {
+				for(a = 0; a < nx; a++) {
+					s += wx[a] * wy[b] * wz[d] * p->r[MG_OFF(p,
+						x * c->f.x + dx[a],
+						y * c->f.y + dy[b],
+						z * c->f.z + dz[d])];
+				}
+			}
+		}
+
+		c->rhs[i] = s;
+	}
+}
+
+/** @brief Work item: prolongation from a dense level into one row of the
+ * next finer dense level. */
+static void mg_prolong_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct mg_level *c, *p;
+	n_float e;
+	size_t i;
+	int x, y, z;
+
+	pass = arg;
+	c = &pass->mg->lev[pass->l];
+	p = &pass->mg->lev[pass->l - 1];
+
+	mg_row(p, n, &y, &z);
+
+	for(x = 1; x < p->size.x - 1; x++) {
+		i = MG_OFF(p, x, y, z);
+
+		if(p->con[i]) continue;
+
+		e = mg_interp(c, v3i(x, y, z));
+
+		if(pass->add) {
+			p->u[i] += e;
+		} else {
+			p->u[i] = e;
+		}
+	}
+}
+
+/** @brief Work item: residual of one mesh block on level 0. */
+static void mg_residual0_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct block *blk;
+
+	pass = arg;
+	blk = pass->mg->sp->var[n];
+
+	blk_halo_update(blk, -1);
+	blk_stencil(blk, -1, MG_VEC_R, -1.0);
+}
+
+/** @brief Work item: restriction of the residual of one mesh block into
+ * level 1.
+ *
+ * Each point of level 1 is restricted by the block that contains the
+ * level 0 point at the same position. */
+static void mg_restrict0_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct space *sp;
+	struct block *blk;
+	struct mg_level *c;
+
+	int dx[3], dy[3], dz[3];
+	n_float wx[3], wy[3], wz[3];
+	int nx, ny, nz, a, b, d;
+
+	n_v3i base, lo, hi, pos, fpos;
+	n_float s;
+	size_t i;
+
+	pass = arg;
+	sp = pass->mg->sp;
+	blk = sp->var[n];
+	c = &pass->mg->lev[1];
+
+	blk_halo_update_vec(blk, MG_VEC_R, -1);
+
+	nx = mg_restrict_axis(c->f.x, dx, wx);
+	ny = mg_restrict_axis(c->f.y, dy, wy);
+	nz = mg_restrict_axis(c->f.z, dz, wz);
+
+	/* position of the block in space coordinates and range of level 1
+	 * points that fall into it (blocks can reach out of the space) */
+
+	base = v3i_sub(blk->pos, sp->pos);
+
+	lo.x = (base.x + c->f.x - 1) / c->f.x;
+	lo.y = (base.y + c->f.y - 1) / c->f.y;
+	lo.z = (base.z + c->f.z - 1) / c->f.z;
+
+	hi.x = base.x + blk->size.x - 1;
+	hi.y = base.y + blk->size.y - 1;
+	hi.z = base.z + blk->size.z - 1;
+
+	if(hi.x > sp->size.x - 1) hi.x = sp->size.x - 1;
+	if(hi.y > sp->size.y - 1) hi.y = sp->size.y - 1;
+	if(hi.z > sp->size.z - 1) hi.z = sp->size.z - 1;
+
+	hi.x /= c->f.x;
+	hi.y /= c->f.y;
+	hi.z /= c->f.z;
+
+	for(pos.z = lo.z; pos.z <= hi.z; pos.z++) {
+	for(pos.y = lo.y; pos.y <= hi.y; pos.y++) {
+	for(pos.x = lo.x; pos.x <= hi.x; pos.x++) {
+		i = MG_OFF(c, pos.x, pos.y, pos.z);
+
+		if(c->con[i]) continue;
+
+		fpos.x = pos.x * c->f.x - base.x;
+		fpos.y = pos.y * c->f.y - base.y;
+		fpos.z = pos.z * c->f.z - base.z;
+
+		s = 0.0;
+		for(d = 0; d < nz; d++) {
+			for(b = 0; b < ny; b++) {
+				for(a = 0; a < nx; a++) {
+					s += wx[a] * wy[b] * wz[d] *
+						BLK_V(blk, MG_VEC_R, v3i_add(
+						fpos, v3i(dx[a], dy[b], dz[d])));
+				}
+			}
+		}
+
+		c->rhs[i] = s;
+	}
+	}
+	}
+}
+
+/** @brief Work item: prolongation from level 1 into one mesh block. */
+static void mg_prolong0_pass(void *arg, int n)
+{
+	struct mg_pass *pass;
+	struct space *sp;
+	struct block *blk;
+	struct mg_level *c;
+
+	n_float *o;
+
+	n_v3i base, pos;
+	n_float e;
+	size_t off;
+	int x;
+
+	pass = arg;
+	sp = pass->mg->sp;
+	blk = sp->var[n];
+	c = &pass->mg->lev[1];
+
+	base = v3i_sub(blk->pos, sp->pos);
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			o = &BLK_N(blk, pos);
+			off = blk_off3(blk, pos);
+
+			for(x = 0; x < blk->size.x; x++) {
+				if(BLK_CON_OFF(blk, off + x)) continue;
+
+				e = mg_interp(c, v3i(base.x + x,
+							base.y + pos.y,
+							base.z + pos.z));
+
+				if(pass->add) {
+					o[x] += e;
+				} else {
+					o[x] = e;
+				}
+			}
+		}
+	}
+}
+
+/** @brief Red-black Gauss-Seidel sweeps on one level.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level.
+ * @param sweeps Number of sweeps. */
+static void mg_smooth(struct mg *mg, int l, int sweeps)
+{
+	struct mg_pass pass;
+	int n;
+
+	if(l == 0) {
+		for(n = 0; n < sweeps; n++) sor_sweep(mg->sp, 1.0);
+		return;
+	}
+
+	pass.mg = mg;
+	pass.l = l;
+
+	for(n = 0; n < sweeps; n++) {
+		for(pass.color = 0; pass.color < 2; pass.color++) {
+			pool_run(mg->sp->pool, mg_smooth_pass, &pass,
+							mg_rows(&mg->lev[l]));
+		}
+	}
+}
+
+/** @brief Calculates the residual on level \a l - 1 and restricts it into
+ * the right hand side of level \a l. The solution on level \a l is set to
+ * zero.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Coarse level. */
+static void mg_restrict(struct mg *mg, int l)
+{
+	struct mg_pass pass;
+	struct mg_level *c;
+	size_t np;
+
+	c = &mg->lev[l];
+
+	np = c->size.x * c->size.y * c->size.z;
+
+	memset(c->u, 0, np * sizeof(*c->u));
+	memset(c->rhs, 0, np * sizeof(*c->rhs));
+
+	pass.mg = mg;
+
+	if(l == 1) {
+		pool_run(mg->sp->pool, mg_residual0_pass, &pass,
+							mg->sp->varnum);
+		pool_run(mg->sp->pool, mg_restrict0_pass, &pass,
+							mg->sp->varnum);
+	} else {
+		pass.l = l - 1;
+		pool_run(mg->sp->pool, mg_residual_pass, &pass,
+						mg_rows(&mg->lev[l - 1]));
+
+		pass.l = l;
+		pool_run(mg->sp->pool, mg_restrict_pass, &pass,
+							mg_rows(c));
+	}
+}
+
+/** @brief Interpolates the solution on level \a l into level \a l - 1.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Coarse level.
+ * @param add If 1, the interpolated values are added to the variable points
+ * of the finer level (coarse grid correction). If 0 they replace them. */
+static void mg_prolong(struct mg *mg, int l, int add)
+{
+	struct mg_pass pass;
+
+	pass.mg = mg;
+	pass.l = l;
+	pass.add = add;
+
+	if(l == 1) {
+		pool_run(mg->sp->pool, mg_prolong0_pass, &pass,
+							mg->sp->varnum);
+	} else {
+		pool_run(mg->sp->pool, mg_prolong_pass, &pass,
+						mg_rows(&mg->lev[l - 1]));
+	}
+}
+
+/** @brief One V-cycle starting at level \a l.
+ *
+ * @param mg Pointer to the multigrid state.
+ * @param l Level. */
+static void mg_vcycle(struct mg *mg, int l)
+{
+	if(l == mg->levnum - 1) {
+		mg_smooth(mg, l, MG_COARSE_SWEEPS);
+		return;
+	}
+
+	mg_smooth(mg, l, MG_SMOOTH);
+
+	mg_restrict(mg, l + 1);
+	mg_vcycle(mg, l + 1);
+	mg_prolong(mg, l + 1, 1);
+
+	mg_smooth(mg, l, MG_SMOOTH);
+}
+
+/** @brief Copies values of constant points to all dense levels
+ * (injection) and sets variable points and right hand sides to zero.
+ *
+ * @param mg Pointer to the multigrid state. */
+static void mg_inject(struct mg *mg)
+{
+	struct mg_level *c, *p;
+	n_v3i pos, fpos;
+	size_t i;
+	int l;
+
+	for(l = 1; l < mg->levnum; l++) {
+		c = &mg->lev[l];
+		p = &mg->lev[l - 1];
+
+		for(pos.z = 0; pos.z < c->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < c->size.y; pos.y++) {
+		for(pos.x = 0; pos.x < c->size.x; pos.x++) {
+			i = MG_OFF(c, pos.x, pos.y, pos.z);
+
+			c->u[i] = 0.0;
+			c->rhs[i] = 0.0;
+
+			if(!c->con[i]) continue;
+
+			/* the value comes from the finer point that made
+			 * this point constant */
+			if(!mg_con_find(mg, l, pos, &fpos)) continue;
+
+			if((fpos.x >= p->size.x) || (fpos.y >= p->size.y) ||
+						(fpos.z >= p->size.z)) {
+				continue;
+			}
+
+			if(l == 1) {
+				c->u[i] = sp_n_get(mg->sp,
+						v3i_add(fpos, mg->sp->pos));
+			} else {
+				c->u[i] = p->u[MG_OFF(p, fpos.x, fpos.y,
+								fpos.z)];
+			}
+		}
+		}
+		}
+	}
+}
+
+/** @brief Builds the multigrid hierarchy for a finite difference mesh.
+ *
+ * Must be called after sp_optimize(). Constant points and materials of the
+ * mesh must not change while the returned state is in use. Coarse levels 
+ * have a uniform step, so graded meshes (see sp_dist()) are not supported.
+ *
+ * @param sp Pointer to the space struct.
+ * @return Pointer to the multigrid state or NULL on error. */
+struct mg *mg_init(struct space *sp)
+{
+	struct mg *mg;
+	struct mg_level *c, *p;
+	int l, n;
+
+	assert(sp != NULL);
+	assert(sp->blk != NULL);
+
+	if(sp_graded(sp, X) || sp_graded(sp, Y) || sp_graded(sp, Z)) {
+		warning("Multigrid needs a uniform mesh step");
+		return NULL;
+	}
+
+	mg = n_calloc(1, sizeof(*mg));
+	if(mg == NULL) return NULL;
+
+	mg->sp = sp;
+
+	c = &mg->lev[0];
+	c->size = sp->size;
+	c->step = sp->step;
+	c->f = v3i(1, 1, 1);
+
+	for(l = 1; l < MG_MAX_LEVELS; l++) {
+		c = &mg->lev[l];
+		p = &mg->lev[l - 1];
+
+		c->f.x = (p->size.x > MG_MIN_SIZE) ? 2 : 1;
+		c->f.y = (p->size.y > MG_MIN_SIZE) ? 2 : 1;
+		c->f.z = (p->size.z > MG_MIN_SIZE) ? 2 : 1;
+
+		if((c->f.x == 1) && (c->f.y == 1) && (c->f.z == 1)) break;
+
+		c->size.x = (c->f.x == 2) ? p->size.x / 2 + 1 : p->size.x;
+		c->size.y = (c->f.y == 2) ? p->size.y / 2 + 1 : p->size.y;
+		c->size.z = (c->f.z == 2) ? p->size.z / 2 + 1 : p->size.z;
+
+		c->step.x = p->step.x * c->f.x;
+		c->step.y = p->step.y * c->f.y;
+		c->step.z = p->step.z * c->f.z;
+	}
+
+	mg->levnum = l;
+
+	for(n = 0; n < sp->varnum; n++) {
+		if(blk_vec_alloc(sp->var[n], MG_VEC_R)) {
+			mg_done(mg);
+			return NULL;
+		}
+	}
+
+	for(l = 1; l < mg->levnum; l++) {
+		c = &mg->lev[l];
+
+		if(mg_level_alloc(c)) {
+			mg_done(mg);
+			return NULL;
+		}
+
+		mg_level_materials(mg, l);
+		mg_level_con(mg, l);
+		mg_level_coef(c);
+	}
+
+	/* materials are only needed to build the next level */
+
+	for(l = 1; l < mg->levnum; l++) {
+		n_free(mg->lev[l].a);
+		mg->lev[l].a = NULL;
+	}
+
+	c = &mg->lev[mg->levnum - 1];
+
+	info("Multigrid with %d levels, coarsest is (%d, %d, %d)", mg->levnum,
+					c->size.x, c->size.y, c->size.z);
+
+	return mg;
+}
+
+/** @brief Frees the multigrid hierarchy.
+ *
+ * Work arrays in mesh blocks are freed together with the mesh.
+ *
+ * @param mg Pointer to the multigrid state. */
+void mg_done(struct mg *mg)
+{
+	int l;
+
+	if(mg == NULL) return;
+
+	for(l = 1; l < MG_MAX_LEVELS; l++) {
+		mg_level_free(&mg->lev[l]);
+	}
+
+	n_free(mg);
+}
+
+/** @brief Calculates an initial solution with full multigrid (FMG).
+ *
+ * The problem is first solved on the coarsest level. The solution is then
+ * interpolated to each finer level in turn and improved there with one
+ * V-cycle. Values of all variable points on level 0 are replaced.
+ *
+ * @param mg Pointer to the multigrid state. */
+void mg_fmg(struct mg *mg)
+{
+	int l;
+
+	if(mg->levnum < 2) return;
+
+	mg_inject(mg);
+
+	mg_smooth(mg, mg->levnum - 1, MG_COARSE_SWEEPS);
+
+	for(l = mg->levnum - 2; l >= 0; l--) {
+		mg_prolong(mg, l + 1, 0);
+		mg_vcycle(mg, l);
+	}
+}
+
+/** @brief Performs one multigrid V-cycle on the finite difference mesh.
+ *
+ * @param mg Pointer to the multigrid state. */
+void mg_cycle(struct mg *mg)
+{
+	mg_vcycle(mg, 0);
+}
@@ -0,0 +1,20 @@
+/**
+ * @file src/multigrid.h
+ *
+ * @brief Geometric multigrid solver, header.
+ */
+
+#ifndef _MULTIGRID_H
+#define _MULTIGRID_H
+
+#include "struct.h"
+
+struct mg;
+
+struct mg *mg_init(struct space *sp);
+void mg_done(struct mg *mg);
+
+void mg_fmg(struct mg *mg);
+void mg_cycle(struct mg *mg);
+
+#endif
@@ -3,6 +3,8 @@
  *
  * @brief , code.
  */
+#include <string.h>
+
 #include "num.h"
 
 /**
@@ -204,3 +206,20 @@ n_v3f v3f(n_float x, n_float y, n_float z)
 	return r;
 }
 
+
+/**
+ * @brief Checks that a value is neither infinite nor NaN.
+ *
+ * The exponent bits are tested directly. With -ffast-math the compiler 
+ * may assume that isfinite() is always true.
+ *
+ * @return 1 if \a x is finite or 0 if not.
+ */
+int num_finite(double x)
+{
+	unsigned long long b;
+
+	memcpy(&b, &x, sizeof(b));
+
+	return ((b >> 52) & 0x7ff) != 0x7ff;
+}
@@ -85,4 +85,6 @@ n_v3i v3i_vectp(n_v3i a, n_v3i b);
 
 n_v3f v3f(n_float x, n_float y, n_float z);
 
+int num_finite(double x);
+
 #endif
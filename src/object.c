@@ -7,7 +7,9 @@
 #include "loadobj.h"
 #include "data.h"
 
-/** @brief Amount of memory used by object maps (bytes) */
+/** @brief Amount of memory used by object maps (bytes). Updated with 
+ * atomic operations, since solves of different nets can run at the same
+ * time. */
 static long int obj_memsize=0;
 
 /** @brief Prints the amount of memory used by object maps */
@@ -93,7 +95,7 @@ int obj_load(struct object *obj)
 		default:	return -1;
 	}
 
-	obj_memsize+=obj->size.x * obj->size.y;
+	__sync_fetch_and_add(&obj_memsize, obj->size.x * obj->size.y);
 
 	return r;
 }
@@ -108,7 +110,7 @@ void obj_unload(struct object *obj)
 	free(obj->map);
 	obj->map=NULL;
 
-	obj_memsize-=obj->size.x * obj->size.y;
+	__sync_fetch_and_sub(&obj_memsize, obj->size.x * obj->size.y);
 
 	return;
 }
@@ -155,7 +157,7 @@ int obj_shrink_tight(struct object *obj)
 
 	new_memsize=new_size.x * new_size.y;
 	new_map=calloc(new_memsize, sizeof(*new_map));
-	obj_memsize+=new_size.x * new_size.y;
+	__sync_fetch_and_add(&obj_memsize, new_size.x * new_size.y);
 
 	if(new_map==NULL) return -1;
 
@@ -170,7 +172,7 @@ int obj_shrink_tight(struct object *obj)
 	}
 
 	free(obj->map);
-	obj_memsize-=obj->size.x * obj->size.y;
+	__sync_fetch_and_sub(&obj_memsize, obj->size.x * obj->size.y);
 
 	//debug("obj_shrink_tight: before (%d, %d) after (%d, %d)", obj->pos.x,
 	//	obj->pos.y, new_pos.x, new_pos.y);
@@ -223,7 +225,7 @@ int obj_grow(struct object *obj, int r, int square)
 
 	new_map=calloc(new_memsize, sizeof(*new_map));
 	if(new_map==NULL) return -1;
-	obj_memsize+=new_size.x * new_size.y;
+	__sync_fetch_and_add(&obj_memsize, new_size.x * new_size.y);
 
 	for(n.y=0;n.y<obj->size.y;n.y++) {
 		for(n.x=0;n.x<obj->size.x;n.x++) {
@@ -240,7 +242,7 @@ int obj_grow(struct object *obj, int r, int square)
 	}
 
 	free(obj->map);
-	obj_memsize-=obj->size.x * obj->size.y;
+	__sync_fetch_and_sub(&obj_memsize, obj->size.x * obj->size.y);
 
 	obj->pos=v2i_sub(obj->pos, v2i(r, r));
 	obj->size=new_size;
@@ -275,7 +277,8 @@ struct object *obj_dup(struct object *obj)
 			return NULL;
 		}
 
-		obj_memsize+=copy->size.x * copy->size.y;
+		__sync_fetch_and_add(&obj_memsize, 
+					copy->size.x * copy->size.y);
 
 		memcpy(copy->map, obj->map, size*sizeof(*copy->map));
 	}
@@ -348,7 +351,7 @@ struct object *obj_merge(struct object *obj1, struct object *obj2)
 		return NULL;
 	}
 
-	obj_memsize+=size.x * size.y;
+	__sync_fetch_and_add(&obj_memsize, size.x * size.y);
 
 	off=v2i_sub(obj1->pos, dest->pos);
 	for(n.y=0;n.y<obj1->size.y;n.y++) {
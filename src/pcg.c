@@ -0,0 +1,581 @@
+/**
+ * @file src/pcg.c
+ *
+ * @brief Preconditioned conjugate gradient solver, code.
+ *
+ * The finite difference equations for variable mesh points form a
+ * symmetric positive definite system (constant points are known values and
+ * only contribute to the right hand side). This module solves it with the
+ * conjugate gradient method without assembling a matrix: the operator is
+ * applied block by block with blk_stencil(), using the same stencil
+ * coefficients as the SOR solver.
+ *
+ * The solution is kept in the mesh point values. Residual, preconditioned
+ * residual, search direction and the operator applied to the search
+ * direction are kept in work arrays of mesh blocks (PCG_VEC_R ...
+ * PCG_VEC_Q). All of them are zero in constant points.
+ *
+ * Stencil coefficients are small in SI units (on the order of 1e-16), so 
+ * the residual and the operator applied to the search direction are 
+ * multiplied by a scale factor. Otherwise they would soon reach denormal
+ * numbers in parts of the mesh far away from the nets.
+ *
+ * Each step runs through the thread pool of the space, one work item per
+ * variable mesh block. Dot products are summed per block first and the
+ * partial sums are then added in block order, so that results do not
+ * depend on the number of threads.
+ */
+
+#include <math.h>
+
+#include "assert.h"
+#include "error.h"
+#include "block.h"
+#include "space.h"
+#include "pool.h"
+#include "malloc.h"
+#include "pcg.h"
+
+/** @brief Work array with the residual. */
+#define PCG_VEC_R	0
+/** @brief Work array with the preconditioned residual. */
+#define PCG_VEC_Z	1
+/** @brief Work array with the search direction. */
+#define PCG_VEC_P	2
+/** @brief Work array with the operator applied to the search direction. */
+#define PCG_VEC_Q	3
+
+/** @brief Relative residual norm at which iterations stop. 
+ *
+ * Mesh point values are single precision, so further iterations would not
+ * improve the solution. The residual only keeps decreasing in the 
+ * recurrence and soon reaches denormal numbers, which are slow. */
+#define PCG_MIN_RESIDUAL	1e-6
+
+/** @brief Conjugate gradient solver state for one finite difference mesh. */
+struct pcg {
+	/** @brief Pointer to the finite difference mesh. */
+	struct space *sp;
+
+	/** @brief Preconditioner. */
+	enum pcg_precond precond;
+
+	/** @brief Partial sums of dot products, two for each variable mesh
+	 * block. */
+	double *sum;
+
+	/** @brief Dot product of the residual and the preconditioned
+	 * residual. */
+	double rz;
+
+	/** @brief Squared norm of the residual. */
+	double rr;
+
+	/** @brief Squared norm of the initial residual. */
+	double rr0;
+
+	/** @brief Scale factor of the residual (inverse of the largest sum
+	 * of stencil coefficients). */
+	n_float scale;
+};
+
+/** @brief Arguments for work items passed to the thread pool. */
+struct pcg_pass {
+	struct pcg *pcg;
+
+	/** @brief Step length (update) or weight of the previous search
+	 * direction (direction). */
+	n_float a;
+
+	/** @brief Color of the mesh points to update (SSOR). */
+	int color;
+
+	/** @brief Set if this is the first pass of the SSOR
+	 * preconditioner. */
+	int first;
+};
+
+/** @brief Work item: largest sum of stencil coefficients in one mesh
+ * block. */
+static void pcg_scale_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *k[BLK_K_NUM];
+	n_v3i pos;
+	size_t off;
+	double m;
+	int x, stride;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	m = 0.0;
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			stride = blk_coef_row(blk, pos, k);
+
+			for(x = 0; x < blk->size.x; x++) {
+				if(BLK_CON_OFF(blk, off + x)) continue;
+
+				if(1.0 / k[BLK_K_D][x * stride] > m) {
+					m = 1.0 / k[BLK_K_D][x * stride];
+				}
+			}
+		}
+	}
+
+	pass->pcg->sum[2 * n] = m;
+}
+
+/** @brief Work item: initial residual of one mesh block. */
+static void pcg_residual_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	blk_halo_update(blk, -1);
+	blk_stencil(blk, -1, PCG_VEC_R, -pass->pcg->scale);
+}
+
+/** @brief Work item: Jacobi preconditioner on one mesh block. */
+static void pcg_jacobi_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *k[BLK_K_NUM];
+	n_float *r, *z;
+	n_v3i pos;
+	size_t off;
+	int x, stride;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			r = &blk->vec[PCG_VEC_R][off];
+			z = &blk->vec[PCG_VEC_Z][off];
+
+			stride = blk_coef_row(blk, pos, k);
+
+			/* coefficients of constant points can be undefined */
+
+			for(x = 0; x < blk->size.x; x++) {
+				if(BLK_CON_OFF(blk, off + x)) {
+					z[x] = 0.0;
+				} else {
+					z[x] = k[BLK_K_D][x * stride] * r[x];
+				}
+			}
+		}
+	}
+}
+
+/** @brief Work item: one red-black Gauss-Seidel pass of the SSOR
+ * preconditioner on one mesh block.
+ *
+ * Relaxes points of one color in the equation A z = r. The first pass
+ * starts from z = 0, so it does not need any neighbors and also clears
+ * points of the other color. */
+static void pcg_ssor_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *k[BLK_K_NUM];
+	n_float *r, *o, *oy1, *oy2, *oz1, *oz2;
+	n_float s;
+	n_v3i pos;
+	size_t off;
+	int x, i, stride;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	if(!pass->first) blk_halo_update_vec(blk, PCG_VEC_Z, !pass->color);
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			r = &blk->vec[PCG_VEC_R][off];
+			o = &blk->vec[PCG_VEC_Z][off];
+
+			oy1 = o - (blk->size.x + 2);
+			oy2 = o + (blk->size.x + 2);
+
+			oz1 = o - (blk->size.x + 2) * (blk->size.y + 2);
+			oz2 = o + (blk->size.x + 2) * (blk->size.y + 2);
+
+
+			stride = blk_coef_row(blk, pos, k);
+
+			x = 0;
+			if(((blk->pos.x + blk->pos.y + blk->pos.z +
+				pos.y + pos.z) & 1) != pass->color) {
+				if(pass->first) o[0] = 0.0;
+				x++;
+			}
+
+			for(; x < blk->size.x; x += 2) {
+				i = x * stride;
+
+				if(pass->first) {
+					o[x] = BLK_CON_OFF(blk, off + x) ? 0.0 : 
+						k[BLK_K_D][i] * r[x];
+					if(x + 1 < blk->size.x) o[x + 1] = 0.0;
+					continue;
+				}
+
+				if(BLK_CON_OFF(blk, off + x)) continue;
+
+				s = r[x] +
+					k[BLK_K_X1][i] * o[x - 1] +
+					k[BLK_K_X2][i] * o[x + 1] +
+					k[BLK_K_Y1][i] * oy1[x] +
+					k[BLK_K_Y2][i] * oy2[x] +
+					k[BLK_K_Z1][i] * oz1[x] +
+					k[BLK_K_Z2][i] * oz2[x];
+
+				o[x] = k[BLK_K_D][i] * s;
+			}
+		}
+	}
+}
+
+/** @brief Work item: dot products (r, z) and (r, r) on one mesh block. */
+static void pcg_dot_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *r, *z;
+	double rz, rr;
+	n_v3i pos;
+	size_t off;
+	int x;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	rz = 0.0;
+	rr = 0.0;
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			r = &blk->vec[PCG_VEC_R][off];
+			z = &blk->vec[PCG_VEC_Z][off];
+
+			for(x = 0; x < blk->size.x; x++) {
+				rz += r[x] * z[x];
+				rr += r[x] * r[x];
+			}
+		}
+	}
+
+	pass->pcg->sum[2 * n] = rz;
+	pass->pcg->sum[2 * n + 1] = rr;
+}
+
+/** @brief Work item: q = A p and dot product (p, q) on one mesh block. */
+static void pcg_apply_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *p, *q;
+	double pq;
+	n_v3i pos;
+	size_t off;
+	int x;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	blk_halo_update_vec(blk, PCG_VEC_P, -1);
+	blk_stencil(blk, PCG_VEC_P, PCG_VEC_Q, 1.0);
+
+	pq = 0.0;
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			p = &blk->vec[PCG_VEC_P][off];
+			q = &blk->vec[PCG_VEC_Q][off];
+
+			for(x = 0; x < blk->size.x; x++) pq += p[x] * q[x];
+		}
+	}
+
+	pass->pcg->sum[2 * n] = pq;
+}
+
+/** @brief Work item: update of the solution and the residual on one mesh
+ * block. */
+static void pcg_update_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *o, *r, *p, *q;
+	n_v3i pos;
+	size_t off;
+	int x;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			o = &blk->n[off];
+
+			r = &blk->vec[PCG_VEC_R][off];
+			p = &blk->vec[PCG_VEC_P][off];
+			q = &blk->vec[PCG_VEC_Q][off];
+
+			for(x = 0; x < blk->size.x; x++) {
+				if(BLK_CON_OFF(blk, off + x)) continue;
+
+				o[x] += pass->a / pass->pcg->scale * p[x];
+				r[x] -= pass->a * q[x];
+			}
+		}
+	}
+}
+
+/** @brief Work item: new search direction on one mesh block. */
+static void pcg_direction_pass(void *arg, int n)
+{
+	struct pcg_pass *pass;
+	struct block *blk;
+
+	n_float *p, *z;
+	n_v3i pos;
+	size_t off;
+	int x;
+
+	pass = arg;
+	blk = pass->pcg->sp->var[n];
+
+	for(pos.z = 0; pos.z < blk->size.z; pos.z++) {
+		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+			pos.x = 0;
+
+			off = blk_off3(blk, pos);
+
+			p = &blk->vec[PCG_VEC_P][off];
+			z = &blk->vec[PCG_VEC_Z][off];
+
+			if(pass->first) {
+				for(x = 0; x < blk->size.x; x++) p[x] = z[x];
+			} else {
+				for(x = 0; x < blk->size.x; x++) {
+					p[x] = z[x] + pass->a * p[x];
+				}
+			}
+		}
+	}
+}
+
+/** @brief Adds partial sums of all blocks.
+ *
+ * @param pcg Pointer to the solver state.
+ * @param i Index of the sum (0 or 1).
+ * @return Sum over all blocks. */
+static double pcg_sum(struct pcg *pcg, int i)
+{
+	double s;
+	int n;
+
+	s = 0.0;
+	for(n = 0; n < pcg->sp->varnum; n++) s += pcg->sum[2 * n + i];
+
+	return s;
+}
+
+/** @brief Applies the preconditioner to the residual and calculates
+ * (r, z) and (r, r).
+ *
+ * @param pcg Pointer to the solver state. */
+static void pcg_precondition(struct pcg *pcg)
+{
+	struct pcg_pass pass;
+	struct space *sp;
+
+	sp = pcg->sp;
+
+	pass.pcg = pcg;
+
+	if(pcg->precond == pcg_jacobi) {
+		pool_run(sp->pool, pcg_jacobi_pass, &pass, sp->varnum);
+	} else {
+		/* forward sweep (red, black) followed by a backward sweep
+		 * (black, red) keeps the preconditioner symmetric. With the
+		 * relaxation factor of 1 the second black pass would not
+		 * change anything, so it is left out. Larger factors did
+		 * not reduce the number of iterations. */
+
+		pass.first = 1;
+		pass.color = 0;
+		pool_run(sp->pool, pcg_ssor_pass, &pass, sp->varnum);
+
+		pass.first = 0;
+		pass.color = 1;
+		pool_run(sp->pool, pcg_ssor_pass, &pass, sp->varnum);
+
+		pass.color = 0;
+		pool_run(sp->pool, pcg_ssor_pass, &pass, sp->varnum);
+	}
+
+	pool_run(sp->pool, pcg_dot_pass, &pass, sp->varnum);
+
+	pcg->rz = pcg_sum(pcg, 0);
+	pcg->rr = pcg_sum(pcg, 1);
+}
+
+/** @brief Prepares the conjugate gradient solver for a mesh.
+ *
+ * Allocates work arrays in all variable mesh blocks and calculates the
+ * initial residual from the current mesh point values. sp_optimize() must
+ * be called before this function.
+ *
+ * @param sp Pointer to the finite difference mesh.
+ * @param precond Preconditioner to use.
+ * @return Pointer to the solver state or NULL on error.
+ */
+struct pcg *pcg_init(struct space *sp, enum pcg_precond precond)
+{
+	struct pcg *pcg;
+	struct pcg_pass pass;
+	int n, v;
+
+	assert(sp != NULL);
+
+	pcg = n_calloc(1, sizeof(*pcg));
+	if(pcg == NULL) return NULL;
+
+	pcg->sp = sp;
+	pcg->precond = precond;
+
+	pcg->sum = n_calloc(2 * sp->varnum + 1, sizeof(*pcg->sum));
+	if(pcg->sum == NULL) {
+		pcg_done(pcg);
+		return NULL;
+	}
+
+	for(n = 0; n < sp->varnum; n++) {
+		for(v = PCG_VEC_R; v <= PCG_VEC_Q; v++) {
+			if(blk_vec_alloc(sp->var[n], v)) {
+				pcg_done(pcg);
+				return NULL;
+			}
+		}
+	}
+
+	pass.pcg = pcg;
+
+	pool_run(sp->pool, pcg_scale_pass, &pass, sp->varnum);
+
+	pcg->scale = 0.0;
+	for(n = 0; n < sp->varnum; n++) {
+		if(pcg->sum[2 * n] > pcg->scale) pcg->scale = pcg->sum[2 * n];
+	}
+	pcg->scale = (pcg->scale > 0.0) ? 1.0 / pcg->scale : 1.0;
+
+	pool_run(sp->pool, pcg_residual_pass, &pass, sp->varnum);
+
+	pcg_precondition(pcg);
+
+	pass.first = 1;
+	pool_run(sp->pool, pcg_direction_pass, &pass, sp->varnum);
+
+	pcg->rr0 = pcg->rr;
+
+	return pcg;
+}
+
+/** @brief Frees the solver state.
+ *
+ * Work arrays stay allocated in the mesh blocks until they are freed.
+ *
+ * @param pcg Pointer to the solver state. */
+void pcg_done(struct pcg *pcg)
+{
+	if(pcg == NULL) return;
+
+	if(pcg->sum != NULL) n_free(pcg->sum);
+
+	n_free(pcg);
+}
+
+/** @brief Performs one iteration of the conjugate gradient method.
+ *
+ * @param pcg Pointer to the solver state. */
+void pcg_iterate(struct pcg *pcg)
+{
+	struct pcg_pass pass;
+	struct space *sp;
+	double pq, rz;
+
+	sp = pcg->sp;
+
+	/* converged to the limits of floating point precision */
+	if(pcg->rr <= pcg->rr0 * PCG_MIN_RESIDUAL * PCG_MIN_RESIDUAL) return;
+	if(pcg->rz <= 0.0) return;
+
+	pass.pcg = pcg;
+
+	pool_run(sp->pool, pcg_apply_pass, &pass, sp->varnum);
+
+	pq = pcg_sum(pcg, 0);
+	if(pq <= 0.0) return;
+
+	pass.a = pcg->rz / pq;
+	pool_run(sp->pool, pcg_update_pass, &pass, sp->varnum);
+
+	rz = pcg->rz;
+
+	pcg_precondition(pcg);
+
+	pass.first = 0;
+	pass.a = pcg->rz / rz;
+	pool_run(sp->pool, pcg_direction_pass, &pass, sp->varnum);
+}
+
+/** @brief Norm of the residual relative to the initial residual.
+ *
+ * @param pcg Pointer to the solver state. */
+n_float pcg_residual(struct pcg *pcg)
+{
+	if(pcg->rr0 <= 0.0) return 0.0;
+
+	return sqrt(pcg->rr / pcg->rr0);
+}
@@ -0,0 +1,29 @@
+/**
+ * @file src/pcg.h
+ *
+ * @brief Preconditioned conjugate gradient solver, header.
+ */
+
+#ifndef _PCG_H
+#define _PCG_H
+
+#include "struct.h"
+
+/** @brief Preconditioner used by the conjugate gradient solver. */
+enum pcg_precond {
+	/** @brief Diagonal (Jacobi) preconditioner. */
+	pcg_jacobi,
+	/** @brief Symmetric red-black Gauss-Seidel (SSOR with omega 1)
+	 * preconditioner. */
+	pcg_ssor
+};
+
+struct pcg;
+
+struct pcg *pcg_init(struct space *sp, enum pcg_precond precond);
+void pcg_done(struct pcg *pcg);
+
+void pcg_iterate(struct pcg *pcg);
+n_float pcg_residual(struct pcg *pcg);
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * @file src/pool.c
+ *
+ * @brief Worker thread pool, code.
+ *
+ * A pool is a fixed set of worker threads that are started once and then
+ * reused for every call to pool_run(). The calling thread takes part in the
+ * work, so a pool with N threads starts only N-1 additional threads.
+ *
+ * Work items are handed out one at a time from a shared counter, so items
+ * of very different sizes (for example mesh blocks of different layers) are
+ * balanced automatically.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "assert.h"
+#include "error.h"
+#include "pool.h"
+
+struct pool {
+	/** @brief Number of threads, including the calling thread. */
+	int threads;
+
+	/** @brief Array of threads-1 started worker threads. */
+	pthread_t *thread;
+
+	pthread_mutex_t lock;
+
+	/** @brief Signalled when a new job is available. */
+	pthread_cond_t start;
+
+	/** @brief Signalled when the last worker finished a job. */
+	pthread_cond_t done;
+
+	/** @brief Current job. */
+	pool_func func;
+	void *arg;
+	int num;
+
+	/** @brief Index of the next work item to be handed out. */
+	int next;
+
+	/** @brief Number of worker threads still working on current job. */
+	int busy;
+
+	/** @brief Incremented each time a new job is started. */
+	unsigned long gen;
+
+	/** @brief Set to 1 when worker threads should exit. */
+	int quit;
+};
+
+/** @brief Process work items of the current job until none are left.
+ *
+ * @param pool Pointer to the pool. */
+static void pool_work(struct pool *pool)
+{
+	int n;
+
+	while(1) {
+		n=__sync_fetch_and_add(&pool->next, 1);
+		if(n>=pool->num) break;
+
+		pool->func(pool->arg, n);
+	}
+}
+
+/** @brief Main function of a worker thread. */
+static void *pool_thread(void *arg)
+{
+	struct pool *pool;
+	unsigned long gen;
+
+	pool=arg;
+
+	/* jobs are counted from the creation of the pool, so a job that was
+	 * started before this thread got the lock is not missed */
+	gen=0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while(1) {
+		while((pool->gen==gen)&&(!pool->quit)) {
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+		if(pool->quit) break;
+
+		gen=pool->gen;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		if(pool->busy==0) pthread_cond_signal(&pool->done);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/** @brief Create a new thread pool.
+ *
+ * @param threads Number of threads that will process work items (including
+ * the thread calling pool_run()).
+ * @return Pointer to the new pool or NULL on error. */
+struct pool *pool_init(int threads)
+{
+	struct pool *pool;
+	int n;
+
+	assert(threads>0);
+
+	pool=calloc(1, sizeof(*pool));
+	if(pool==NULL) return NULL;
+
+	pool->threads=threads;
+	pool->gen=0;
+	pool->quit=0;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	if(threads==1) return pool;
+
+	pool->thread=calloc(threads-1, sizeof(*pool->thread));
+	if(pool->thread==NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	for(n=0;n<threads-1;n++) {
+		if(pthread_create(&pool->thread[n], NULL, pool_thread, pool)) {
+			error("Can't start worker thread");
+			pool->threads=n+1;
+			break;
+		}
+	}
+
+	return pool;
+}
+
+/** @brief Stop all worker threads and free the pool.
+ *
+ * @param pool Pointer to the pool. */
+void pool_done(struct pool *pool)
+{
+	int n;
+
+	if(pool==NULL) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit=1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(n=0;n<pool->threads-1;n++) {
+		pthread_join(pool->thread[n], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+
+	if(pool->thread!=NULL) free(pool->thread);
+	free(pool);
+}
+
+/** @brief Number of threads in a pool.
+ *
+ * @param pool Pointer to the pool or NULL.
+ * @return Number of threads (1 if \a pool is NULL). */
+int pool_threads(struct pool *pool)
+{
+	if(pool==NULL) return 1;
+
+	return pool->threads;
+}
+
+/** @brief Call \a func for all work items from 0 to \a num-1 and wait until
+ * all calls return.
+ *
+ * Work items are processed in an unspecified order and concurrently, so
+ * \a func must not depend on the results of other items of the same job.
+ *
+ * @param pool Pointer to the pool. If NULL, items are processed in order in
+ * the calling thread.
+ * @param func Function to call.
+ * @param arg Pointer passed to \a func.
+ * @param num Number of work items. */
+void pool_run(struct pool *pool, pool_func func, void *arg, int num)
+{
+	int n;
+
+	if((pool==NULL)||(pool->threads==1)||(num<2)) {
+		for(n=0;n<num;n++) func(arg, n);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->func=func;
+	pool->arg=arg;
+	pool->num=num;
+	pool->next=0;
+	pool->busy=pool->threads-1;
+	pool->gen++;
+
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy>0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
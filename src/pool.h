@@ -0,0 +1,25 @@
+/**
+ * @file src/pool.h
+ *
+ * @brief Worker thread pool, header.
+ */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+struct pool;
+
+/** @brief Function called for each work item in pool_run().
+ *
+ * @param arg Pointer that was passed to pool_run().
+ * @param n Index of the work item. */
+typedef void (*pool_func)(void *arg, int n);
+
+struct pool *pool_init(int threads);
+void pool_done(struct pool *pool);
+
+int pool_threads(struct pool *pool);
+
+void pool_run(struct pool *pool, pool_func func, void *arg, int num);
+
+#endif
@@ -1,401 +1,1951 @@
+#include <math.h>
+#include <string.h>
+
 #include "sor.h" 
 #include "data.h"
+#include "error.h"
 #include "assert.h"
 #include "space.h"
+#include "pool.h"
+#include "sor_simd.h"
+#include "block.h"
+#include "malloc.h"
 
 /** @file 
- * @brief SOR algorithm, code */
+ * @brief SOR algorithm, code
+ *
+ * Mesh points are updated in red-black (checkerboard) order. A point at 
+ * absolute position (x,y,z) is red if x+y+z is even and black otherwise.
+ * Each iteration first updates all red points and then all black points.
+ * 
+ * Since the finite difference stencil of a red point only includes black 
+ * points (and vice versa), all points of one color can be updated in any
+ * order. This allows mesh blocks to be processed concurrently by a thread
+ * pool. 
+ *
+ * In automatic mode (a_soromega_auto) the extrapolation parameter is
+ * estimated while iterating. The first sweeps are Gauss-Seidel sweeps 
+ * (omega = 1). Red-black ordering is consistently ordered, so the theory
+ * of Young applies: once the ratio lambda of the norms of two successive
+ * updates settles, it is the dominant eigenvalue of the iteration matrix and
+ * the spectral radius mu of the Jacobi iteration follows from
+ *
+ * (lambda + omega - 1)^2 = lambda * omega^2 * mu^2
+ *
+ * The optimal omega is then 2 / (1 + sqrt(1 - mu^2)). The estimate of mu 
+ * is low while the solution still contains other components, so this is 
+ * repeated with the new omega until the estimate stops increasing. Above
+ * the optimum the dominant eigenvalues are complex and update norms 
+ * oscillate. The estimate is frozen when that happens.
+ *
+ * Far from the conductors the solution settles long before the iteration
+ * ends. A block whose largest change stays below SOR_SLEEP_TOLERANCE 
+ * times the requested accuracy times the largest change in the first 
+ * sweep for SOR_SLEEP_SWEEPS sweeps falls asleep and is skipped. Its ghost
+ * points are still refreshed in every sweep. It wakes up as soon as the 
+ * values on its faces have changed by more than the same threshold since 
+ * it fell asleep. A sleeping block keeps the residual of its last sweep in
+ * the residual norm. That residual gets out of date while the neighbors 
+ * change, so before the norm is trusted for convergence the caller wakes
+ * all blocks for one sweep (see sor_wake()).
+ *
+ * Mesh blocks far from objects can be coarse (see sp_refine()). Ghost 
+ * points between blocks of different scale are interpolated from points 
+ * of the neighboring blocks before each color is swept.
+ *
+ * With line relaxation (a_sorrelax equal to sor_line) all points on a line
+ * along the z axis are updated at once by solving the tridiagonal system
+ * of their finite difference equations, with values of the neighboring 
+ * lines fixed. When the mesh step in z is much smaller than in x and y, 
+ * coupling along z dominates and point SOR converges very slowly. Line 
+ * SOR removes that coupling from the iteration. Lines are colored by x+y,
+ * so all lines of one color are again independent. A line runs through
+ * all variable blocks stacked on top of each other (a run). Blocks are not
+ * put to sleep in this mode.
+ *
+ * In mixed precision (a_sorprecision equal to sor_mixed) mesh point values
+ * are still swept in single precision, but the solution is improved with
+ * iterative refinement. Once the residual has been reduced by 
+ * SOR_REFINE_REDUCTION, the residual of the current solution is computed
+ * in double precision and the correction is solved for with the same
+ * single precision sweeps, using the residual as the right hand side. The
+ * correction is then added to the solution, which is kept as a sum of two
+ * single precision values (n and the work array BLK_VEC_LO), and the next
+ * correction is started. Rounding errors of the sweeps only affect the
+ * correction, so the residual can be reduced far below the precision of
+ * n_float. Corrections always use point red-black sweeps.
+ *
+ * With half storage (a_sorstorage equal to sor_half) the solve starts with
+ * a coarse pre-solve on mesh point values packed into 16 bits (see 
+ * blk_pack()). This halves the memory for the values and the memory 
+ * traffic of a sweep. Values of constant points must stay exact, so blocks
+ * in which they are not the smallest or largest values are not packed. A
+ * packed block is swept one plane at a time: three planes are unpacked
+ * into a work array, the middle one is updated with the usual row kernels
+ * and packed again. Rounding to 16 bits limits
+ * the residual that can be reached, so all blocks are unpacked once the
+ * residual has been reduced by SOR_PACK_REDUCTION or stops decreasing,
+ * and the solve continues in single precision. Packed blocks use point 
+ * red-black sweeps and are not put to sleep. */
 
 /** @brief SOR exstrapolation (omega) parameter. Must be 0 <= omega <= 2.0. */
 n_float a_soromega=1.0;
 
-/** @brief Helper macro for sor_iterate_block_corners() */
-#define ITERATE_ONE \
-			ex1y1z1=blk_a_get(blk, v3i_sub(pos, v3i(1,1,1)));  \
-			ex1y2z1=blk_a_get(blk, v3i_sub(pos, v3i(1,0,1)));  \
-			ex2y1z1=blk_a_get(blk, v3i_sub(pos, v3i(0,1,1)));  \
-			ex2y2z1=blk_a_get(blk, v3i_sub(pos, v3i(0,0,1)));  \
- \
-			ex1y1z2=blk_a_get(blk, v3i_sub(pos, v3i(1,1,0))); \
-			ex1y2z2=blk_a_get(blk, v3i_sub(pos, v3i(1,0,0))); \
-			ex2y1z2=blk_a_get(blk, v3i_sub(pos, v3i(0,1,0))); \
-			ex2y2z2=blk_a_get(blk, v3i_sub(pos, v3i(0,0,0))); \
- \
-			kx1=(ex1y1z1+ex1y1z2+ex1y2z1+ex1y2z2)*ax; \
-			kx2=(ex2y1z1+ex2y1z2+ex2y2z1+ex2y2z2)*ax; \
- \
-			ky1=(ex1y1z1+ex1y1z2+ex2y1z1+ex2y1z2)*ay; \
-			ky2=(ex1y2z1+ex1y2z2+ex2y2z1+ex2y2z2)*ay; \
- \
-			kz1=(ex1y1z1+ex1y2z1+ex2y1z1+ex2y2z1)*az; \
-			kz2=(ex1y1z2+ex1y2z2+ex2y1z2+ex2y2z2)*az; \
- \
-			n1= kx1*blk_n_get(blk, v3i_sub(pos, v3i_x)); \
-			n1+=kx2*blk_n_get(blk, v3i_add(pos, v3i_x)); \
-			n1+=ky1*blk_n_get(blk, v3i_sub(pos, v3i_y)); \
-			n1+=ky2*blk_n_get(blk, v3i_add(pos, v3i_y)); \
-			n1+=kz1*blk_n_get(blk, v3i_sub(pos, v3i_z)); \
-			n1+=kz2*blk_n_get(blk, v3i_add(pos, v3i_z)); \
- \
-			n1=n1/(kx1+kx2+ky1+ky2+kz1+kz2); \
- \
-			n2=(1.0 - a_soromega) * BLK_N(blk, pos) +  \
-				a_soromega * n1; \
- \
-			BLK_N(blk, pos) = n2;
-
-/** @brief Performs a single SOR iteration on the edges of a mesh block 
- *
- * @param blk Pointer to the mesh block. */
-void static sor_iterate_block_corners(struct block *blk)
-{
-	n_float n1,n2;
-	n_float kx1,kx2,ky1,ky2,kz1,kz2;
-	n_float ex1y1z1, ex1y2z1, ex2y1z1, ex2y2z1;
-	n_float ex1y1z2, ex1y2z2, ex2y1z2, ex2y2z2;
-	n_float ax,ay,az;
+/** @brief Set if the extrapolation parameter should be estimated 
+ * automatically instead of using a_soromega. */
+int a_soromega_auto=0;
+
+/** @brief Number of sweeps done on each block before moving to the next
+ * one (temporal blocking). Must be 1 <= a_sorsweeps <= SOR_SWEEPS_MAX. */
+int a_sorsweeps=1;
+
+/** @brief Relaxation method. */
+enum sor_relax a_sorrelax=sor_point;
+
+/** @brief Precision of the solution. */
+enum sor_precision a_sorprecision=sor_single;
+
+/** @brief Storage of mesh point values. */
+enum sor_storage a_sorstorage=sor_float;
+
+/** @brief Minimal number of sweeps with the same omega before it is 
+ * estimated again. */
+#define SOR_AUTO_SWEEPS		5
+
+/** @brief Maximal relative change of the update norm ratio between two 
+ * sweeps for the ratio to be considered settled. */
+#define SOR_AUTO_TOLERANCE	0.01
 
+/** @brief Smallest change of omega that is applied. */
+#define SOR_AUTO_STEP		0.005
+
+/** @brief Upper limit for the estimated omega. */
+#define SOR_AUTO_MAX		1.99
+
+/** @brief Estimation stops when the update norm drops below this fraction
+ * of the first update. Smaller updates are dominated by rounding errors. */
+#define SOR_AUTO_FLOOR		1e-5
+
+/** @brief Number of consecutive sweeps with small changes after which a
+ * block falls asleep. */
+#define SOR_SLEEP_SWEEPS	10
+
+/** @brief Changes smaller than this fraction of the largest change in the
+ * first sweep, times the requested accuracy, are considered small. */
+#define SOR_SLEEP_TOLERANCE	1e-3
+
+/** @brief Each solve in mixed precision reduces its residual norm by this
+ * factor before the solution is corrected. The residual of the correction
+ * must stay well above rounding errors of single precision. */
+#define SOR_REFINE_REDUCTION	1e-3
+
+/** @brief Work array with the correction in mixed precision. */
+#define SOR_VEC_E		0
+
+/** @brief Work array with the right hand side of the correction equations,
+ * divided by the sum of weights. */
+#define SOR_VEC_F		1
+
+/** @brief Blocks are unpacked when the residual norm drops below this
+ * fraction of the first one. */
+#define SOR_PACK_REDUCTION	1e-3
+
+/** @brief Blocks are unpacked when the residual norm hasn't decreased by
+ * at least SOR_PACK_PROGRESS for this many sweeps. */
+#define SOR_PACK_STALL		20
+
+/** @brief Smallest relative decrease of the residual norm that counts as
+ * progress with packed blocks. */
+#define SOR_PACK_PROGRESS	0.1
+
+/** @brief State of the SOR solver for one mesh (see sor_init()). */
+struct sor {
+	/** @brief Pointer to the finite difference mesh. */
 	struct space *sp;
 
+	/** @brief Relaxation method. Starts as a_sorrelax. */
+	enum sor_relax relax;
+
+	/** @brief Precision of the solution. Starts as a_sorprecision. */
+	enum sor_precision precision;
+
+	/** @brief Storage of mesh point values. Starts as a_sorstorage. */
+	enum sor_storage storage;
+
+	/** @brief Current extrapolation parameter in automatic mode. */
+	n_float omega;
+
+	/** @brief Number of sweeps since the last change of omega. */
+	int sweeps;
+
+	/** @brief Set when omega is not changed anymore. */
+	int frozen;
+
+	/** @brief Squared norm of the update in the first sweep. */
+	double first;
+
+	/** @brief Squared norm of the update in the last sweep. */
+	double last;
+
+	/** @brief Ratio of update norms of the last two sweeps. */
+	double lambda;
+
+	/** @brief Extrapolation parameter of the last half-sweep with 
+	 * Chebyshev acceleration. 0 before the first sweep. */
+	n_float cheb;
+
+	/** @brief Squared residual norm after the first sweep. */
+	double resid_first;
+
+	/** @brief Squared residual norm after the last sweep. */
+	double resid;
+
+	/** @brief Threshold for small changes, 0 before the first sweep. */
+	n_float sleep;
+
+	/** @brief Requested relative accuracy of the solution. Scales the
+	 * threshold for small changes. */
+	n_float tol;
+
+	/** @brief Set if the next sweep should update all blocks (see 
+	 * sor_wake()). */
+	int wake;
+
+	/** @brief Set if no block was sleeping in the last sweep. */
+	int awake;
+
+	/** @brief Number of corrections in mixed precision. 0 while the 
+	 * original equations are solved. */
+	int refines;
+
+	/** @brief Squared residual norm at the start of the current solve in
+	 * mixed precision (after the first sweep for the original 
+	 * equations). */
+	double solve_first;
+
+	/** @brief Number of packed blocks. */
+	int packed;
+
+	/** @brief Set once mesh point values were packed. */
+	int packdone;
+
+	/** @brief Smallest squared residual norm with packed blocks. */
+	double pack_best;
+
+	/** @brief Number of sweeps since pack_best decreased enough. */
+	int pack_stall;
+
+	/** @brief Work arrays for unpacked planes, one for each thread. NULL
+	 * if not allocated. */
+	n_float *windows;
+
+	/** @brief Set for work arrays in windows that are in use. */
+	int *windowbusy;
+
+	/** @brief Number of work arrays in windows. */
+	int windownum;
+
+	/** @brief Number of values in each work array in windows. */
+	size_t windowsize;
+
+	/** @brief Lowest blocks of all runs of variable blocks stacked along 
+	 * the z axis. Used for line relaxation. NULL if not allocated. */
+	struct block **runs;
+
+	/** @brief Number of runs in runs. */
+	int runnum;
+
+	/** @brief Work space for the tridiagonal solver, linesize values for
+	 * each run. */
+	n_float *linebuf;
+
+	/** @brief Number of values in linebuf for each run. */
+	int linesize;
+};
+
+/** @brief Color of the mesh point in the red-black ordering.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param pos Position of the mesh point in block coordinates.
+ * @return 0 for red and 1 for black points. */
+static inline int sor_color(struct block *blk, n_v3i pos)
+{
+	return (blk->pos.x + pos.x + blk->pos.y + pos.y + 
+					blk->pos.z + pos.z) & 1;
+}
+
+/** @brief Performs a single SOR iteration on one plane of a mesh block 
+ *
+ * Planes with uniform coefficients are updated with the homogeneous row 
+ * kernel and others with the coefficient table (see struct block).
+ *
+ * @param blk Pointer to the mesh block.
+ * @param z Block coordinate of the plane.
+ * @param color Color of the mesh points to update.
+ * @param omega SOR extrapolation parameter. 
+ * @param u Pointer to the ghost point at (-1, -1, z) in the values to 
+ * update (\a n of the block, a work array or an unpacked plane). Planes
+ * z - 1 and z + 1 are at the same distance before and after it as in 
+ * \a n.
+ * @param f Pointer to the ghost point at (-1, -1, z) in the right hand 
+ * side divided by the sum of weights, same layout as \a u. NULL for the 
+ * homogeneous equations.
+ * @param dmax Updated to the largest squared change of a mesh point value.
+ * @return Sum of squared changes of mesh point values. */
+static double sor_iterate_plane(struct block *blk, int z, int color, 
+			n_float omega, n_float *u, n_float *f, n_float *dmax)
+{
+	struct sor_row row;
+	sor_row_func func;
+
+	n_float *ck;
+	double delta;
+
+	unsigned short *span;
 	n_v3i pos;
+	size_t off, sy, sz;
+	unsigned int r, r1;
+	int p, c, x0;
+
+	p = (z > 0);
+
+	sy = blk->size.x + 2;
+	sz = sy * (blk->size.y + 2);
+
+	delta = 0.0;
+
+	if(blk->k[p] == NULL) {
+		ck = blk->c_k[p];
+
+		assert(ck[BLK_K_X1] == ck[BLK_K_X2]);
+		assert(ck[BLK_K_Y1] == ck[BLK_K_Y2]);
+		assert(ck[BLK_K_Z1] == ck[BLK_K_Z2]);
 
-	sp=blk->sp;
+		row.kx = ck[BLK_K_X1] * ck[BLK_K_D];
+		row.ky = ck[BLK_K_Y1] * ck[BLK_K_D];
+		row.kz = ck[BLK_K_Z1] * ck[BLK_K_D];
 
-	ax=sp->step.z * sp->step.y / 4 / sp->step.x;
-	ay=sp->step.z * sp->step.x / 4 / sp->step.y;
-	az=sp->step.x * sp->step.y / 4 / sp->step.z;
+		func = sor_row_h;
+	} else {
+		func = sor_row_n;
+	}
 
-	/* bottom */
+	row.omega = omega;
 
-	pos.z = 0;
+	pos.z = z;
 	for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
-		for(pos.x = 0; pos.x < blk->size.x; pos.x++) {
+		pos.x = 0;
+
+		x0 = (sor_color(blk, pos) != color);
+
+		off = (pos.y + 1) * sy + 1;
 
-			if(BLK_CON(blk, pos)) continue;
+		row.o = u + off;
 
-			ITERATE_ONE
+		row.oy1 = row.o - sy;
+		row.oy2 = row.o + sy;
+
+		row.oz1 = row.o - sz;
+		row.oz2 = row.o + sz;
+
+		row.f = (f != NULL) ? f + off : NULL;
+
+		if(blk->k[p] != NULL) {
+			for(c = 0; c < BLK_K_NUM; c++) {
+				row.k[c] = &BLK_K(blk, c, pos);
+			}
+		}
+
+		/* the kernel is called for each run of variable points */
+
+		r1 = blk->spanrow[z * blk->size.y + pos.y + 1];
+		for(r = blk->spanrow[z * blk->size.y + pos.y]; r < r1; r++) {
+			span = &blk->span[r * 2];
+
+			row.start = span[0] + ((span[0] ^ x0) & 1);
+			row.stop = span[1];
+
+			if(row.start >= row.stop) continue;
+
+			func(&row);
+
+			delta += row.delta;
+			if(row.dmax > *dmax) *dmax = row.dmax;
 		}
 	}
 
-	/* top */
+	return delta;
+}
 
-	if(blk->size.z > 1) {
-		pos.z = blk->size.z-1;
-		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
-			for(pos.x = 0; pos.x < blk->size.x; pos.x++) {
+/** @brief Checks whether a block is sleeping.
+ *
+ * A sleeping block wakes up when the sum of changes of its ghost points
+ * (\a drift) reaches the threshold.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param sleep Threshold for small changes. 0 disables sleeping and wakes
+ * up the block if it is sleeping.
+ * @return 1 if the block should not be updated. */
+static int sor_block_sleeping(struct block *blk, n_float sleep)
+{
+	if(blk->quiet < SOR_SLEEP_SWEEPS) return 0;
 
-				if(BLK_CON(blk, pos)) continue;
+	if(sleep > 0.0 && blk->drift < sleep) return 1;
 
-				ITERATE_ONE
-			}
+	blk->quiet = 0;
+	return 0;
+}
+
+/** @brief Counts sweeps with small changes after a block was updated.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param dmax Largest change of a mesh point value in the last sweep.
+ * @param sweeps Number of sweeps since the last call.
+ * @param sleep Threshold for small changes (0 disables sleeping). */
+static void sor_block_settle(struct block *blk, n_float dmax, int sweeps,
+								n_float sleep)
+{
+	blk->dmax = dmax;
+
+	if(sleep > 0.0 && dmax < sleep) {
+		blk->quiet += sweeps;
+		blk->drift = 0.0;
+	} else {
+		blk->quiet = 0;
+	}
+}
+
+/** @brief Performs a single iteration of the SOR algorithm on mesh points of
+ * one color in one mesh block.
+ *
+ * Ghost points of the other color are refreshed first, so that all points
+ * in the block, including those on its faces, can be updated with the same
+ * row kernels.
+ *
+ * Blocks are put to sleep and woken up here (see the description of this
+ * file). This only depends on the block itself and its ghost points, so it
+ * is safe to do concurrently.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param color Color of the mesh points to update.
+ * @param omega SOR extrapolation parameter. 
+ * @param sleep Threshold for small changes. 0 disables sleeping and wakes
+ * up the block if it is sleeping.
+ * @return Sum of squared changes of mesh point values or -1 if the block
+ * is sleeping. */
+double sor_iterate_block(struct block *blk, int color, n_float omega,
+								n_float sleep)
+{
+	n_float change, dmax;
+	double delta;
+	int z;
+
+	assert(blk->size.x > 0);
+	assert(blk->size.y > 0);
+	assert(blk->size.z > 0);
+
+	if(blk->n==NULL) {
+		return 0.0;
+	}
+
+	change = blk_halo_update(blk, !color);
+
+	if(blk->quiet >= SOR_SLEEP_SWEEPS) blk->drift += change;
+
+	if(sor_block_sleeping(blk, sleep)) return -1.0;
+
+	delta = 0.0;
+	dmax = 0.0;
+	for(z = 0; z < blk->size.z; z++) {
+		delta += sor_iterate_plane(blk, z, color, omega, 
+			&blk->n[blk_off3(blk, v3i(-1, -1, z))], NULL, &dmax);
+	}
+
+	dmax = sqrt(dmax);
+
+	if(color == 0) {
+		blk->dmax = dmax;
+	} else {
+		if(blk->dmax > dmax) dmax = blk->dmax;
+
+		sor_block_settle(blk, dmax, 1, sleep);
+	}
+
+	return delta;
+}
+
+/** @brief Performs a single iteration of the SOR algorithm on the
+ * correction equations in mixed precision on points of one color in one
+ * mesh block.
+ *
+ * @param blk Pointer to the mesh block.
+ * @param color Color of the mesh points to update.
+ * @param omega SOR extrapolation parameter. 
+ * @return Sum of squared changes of the correction. */
+static double sor_refine_block(struct block *blk, int color, n_float omega)
+{
+	n_float dmax;
+	double delta;
+	size_t off;
+	int z;
+
+	if(blk->n==NULL) {
+		return 0.0;
+	}
+
+	blk_halo_update_vec(blk, SOR_VEC_E, !color);
+
+	delta = 0.0;
+	dmax = 0.0;
+	for(z = 0; z < blk->size.z; z++) {
+		off = blk_off3(blk, v3i(-1, -1, z));
+
+		delta += sor_iterate_plane(blk, z, color, omega, 
+				&blk->vec[SOR_VEC_E][off], 
+				&blk->vec[SOR_VEC_F][off], &dmax);
+	}
+
+	return delta;
+}
+
+/** @brief Performs a single iteration of the SOR algorithm on mesh points of
+ * one color in one packed mesh block.
+ *
+ * Planes z - 1, z and z + 1 are unpacked into a work array from the 
+ * windows pool (see blk_unpack_plane()), plane z is updated and packed
+ * again. The work array is then shifted by one plane. Points of the other
+ * color are only read, also in neighboring blocks.
+ *
+ * @param sor Pointer to the SOR state.
+ * @param blk Pointer to the packed mesh block.
+ * @param color Color of the mesh points to update.
+ * @param omega SOR extrapolation parameter. 
+ * @return Sum of squared changes of mesh point values. */
+static double sor_pack_block(struct sor *sor, struct block *blk, int color,
+								n_float omega)
+{
+	n_float *w, dmax;
+	double delta;
+	size_t plane;
+	int i, z;
+
+	/* there are as many work arrays as threads, so one is always 
+	 * free */
+	for(i=0;__sync_lock_test_and_set(&sor->windowbusy[i], 1);) {
+		i=(i + 1) % sor->windownum;
+	}
+
+	w=sor->windows + i * sor->windowsize;
+
+	plane=(blk->size.x + 2) * (blk->size.y + 2);
+
+	blk_unpack_plane(blk, w, -1, !color);
+	blk_unpack_plane(blk, w + plane, 0, !color);
+
+	delta=0.0;
+	dmax=0.0;
+	for(z=0;z<blk->size.z;z++) {
+		blk_unpack_plane(blk, w + 2 * plane, z + 1, !color);
+
+		delta+=sor_iterate_plane(blk, z, color, omega, w + plane, 
+								NULL, &dmax);
+
+		blk_pack_plane(blk, w + plane, z, color);
+
+		memmove(w, w + plane, 2 * plane * sizeof(*w));
+	}
+
+	__sync_lock_release(&sor->windowbusy[i]);
+
+	blk->dmax=sqrt(dmax);
+
+	return delta;
+}
+
+/** @brief Arguments for sor_iterate_pass() */
+struct sor_pass {
+	struct space *sp;
+	struct sor *sor;
+	int color;
+	n_float omega;
+	n_float sleep;
+	int refine;
+};
+
+/** @brief Work item for the thread pool: update mesh points of one color in
+ * one variable mesh block. */
+static void sor_iterate_pass(void *arg, int n)
+{
+	struct sor_pass *pass;
+	struct block *blk;
+	double delta;
+
+	pass=arg;
+	blk=pass->sp->var[n];
+
+	if(pass->refine) {
+		delta=sor_refine_block(blk, pass->color, pass->omega);
+	} else if(blk->h!=NULL) {
+		delta=sor_pack_block(pass->sor, blk, pass->color, 
+								pass->omega);
+	} else {
+		delta=sor_iterate_block(blk, pass->color, pass->omega,
+								pass->sleep);
+	}
+
+	/* a sleeping block keeps the residual of its last sweep. It can
+	 * only wake up between colors, never fall asleep, so the residual of
+	 * black points is then added to the old one. */
+	if(delta<0.0) {
+		if(pass->color==0) blk->delta=0.0;
+		return;
+	}
+
+	/* the change of a point is omega times its residual (divided by the
+	 * sum of weights) */
+
+	if(pass->color==0) {
+		blk->delta=delta;
+		blk->resid=delta/(pass->omega*pass->omega);
+	} else {
+		blk->delta+=delta;
+		blk->resid+=delta/(pass->omega*pass->omega);
+	}
+}
+
+/** @brief Work item for the thread pool: refresh interpolated ghost points
+ * of one variable mesh block (see sp_refine()). Changes wake up sleeping 
+ * blocks like those of copied ghost points. */
+static void sor_link_pass(void *arg, int n)
+{
+	struct space *sp;
+	struct block *blk;
+	n_float change;
+
+	sp=arg;
+	blk=sp->var[n];
+
+	if(blk->linknum==0) return;
+
+	change=blk_link_update(blk);
+
+	if(blk->quiet >= SOR_SLEEP_SWEEPS) blk->drift += change;
+}
+
+/** @brief Refreshes interpolated ghost points of all variable mesh blocks.
+ *
+ * Sources of interpolated ghost points are in other blocks, so this can't
+ * be done together with copying the halos in sor_iterate_block().
+ *
+ * @param sp Pointer to the space struct. */
+static void sor_link(struct space *sp)
+{
+	if(sp->linked==0) return;
+
+	pool_run(sp->pool, sor_link_pass, sp, sp->varnum);
+}
+
+/** @brief Sums changes and residuals of all variable blocks.
+ *
+ * Sums are computed in block order, so that the result does not depend on
+ * the number of threads.
+ *
+ * @param sp Pointer to the space struct.
+ * @param resid Set to the sum of squared residuals (see sor_residual()).
+ * @return Sum of squared changes of mesh point values. */
+static double sor_sum(struct space *sp, double *resid)
+{
+	double delta;
+	int n;
+
+	delta=0.0;
+	*resid=0.0;
+	for(n=0;n<sp->varnum;n++) {
+		delta+=sp->var[n]->delta;
+		*resid+=sp->var[n]->resid;
+	}
+
+	return delta;
+}
+
+/** @brief Performs a single red-black SOR sweep on the whole mesh with
+ * a separate extrapolation parameter for each color.
+ *
+ * @param sp Pointer to the space struct.
+ * @param sor Pointer to the SOR state with work arrays for packed blocks.
+ * NULL if there are no packed blocks.
+ * @param omega0 SOR extrapolation parameter for red points.
+ * @param omega1 SOR extrapolation parameter for black points.
+ * @param sleep Threshold for small changes (0 to update all blocks).
+ * @param refine If set, the correction equations in mixed precision are 
+ * swept instead of mesh point values.
+ * @param resid Set to the sum of squared residuals (see sor_residual()).
+ * @return Sum of squared changes of mesh point values. */
+static double sor_sweep_rb(struct space *sp, struct sor *sor, n_float omega0,
+			n_float omega1, n_float sleep, int refine, double *resid)
+{
+	struct sor_pass pass;
+
+	pass.sp=sp;
+	pass.sor=sor;
+	pass.sleep=sleep;
+	pass.refine=refine;
+
+	for(pass.color=0;pass.color<2;pass.color++) {
+		pass.omega=(pass.color==0) ? omega0 : omega1;
+		sor_link(sp);
+		pool_run(sp->pool, sor_iterate_pass, &pass, sp->varnum);
+	}
+
+	return sor_sum(sp, resid);
+}
+
+/** @brief Arguments for sor_wave_pass() */
+struct sor_wave {
+	struct space *sp;
+	n_float *omega;
+	int sweeps;
+	n_float sleep;
+	int step;
+};
+
+/** @brief Work item for the thread pool: one step of the wavefront in one
+ * variable mesh block (see sor_sweep_wave()). */
+static void sor_wave_pass(void *arg, int n)
+{
+	struct sor_wave *wave;
+	struct block *blk;
+	n_float change, dmax;
+	double delta;
+	int h, z, color, last;
+
+	wave=arg;
+	blk=wave->sp->var[n];
+
+	if(blk->n==NULL) return;
+
+	last=2*wave->sweeps-2;
+
+	for(h=0;h<2*wave->sweeps;h++) {
+		z=wave->step-2*h-blk->pos.z;
+		if(z<0||z>=blk->size.z) continue;
+
+		color=h&1;
+
+		change=blk_halo_update_plane(blk, z, !color);
+
+		if(blk->quiet>=SOR_SLEEP_SWEEPS) blk->drift+=change;
+
+		if(sor_block_sleeping(blk, wave->sleep)) continue;
+
+		dmax=0.0;
+		delta=sor_iterate_plane(blk, z, color, wave->omega[h], 
+			&blk->n[blk_off3(blk, v3i(-1, -1, z))], NULL, &dmax);
+
+		/* changes are only counted in the last sweep */
+
+		if(h>=last) {
+			blk->delta+=delta;
+			blk->resid+=delta/(wave->omega[h]*wave->omega[h]);
+
+			dmax=sqrt(dmax);
+			if(dmax>blk->dmax) blk->dmax=dmax;
+		}
+	}
+}
+
+/** @brief Performs several red-black SOR sweeps on the whole mesh with
+ * temporal blocking.
+ *
+ * Half-sweeps are pipelined along the z axis. Half-sweep h (red for even
+ * h, black for odd h) updates plane z in step z + 2h. When it does, 
+ * half-sweep h - 1 has finished with planes z - 1, z and z + 1 in the 
+ * previous steps and half-sweep h + 1 doesn't start reading them before
+ * the next step. Points are therefore updated in exactly the same order as
+ * with separate sweeps, also across block boundaries. 
+ *
+ * Each step only touches a band of 4 * \a sweeps planes, so a plane stays
+ * in cache for all \a sweeps sweeps if the band fits, instead of being
+ * loaded from memory once per sweep. The price is one pass of the thread
+ * pool per step instead of two per sweep.
+ *
+ * @param sp Pointer to the space struct.
+ * @param omega Extrapolation parameters of the 2 * \a sweeps half-sweeps.
+ * @param sweeps Number of sweeps.
+ * @param sleep Threshold for small changes (0 to update all blocks).
+ * @param resid Set to the sum of squared residuals in the last sweep.
+ * @return Sum of squared changes of mesh point values in the last 
+ * sweep. */
+static double sor_sweep_wave(struct space *sp, n_float *omega, int sweeps,
+						n_float sleep, double *resid)
+{
+	struct sor_wave wave;
+	struct block *blk;
+	int n;
+
+	wave.sp=sp;
+	wave.omega=omega;
+	wave.sweeps=sweeps;
+	wave.sleep=sleep;
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		blk->delta=0.0;
+		blk->dmax=0.0;
+
+		/* sleeping blocks keep the residual of their last sweep 
+		 * (see sor_iterate_pass()) */
+		if(blk->quiet<SOR_SLEEP_SWEEPS || sleep<=0.0 || 
+							blk->drift>=sleep) {
+			blk->resid=0.0;
 		}
 	}
 
-	/* xprev */
+	for(wave.step=0;wave.step<sp->size.z+4*sweeps-2;wave.step++) {
+		pool_run(sp->pool, sor_wave_pass, &wave, sp->varnum);
+	}
 
-	pos.x = 0;
-	for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-		for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
 
-			if(BLK_CON(blk, pos)) continue;
-			
-			ITERATE_ONE
+		if(blk->quiet<SOR_SLEEP_SWEEPS) {
+			sor_block_settle(blk, blk->dmax, sweeps, sleep);
 		}
 	}
 
-	/* xnext */
+	return sor_sum(sp, resid);
+}
+
+/** @brief Performs line relaxation on one row of z-lines of one color in 
+ * a run of variable blocks.
+ *
+ * Each line is solved with the Thomas algorithm. Lines in the row are
+ * processed together, with the loop over x innermost, so that the 
+ * elimination is vectorized across lines.
+ *
+ * Written as a*u(z-1) - u(z) + b*u(z+1) = -r, where a and b are the weights
+ * in z direction divided by the sum of weights and r is the weighted sum
+ * of the neighbors in x and y direction. The forward pass computes
+ * e(z) = b / (1 - a*e(z-1)) and f(z) = (r + a*f(z-1)) / (1 - a*e(z-1)), so
+ * that u(z) = f(z) + e(z)*u(z+1). Constant points have e = 0 and f equal to
+ * their value.
+ *
+ * @param first Lowest block of the run.
+ * @param y Block coordinate of the row.
+ * @param color Color of the lines to update.
+ * @param omega SOR extrapolation parameter.
+ * @param e Work space, at least (height of the run) * size.x values.
+ * @param f Work space, same size as \a e. */
+static void sor_iterate_row(struct block *first, int y, int color, 
+					n_float omega, n_float *e, n_float *f)
+{
+	struct block *blk;
+	n_float *k[BLK_K_NUM];
+	n_float *o, *oy1, *oy2, *eb, *fb, *ep, *fp;
+	n_float a, b, r, m, d, dmax;
+	double delta;
+	size_t off;
+	int x, x0, z, nx, s;
+
+	nx=first->size.x;
+
+	x0=(first->pos.x + first->pos.y + y + color) & 1;
+
+	/* forward elimination, starting from the lowest block */
+
+	ep=NULL;
+	fp=NULL;
+	eb=e;
+	fb=f;
+	for(blk=first;blk!=NULL && blk->n!=NULL;blk=blk->znext) {
+		for(z=0;z<blk->size.z;z++) {
+			o=&BLK_N(blk, v3i(0, y, z));
+			oy1=&BLK_N(blk, v3i(0, y - 1, z));
+			oy2=&BLK_N(blk, v3i(0, y + 1, z));
+			off=blk_off3(blk, v3i(0, y, z));
+
+			s=blk_coef_row(blk, v3i(0, y, z), k);
+
+			for(x=x0;x<nx;x+=2) {
+				if(BLK_CON_OFF(blk, off + x)) {
+					eb[x]=0.0;
+					fb[x]=o[x];
+					continue;
+				}
+
+				a=k[BLK_K_Z1][x*s] * k[BLK_K_D][x*s];
+				b=k[BLK_K_Z2][x*s] * k[BLK_K_D][x*s];
 
-	if(blk->size.x > 1) {
-		pos.x = blk->size.x-1;
-		for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-			for(pos.y = 0; pos.y < blk->size.y; pos.y++) {
+				r=k[BLK_K_X1][x*s] * o[x-1] + 
+					k[BLK_K_X2][x*s] * o[x+1] +
+					k[BLK_K_Y1][x*s] * oy1[x] + 
+					k[BLK_K_Y2][x*s] * oy2[x];
+				r*=k[BLK_K_D][x*s];
 
-				if(BLK_CON(blk, pos)) continue;
+				/* the line ends at a constant block */
+
+				if(ep==NULL) {
+					if(blk->zprev!=NULL) {
+						r+=a * blk->zprev->c_n;
+					}
+					a=0.0;
+				}
+				if(z==blk->size.z-1 && (blk->znext==NULL ||
+						blk->znext->n==NULL)) {
+					if(blk->znext!=NULL) {
+						r+=b * blk->znext->c_n;
+					}
+					b=0.0;
+				}
 
-				ITERATE_ONE
+				if(ep==NULL) {
+					eb[x]=b;
+					fb[x]=r;
+				} else {
+					m=1.0/(1.0 - a * ep[x]);
+					eb[x]=b * m;
+					fb[x]=(r + a * fp[x]) * m;
+				}
 			}
+
+			ep=eb;
+			fp=fb;
+			eb+=nx;
+			fb+=nx;
 		}
 	}
 
+	/* back substitution, f is replaced by the solution */
+
+	for(blk=first;blk->znext!=NULL && blk->znext->n!=NULL;
+							blk=blk->znext);
 
-	/* yprev */
+	fp=NULL;
+	for(;blk!=first->zprev;blk=blk->zprev) {
+		delta=0.0;
+		dmax=0.0;
 
-	pos.y = 0;
-	for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-		for(pos.x = 1; pos.x < blk->size.x - 1; pos.x++) {
+		for(z=blk->size.z-1;z>=0;z--) {
+			eb-=nx;
+			fb-=nx;
 
-			if(BLK_CON(blk, pos)) continue;
-			
-			ITERATE_ONE
+			o=&BLK_N(blk, v3i(0, y, z));
+			off=blk_off3(blk, v3i(0, y, z));
+
+			for(x=x0;x<nx;x+=2) {
+				if(fp!=NULL) fb[x]+=eb[x] * fp[x];
+
+				if(BLK_CON_OFF(blk, off + x)) continue;
+
+				d=omega * (fb[x] - o[x]);
+				o[x]+=d;
+
+				delta+=d * d;
+				if(d * d > dmax) dmax=d * d;
+			}
+
+			fp=fb;
 		}
+
+		blk->delta+=delta;
+		blk->resid+=delta/(omega * omega);
+
+		dmax=sqrt(dmax);
+		if(dmax > blk->dmax) blk->dmax=dmax;
 	}
+}
+
+/** @brief Arguments for sor_lines_pass() */
+struct sor_lines {
+	struct sor *sor;
+	int color;
+	n_float omega;
+};
 
-	/* ynext */
+/** @brief Work item for the thread pool: line relaxation of lines of one
+ * color in one run of variable blocks. */
+static void sor_lines_pass(void *arg, int n)
+{
+	struct sor_lines *lines;
+	struct block *first, *blk;
+	n_float *e, *f;
+	int y;
 
-	if(blk->size.y > 1) {
-		pos.y = blk->size.y-1;
-		for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-			for(pos.x = 1; pos.x < blk->size.x - 1; pos.x++) {
+	lines=arg;
+	first=lines->sor->runs[n];
 
-				if(BLK_CON(blk, pos)) continue;
+	e=lines->sor->linebuf + (size_t) n * lines->sor->linesize;
+	f=e + lines->sor->linesize / 2;
 
-				ITERATE_ONE
-			}
+	for(blk=first;blk!=NULL && blk->n!=NULL;blk=blk->znext) {
+		blk_halo_update_lines(blk, !lines->color);
+
+		if(lines->color==0) {
+			blk->delta=0.0;
+			blk->resid=0.0;
+			blk->dmax=0.0;
 		}
 	}
+
+	for(y=0;y<first->size.y;y++) {
+		sor_iterate_row(first, y, lines->color, lines->omega, e, f);
+	}
 }
 
-/** @brief Performs a single SOR iteration on the center of a heterogeneous 
- * mesh block 
+/** @brief Finds runs of variable blocks for line relaxation and allocates
+ * work space for them.
  *
- * @param blk Pointer to the mesh block. */
-int static sor_iterate_block_n(struct block *blk)
+ * @param sor Pointer to the SOR state.
+ * @return 0 on success and -1 on error. */
+static int sor_lines_init(struct sor *sor)
 {
-	n_float n1,n2;
-	n_float kx1,kx2,ky1,ky2,kz;
-	n_float ex1y1, ex1y2, ex2y1, ex2y2;
-	n_float ax,ay,az;
+	struct space *sp;
+	struct block *blk;
+	int n, height;
+
+	sp=sor->sp;
+
+	sor->runs=n_calloc(sp->varnum, sizeof(*sor->runs));
+	if(sor->runs==NULL) return -1;
+
+	sor->runnum=0;
+	sor->linesize=0;
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		if(blk->zprev!=NULL && blk->zprev->n!=NULL) continue;
+
+		sor->runs[sor->runnum++]=blk;
+
+		height=0;
+		for(;blk!=NULL && blk->n!=NULL;blk=blk->znext) {
+			height+=blk->size.z;
+		}
+
+		if(2 * height * sp->var[n]->size.x > sor->linesize) {
+			sor->linesize=2 * height * sp->var[n]->size.x;
+		}
+	}
+
+	sor->linebuf=n_calloc((size_t) sor->runnum * sor->linesize, 
+							sizeof(*sor->linebuf));
+	if(sor->linebuf==NULL) return -1;
+
+	return 0;
+}
 
+/** @brief Performs a single red-black line SOR sweep on the whole mesh.
+ *
+ * @param sor Pointer to the SOR state.
+ * @param omega0 SOR extrapolation parameter for red lines.
+ * @param omega1 SOR extrapolation parameter for black lines.
+ * @param resid Set to the sum of squared residuals (see sor_residual()).
+ * @return Sum of squared changes of mesh point values. */
+static double sor_sweep_lines(struct sor *sor, n_float omega0, 
+					n_float omega1, double *resid)
+{
 	struct space *sp;
+	struct sor_lines lines;
 
-	n_v3i pos;
+	sp=sor->sp;
+
+	lines.sor=sor;
+
+	for(lines.color=0;lines.color<2;lines.color++) {
+		lines.omega=(lines.color==0) ? omega0 : omega1;
+		pool_run(sp->pool, sor_lines_pass, &lines, sor->runnum);
+	}
+
+	return sor_sum(sp, resid);
+}
+
+/** @brief Work item for the thread pool: adjusts the range of packed 
+ * values in one variable mesh block. */
+static void sor_rescale_pass(void *arg, int n)
+{
+	struct space *sp;
+	struct block *blk;
+
+	sp=arg;
+	blk=sp->var[n];
+
+	if(blk->h!=NULL) blk_pack_rescale(blk);
+}
+
+/** @brief Converts all packed blocks back to single precision.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return 0 on success and -1 on error. */
+static int sor_unpack(struct sor *sor)
+{
+	struct space *sp;
+	struct block *blk;
+	int n;
+
+	sp=sor->sp;
 
-	assert(blk->a!=NULL);
+	if(sor->windows!=NULL) {
+		n_free(sor->windows);
+		sor->windows=NULL;
+	}
+	if(sor->windowbusy!=NULL) {
+		n_free(sor->windowbusy);
+		sor->windowbusy=NULL;
+	}
+	sor->windownum=0;
 
-	sp=blk->sp;
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
 
-	ax=sp->step.z * sp->step.y / 2 / sp->step.x;
-	ay=sp->step.z * sp->step.x / 2 / sp->step.y;
-	az=sp->step.x * sp->step.y / 4 / sp->step.z;
+		if(blk->h==NULL) continue;
 
-	for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-		for(pos.y = 1; pos.y < blk->size.y - 1; pos.y++) {
-			for(pos.x = 1; pos.x < blk->size.x - 1; pos.x++) {
-				if(BLK_CON(blk, pos)) continue;
+		if(blk_unpack(blk)) {
+			error("Can't allocate memory to unpack mesh blocks");
+			return -1;
+		}
 
-				ex1y1=BLK_A(blk, v3i_sub(pos, v3i(1,1,0)));
-				ex1y2=BLK_A(blk, v3i_sub(pos, v3i(1,0,0)));
-				ex2y1=BLK_A(blk, v3i_sub(pos, v3i(0,1,0)));
-				ex2y2=BLK_A(blk, v3i_sub(pos, v3i(0,0,0)));
+		sor->packed--;
+	}
 
-				kz=(ex1y1+ex1y2+ex2y1+ex2y2)*az;
+	debug("Unpacked mesh blocks, relative residual norm %e", 
+							sor_residual(sor));
 
-				kx1=(ex1y1+ex1y2)*ax;
-				kx2=(ex2y1+ex2y2)*ax;
+	return 0;
+}
 
-				ky1=(ex1y1+ex2y1)*ay;
-				ky2=(ex1y2+ex2y2)*ay;
+/** @brief Packs mesh point values of variable blocks and allocates work 
+ * arrays for packed sweeps.
+ *
+ * The solution always lies between the smallest and the largest value of
+ * a constant point, so the range of packed values in each block starts 
+ * from there. Starting from the values in the block would clamp values 
+ * that are still growing from the initial zero.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return 0 on success and -1 on error. */
+static int sor_pack(struct sor *sor)
+{
+	struct space *sp;
+	struct block *blk;
+	n_float lo, hi;
+	n_v3i pos;
+	size_t size;
+	int n, r;
 
-				n1=0.0;
-				n1+=kx1*BLK_N(blk, v3i_sub(pos, v3i_x));
-				n1+=kx2*BLK_N(blk, v3i_add(pos, v3i_x));
-				n1+=ky1*BLK_N(blk, v3i_sub(pos, v3i_y));
-				n1+=ky2*BLK_N(blk, v3i_add(pos, v3i_y));
-				n1+=kz*BLK_N(blk, v3i_sub(pos, v3i_z));
-				n1+=kz*BLK_N(blk, v3i_add(pos, v3i_z));
+	sp=sor->sp;
 
-				n1=n1/(kx1+kx2+ky1+ky2+2*kz);
+	sor->windownum=pool_threads(sp->pool);
 
-				n2=(1.0 - a_soromega) * BLK_N(blk, pos) + 
-							a_soromega * n1;
+	sor->windowsize=0;
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
 
-				BLK_N(blk, pos) = n2;
+		size=(size_t) 3 * (blk->size.x + 2) * (blk->size.y + 2);
+		if(size>sor->windowsize) sor->windowsize=size;
+	}
+
+	sor->windows=n_calloc(sor->windownum * sor->windowsize, 
+							sizeof(*sor->windows));
+	sor->windowbusy=n_calloc(sor->windownum, sizeof(*sor->windowbusy));
+	if(sor->windows==NULL || sor->windowbusy==NULL) {
+		sor_unpack(sor);
+		return -1;
+	}
+
+	lo=0.0;
+	hi=0.0;
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+			for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+				for(pos.x=0;pos.x<blk->size.x;pos.x++) {
+					if(!BLK_CON(blk, pos)) continue;
+
+					if(BLK_N(blk, pos) < lo) {
+						lo=BLK_N(blk, pos);
+					}
+					if(BLK_N(blk, pos) > hi) {
+						hi=BLK_N(blk, pos);
+					}
+				}
 			}
 		}
 	}
 
+	sor->packed=0;
+	for(n=0;n<sp->varnum;n++) {
+		r=blk_pack(sp->var[n], lo, hi);
+		if(r<0) {
+			sor_unpack(sor);
+			return -1;
+		}
+		if(r==0) sor->packed++;
+	}
+
+	info("Packed %d of %d variable blocks into 16 bits", sor->packed,
+								sp->varnum);
+
+	if(sor->packed==0) sor_unpack(sor);
+
 	return 0;
 }
 
-/** @brief Performs a single SOR iteration on the center of a homogeneous 
- * mesh block 
+/** @brief Work item for the thread pool: adds the correction in mixed
+ * precision to the solution in one variable mesh block.
  *
- * @param blk Pointer to the mesh block. */
-void static sor_iterate_block_h(struct block *blk)
+ * The sum is rounded to single precision for \a n and the rest is kept in
+ * the work array BLK_VEC_LO. The correction is reset to zero. */
+static void sor_fold_pass(void *arg, int n)
 {
-	n_float n1,n2;
-	n_float kx,ky,kz;
-	n_float bx,by,bz;
-	n_float ks;
+	struct space *sp;
+	struct block *blk;
+	n_float *u, *lo, *e;
+	double t;
+	size_t i, memsize;
+
+	sp=arg;
+	blk=sp->var[n];
+
+	if(blk->n==NULL) return;
+
+	u=blk->n;
+	lo=blk->vec[BLK_VEC_LO];
+	e=blk->vec[SOR_VEC_E];
+
+	memsize=(blk->size.x + 2) * (blk->size.y + 2) * (blk->size.z + 2);
+
+	for(i=0;i<memsize;i++) {
+		t=(double) u[i] + lo[i] + e[i];
 
+		u[i]=t;
+		lo[i]=t - u[i];
+		e[i]=0.0;
+	}
+}
+
+/** @brief Work item for the thread pool: computes the residual of the
+ * solution in mixed precision in one variable mesh block.
+ *
+ * The residual of each variable point is computed in double precision from
+ * the sum of \a n and BLK_VEC_LO and stored, divided by the sum of 
+ * weights, as the right hand side of the correction equations. Its squared
+ * norm is stored in \a resid of the block. */
+static void sor_defect_pass(void *arg, int n)
+{
 	struct space *sp;
+	struct block *blk;
+	n_float *k[BLK_K_NUM];
+	n_float *o, *l, *f;
+	double r, resid;
 
 	n_v3i pos;
+	size_t off, sy, sz;
+	int x, i, stride;
+
+	sp=arg;
+	blk=sp->var[n];
 
-	assert(blk->a == NULL);
+	blk->delta=0.0;
+	blk->resid=0.0;
 
-	sp=blk->sp;
+	if(blk->n==NULL) return;
 
-	bx = sp->step.z * sp->step.y / sp->step.x;
-	by = sp->step.z * sp->step.x / sp->step.y;
-	bz = sp->step.x * sp->step.y / sp->step.z;
+	blk_halo_update(blk, -1);
+	blk_halo_update_vec(blk, BLK_VEC_LO, -1);
 
-	kx = blk->c_a * bx;
-	ky = blk->c_a * by;
-	kz = blk->c_a * bz;
+	sy=blk->size.x + 2;
+	sz=sy * (blk->size.y + 2);
 
-	ks=1/(2*kx+2*ky+2*kz);
+	resid=0.0;
 
-	for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-		for(pos.y = 1; pos.y < blk->size.y - 1; pos.y++) {
-			for(pos.x = 1; pos.x < blk->size.x - 1; pos.x++) {
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			pos.x=0;
 
-				if(BLK_CON(blk, pos)) continue;
+			off=blk_off3(blk, pos);
 
-				n1=0;
-				n1+=kx*(BLK_N(blk, v3i_sub(pos, v3i_x)) +
-					BLK_N(blk, v3i_add(pos, v3i_x)));
+			o=&blk->n[off];
+			l=&blk->vec[BLK_VEC_LO][off];
+			f=&blk->vec[SOR_VEC_F][off];
 
-				n1+=ky*(BLK_N(blk, v3i_sub(pos, v3i_y)) +
-					BLK_N(blk, v3i_add(pos, v3i_y)));
+			stride=blk_coef_row(blk, pos, k);
+
+			for(x=0;x<blk->size.x;x++) {
+				if(BLK_CON_OFF(blk, off + x)) {
+					f[x]=0.0;
+					continue;
+				}
 
-				n1+=kz*(BLK_N(blk, v3i_sub(pos, v3i_z)) +
-					BLK_N(blk, v3i_add(pos, v3i_z)));
+				i=x*stride;
 
-				n1=n1*ks;
+				r=k[BLK_K_X1][i] * ((double) o[x-1] + l[x-1]) +
+				  k[BLK_K_X2][i] * ((double) o[x+1] + l[x+1]) +
+				  k[BLK_K_Y1][i] * ((double) o[x-sy] + l[x-sy]) +
+				  k[BLK_K_Y2][i] * ((double) o[x+sy] + l[x+sy]) +
+				  k[BLK_K_Z1][i] * ((double) o[x-sz] + l[x-sz]) +
+				  k[BLK_K_Z2][i] * ((double) o[x+sz] + l[x+sz]);
 
-				n2=(1.0 - a_soromega) * BLK_N(blk, pos) + 
-							a_soromega * n1;
+				r=r * k[BLK_K_D][i] - ((double) o[x] + l[x]);
 
-				
-				BLK_N(blk, pos) = n2;
+				f[x]=r;
+				resid+=r * r;
 			}
 		}
 	}
+
+	blk->resid=resid;
 }
 
-/** @brief Performs a single SOR iteration on the center of a homogeneous 
- * mesh block 
+/** @brief Work item for the thread pool: computes the residual of the
+ * current mesh point values in one variable mesh block.
  *
- * @param blk Pointer to the mesh block. */
-void static sor_iterate_block_h_fast(struct block *blk)
+ * The squared norm of the residuals of variable points, divided by the sum
+ * of weights, is stored in \a resid of the block. */
+static void sor_resid_pass(void *arg, int n)
 {
-	n_float n1,n2;
-	n_float kx,ky,kz;
-	n_float bx,by,bz;
-	n_float ks;
-
 	struct space *sp;
+	struct block *blk;
+	n_float *k[BLK_K_NUM];
+	n_float *o;
+	double r, resid;
 
-	int stopx;
+	n_v3i pos;
+	size_t off, sy, sz;
+	int x, i, stride;
 
-	n_float *o, *ox1, *ox2, *oy1, *oy2, *oz1, *oz2;
-	char *con;
+	sp=arg;
+	blk=sp->var[n];
 
-	n_v3i pos;
+	blk->delta=0.0;
+	blk->resid=0.0;
 
-	assert(blk->a == NULL);
+	if(blk->n==NULL) return;
 
-	sp=blk->sp;
+	blk_halo_update(blk, -1);
 
-	bx = sp->step.z * sp->step.y / sp->step.x;
-	by = sp->step.z * sp->step.x / sp->step.y;
-	bz = sp->step.x * sp->step.y / sp->step.z;
+	sy=blk->size.x + 2;
+	sz=sy * (blk->size.y + 2);
 
-	kx = blk->c_a * bx;
-	ky = blk->c_a * by;
-	kz = blk->c_a * bz;
+	resid=0.0;
 
-	ks = 1/(2*kx+2*ky+2*kz);
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			pos.x=0;
 
-	kx = kx * ks;
-	ky = ky * ks;
-	kz = kz * ks;
+			off=blk_off3(blk, pos);
+			o=&blk->n[off];
 
-	stopx = blk->size.x - 1;
+			stride=blk_coef_row(blk, pos, k);
 
-	for(pos.z = 1; pos.z < blk->size.z - 1; pos.z++) {
-		for(pos.y = 1; pos.y < blk->size.y - 1; pos.y++) {
-			pos.x = 1;
+			for(x=0;x<blk->size.x;x++) {
+				if(BLK_CON_OFF(blk, off + x)) continue;
 
-			o = &BLK_N(blk, pos);
+				i=x*stride;
 
-			ox1 = &BLK_N(blk, v3i_sub(pos, v3i_x));
-			ox2 = &BLK_N(blk, v3i_add(pos, v3i_x));
+				r=k[BLK_K_X1][i] * o[x-1] + k[BLK_K_X2][i] * o[x+1] +
+				  k[BLK_K_Y1][i] * o[x-sy] + 
+				  k[BLK_K_Y2][i] * o[x+sy] +
+				  k[BLK_K_Z1][i] * o[x-sz] + 
+				  k[BLK_K_Z2][i] * o[x+sz];
 
-			oy1 = &BLK_N(blk, v3i_sub(pos, v3i_y));
-			oy2 = &BLK_N(blk, v3i_add(pos, v3i_y));
+				r=r * k[BLK_K_D][i] - o[x];
 
-			oz1 = &BLK_N(blk, v3i_sub(pos, v3i_z));
-			oz2 = &BLK_N(blk, v3i_add(pos, v3i_z));
+				resid+=r * r;
+			}
+		}
+	}
 
-			con = &BLK_CON(blk, pos);
+	blk->resid=resid;
+}
 
-			for(; pos.x < stopx; pos.x++) {
+/** @brief Measures the relative residual norm against the current mesh
+ * point values.
+ *
+ * Normally the residual norm is relative to the residual after the first
+ * sweep. When the iteration starts from a guess, that residual is already
+ * small and the relative norm would ask for more accuracy than usual. 
+ * Calling this before the guess is written makes the norm relative to the
+ * residual of the values before the guess instead. This is the residual
+ * that the first sweep sees on red points and a little smaller than the 
+ * one it sees on black points, so the criterion is slightly stricter than
+ * without a guess.
+ *
+ * @param sor Pointer to the SOR state, before the first sor_iterate(). */
+void sor_reference(struct sor *sor)
+{
+	struct space *sp;
 
-				if(!(*con)) {
+	sp=sor->sp;
 
-					n1=kx * ((*ox1) + (*ox2));
+	sor_link(sp);
+	pool_run(sp->pool, sor_resid_pass, sp, sp->varnum);
 
-					n1+=ky * ((*oy1) + (*oy2));
+	sor_sum(sp, &sor->resid_first);
+	sor->solve_first=sor->resid_first;
+	sor->resid=sor->resid_first;
+}
 
-					n1+=kz * ((*oz1) + (*oz2));
+/** @brief Arguments of sor_scale_pass(). */
+struct sor_scale {
+	struct space *sp;
+	n_float factor;
+};
 
-					n2=(1.0 - a_soromega) * (*o) + 
-							a_soromega * n1;
+/** @brief Multiplies values of variable points of one block with a 
+ * factor.
+ *
+ * @param arg Pointer to struct sor_scale.
+ * @param n Index of the block in \a var of the space struct. */
+static void sor_scale_pass(void *arg, int n)
+{
+	struct sor_scale *scale;
+	struct block *blk;
+	n_v3i pos;
+	size_t off;
+	int x;
 
-				
-					(*o) = n2;
-				}
+	scale=arg;
+	blk=scale->sp->var[n];
 
-				ox1=o;
-				o=ox2;
-				ox2++;
+	if(blk->n==NULL) return;
 
-				oy1++;
-				oy2++;
+	for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+		for(pos.y=0;pos.y<blk->size.y;pos.y++) {
+			pos.x=0;
+			off=blk_off3(blk, pos);
 
-				oz1++;
-				oz2++;
+			for(x=0;x<blk->size.x;x++) {
+				if(BLK_CON_OFF(blk, off + x)) continue;
 
-				con++;
+				blk->n[off + x]*=scale->factor;
 			}
 		}
 	}
 }
 
-/** @brief Peforms a single iteration of the SOR algorithm on one mesh block.
+/** @brief Scales a starting guess to the smallest residual norm.
  *
- * @param blk Pointer to the mesh block. */
-void sor_iterate_block(struct block *blk) 
+ * The residual is linear in the scale of the guess, so its squared norm 
+ * is a parabola that is found from the residuals of the guess and of 
+ * twice the guess. A guess that is only right near the nets would 
+ * otherwise add a large smooth error far from them, which SOR removes 
+ * slowest. The scale is limited to between 0 and 1.
+ *
+ * @param sor Pointer to the SOR state, after sor_reference(). Variable 
+ * points must hold the guess and were zero when sor_reference() was 
+ * called. 
+ * @return The chosen scale. */
+n_float sor_guess_scale(struct sor *sor)
 {
-	assert(blk->size.x > 0);
-	assert(blk->size.y > 0);
-	assert(blk->size.z > 0);
+	struct sor_scale scale;
+	struct space *sp;
+	double r0, r1, r2, a, b;
 
-	if(blk->n==NULL) {
+	sp=sor->sp;
+
+	r0=sor->resid_first;
+
+	sor_link(sp);
+	pool_run(sp->pool, sor_resid_pass, sp, sp->varnum);
+	sor_sum(sp, &r1);
+
+	scale.sp=sp;
+	scale.factor=2.0;
+	pool_run(sp->pool, sor_scale_pass, &scale, sp->varnum);
+
+	sor_link(sp);
+	pool_run(sp->pool, sor_resid_pass, sp, sp->varnum);
+	sor_sum(sp, &r2);
+
+	/* |r0 + x w|^2 = r0 + 2 b x + a x^2 */
+	a=(r2 - 2.0*r1 + r0)/2.0;
+	b=(r1 - r0 - a)/2.0;
+
+	scale.factor=0.0;
+	if(a>0.0) {
+		scale.factor=-b/a;
+		if(scale.factor<0.0) scale.factor=0.0;
+		if(scale.factor>1.0) scale.factor=1.0;
+	}
+
+	debug("Guess scale %f, residual %e instead of %e", scale.factor,
+					r0 + 2.0*b*scale.factor + 
+					a*scale.factor*scale.factor, r0);
+
+	scale.factor/=2.0;
+	pool_run(sp->pool, sor_scale_pass, &scale, sp->varnum);
+
+	return scale.factor*2.0;
+}
+
+/** @brief Allocates work arrays for mixed precision.
+ *
+ * @param sp Pointer to the space struct.
+ * @return 0 on success and -1 on error. */
+static int sor_refine_init(struct space *sp)
+{
+	struct block *blk;
+	int n;
+
+	for(n=0;n<sp->varnum;n++) {
+		blk=sp->var[n];
+
+		if(blk_vec_alloc(blk, SOR_VEC_E)) return -1;
+		if(blk_vec_alloc(blk, SOR_VEC_F)) return -1;
+		if(blk_vec_alloc(blk, BLK_VEC_LO)) return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Starts the next correction in mixed precision.
+ *
+ * The current correction is added to the solution and the right hand side
+ * of the next one is computed. The residual norm is replaced with the
+ * one computed in double precision.
+ *
+ * @param sor Pointer to the SOR state. */
+static void sor_refine(struct sor *sor)
+{
+	struct space *sp;
+
+	sp=sor->sp;
+
+	pool_run(sp->pool, sor_fold_pass, sp, sp->varnum);
+	pool_run(sp->pool, sor_defect_pass, sp, sp->varnum);
+
+	sor_sum(sp, &sor->resid);
+
+	sor->refines++;
+	sor->solve_first=sor->resid;
+
+	/* the error of the correction is a new problem for Chebyshev
+	 * acceleration */
+	sor->cheb=0.0;
+
+	debug("Mixed precision correction %d, relative residual norm %e",
+						sor->refines, sor_residual(sor));
+}
+
+/** @brief Unpacks packed blocks and adds the last correction in mixed 
+ * precision to the solution.
+ *
+ * Must be called after the last sor_iterate(), before mesh 
+ * point values are used. The iteration can continue afterwards: in mixed
+ * precision the right hand side of the correction is computed again for
+ * the new solution. Continuing the correction from zero with it is the 
+ * same iteration as before in exact arithmetic, so Chebyshev acceleration
+ * is not restarted.
+ *
+ * @param sor Pointer to the SOR state. */
+void sor_finish(struct sor *sor)
+{
+	struct space *sp;
+
+	sp=sor->sp;
+
+	if(sor->packed>0) sor_unpack(sor);
+
+	if(sor->refines<=0) return;
+
+	pool_run(sp->pool, sor_fold_pass, sp, sp->varnum);
+	pool_run(sp->pool, sor_defect_pass, sp, sp->varnum);
+
+	sor_sum(sp, &sor->resid);
+}
+
+/** @brief Performs a single red-black SOR sweep on the whole mesh.
+ *
+ * Only variable mesh blocks (listed by sp_optimize()) are updated. If the 
+ * space has a thread pool, blocks are processed concurrently.
+ *
+ * @param sp Pointer to the space struct.
+ * @param omega SOR extrapolation parameter (1.0 for a Gauss-Seidel 
+ * sweep). 
+ * @return Sum of squared changes of mesh point values. */
+double sor_sweep(struct space *sp, n_float omega)
+{
+	double resid;
+
+	return sor_sweep_rb(sp, NULL, omega, omega, 0.0, 0, &resid);
+}
+
+/** @brief Refines the estimate of the optimal omega after a sweep.
+ *
+ * @param sor Pointer to the SOR state.
+ * @param delta Sum of squared changes in the last sweep.
+ * @param sweeps Number of sweeps since the last call. */
+static void sor_auto_update(struct sor *sor, double delta, int sweeps)
+{
+	double lambda, mu2, omega, last;
+
+	last=sor->last;
+	sor->last=delta;
+
+	if(sor->first<=0.0) sor->first=delta;
+
+	sor->sweeps+=sweeps;
+
+	if(sor->frozen) return;
+
+	if(last<=0.0 || delta<=0.0) return;
+	if(delta<sor->first*SOR_AUTO_FLOOR*SOR_AUTO_FLOOR) return;
+
+	lambda=pow(delta/last, 0.5/sweeps);
+
+	/* updates only grow shortly after omega was changed, unless it is
+	 * already above the optimum */
+	if(lambda>1.0 && sor->sweeps>=SOR_AUTO_SWEEPS) {
+		sor->frozen=1;
+		return;
+	}
+
+	if(fabs(lambda-sor->lambda) > SOR_AUTO_TOLERANCE*lambda) {
+		sor->lambda=lambda;
 		return;
 	}
+	sor->lambda=lambda;
+
+	if(sor->sweeps<SOR_AUTO_SWEEPS) return;
+
+	/* the relation only holds while the dominant eigenvalue is real,
+	 * that is while omega is below the optimum */
+	if(lambda>=1.0 || lambda<=sor->omega-1.0) return;
+
+	mu2=(lambda+sor->omega-1.0)*(lambda+sor->omega-1.0)/
+						(lambda*sor->omega*sor->omega);
+	if(mu2>=1.0) {
+		omega=SOR_AUTO_MAX;
+	} else {
+		omega=2.0/(1.0+sqrt(1.0-mu2));
+		if(omega>SOR_AUTO_MAX) omega=SOR_AUTO_MAX;
+	}
+
+	if(omega<sor->omega+SOR_AUTO_STEP) return;
+
+	sor->omega=omega;
+	sor->sweeps=0;
+
+	debug("SOR omega estimated at %.3f (update ratio %.4f)", sor->omega,
+									lambda);
+}
+
+/** @brief Frees work space for line relaxation.
+ *
+ * @param sor Pointer to the SOR state. */
+static void sor_lines_done(struct sor *sor)
+{
+	if(sor->runs!=NULL) {
+		n_free(sor->runs);
+		sor->runs=NULL;
+	}
+	if(sor->linebuf!=NULL) {
+		n_free(sor->linebuf);
+		sor->linebuf=NULL;
+	}
+	sor->runnum=0;
+	sor->linesize=0;
+}
+
+/** @brief Starts the SOR solver on a mesh.
+ *
+ * Estimation of the extrapolation parameter, Chebyshev acceleration and 
+ * the residual norm start from the beginning, with Gauss-Seidel sweeps.
+ * Settings are copied from a_sorrelax, a_sorprecision and a_sorstorage.
+ *
+ * All state is kept in the returned struct, so different meshes can be
+ * iterated at the same time.
+ *
+ * @param sp Pointer to the space struct, after sp_optimize().
+ * @param tol Requested relative accuracy of the solution. Blocks whose
+ * changes are small compared to it are put to sleep.
+ * @return Pointer to the SOR state or NULL on error. */
+struct sor *sor_init(struct space *sp, n_float tol)
+{
+	struct sor *sor;
+
+	assert(sp!=NULL);
+
+	sor=n_calloc(1, sizeof(*sor));
+	if(sor==NULL) return NULL;
+
+	sor->sp=sp;
+
+	sor->relax=a_sorrelax;
+	sor->precision=a_sorprecision;
+	sor->storage=a_sorstorage;
+
+	sor->omega=1.0;
+	sor->sweeps=0;
+	sor->frozen=0;
+	sor->first=0.0;
+	sor->last=0.0;
+	sor->lambda=0.0;
+	sor->cheb=0.0;
+	sor->resid_first=0.0;
+	sor->resid=0.0;
+	sor->sleep=0.0;
+	sor->tol=tol;
+	sor->wake=0;
+	sor->awake=1;
+	sor->refines=0;
+	sor->solve_first=0.0;
+	sor->packed=0;
+	sor->packdone=0;
+	sor->pack_best=0.0;
+	sor->pack_stall=0;
+
+	sor->windows=NULL;
+	sor->windowbusy=NULL;
+	sor->windownum=0;
+	sor->windowsize=0;
+
+	sor->runs=NULL;
+	sor->runnum=0;
+	sor->linebuf=NULL;
+	sor->linesize=0;
+
+	return sor;
+}
+
+/** @brief Frees memory used by the SOR solver.
+ *
+ * Blocks that are still packed stay packed, so sor_finish() must be 
+ * called first if mesh point values are used afterwards.
+ *
+ * @param sor Pointer to the SOR state. */
+void sor_done(struct sor *sor)
+{
+	sor_lines_done(sor);
+
+	if(sor->windows!=NULL) n_free(sor->windows);
+	if(sor->windowbusy!=NULL) n_free(sor->windowbusy);
+
+	n_free(sor);
+}
+
+/** @brief Extrapolation parameter that is currently used.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return a_soromega or the current estimate in automatic mode. */
+n_float sor_get_omega(struct sor *sor)
+{
+	if(a_soromega_auto) return sor->omega;
+
+	return a_soromega;
+}
 
-	if(blk->a==NULL) {
-		sor_iterate_block_h_fast(blk);
+/** @brief Extrapolation parameter of the next half-sweep with Chebyshev
+ * acceleration.
+ *
+ * @param rho2 Square of the spectral radius of the Jacobi iteration.
+ * @param omega Extrapolation parameter of the previous half-sweep or 0 
+ * before the first one.
+ * @return Extrapolation parameter. */
+n_float sor_cheb_next(double rho2, n_float omega)
+{
+	if(omega==0.0) {
+		return 1.0;
+	} else if(omega==1.0) {
+		return 1.0/(1.0-rho2/2.0);
 	} else {
-		sor_iterate_block_n(blk);
+		return 1.0/(1.0-rho2*omega/4.0);
 	}
+}
+
+/** @brief Updates all blocks in the next sweep, also sleeping ones.
+ *
+ * Sleeping blocks report the residual of their last sweep (see the 
+ * description of this file). After the next sweep sor_residual() 
+ * includes the current residual of all blocks.
+ *
+ * @param sor Pointer to the SOR state. */
+void sor_wake(struct sor *sor)
+{
+	sor->wake=1;
+}
 
-	sor_iterate_block_corners(blk);
+/** @brief Checks whether all blocks were updated in the last sweep.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return 1 if sor_residual() is the current residual of all blocks, 0 if
+ * some of it is from sleeping blocks. */
+int sor_awake(struct sor *sor)
+{
+	return sor->awake;
+}
+
+/** @brief Residual norm relative to the residual after the first sweep.
+ *
+ * The residual is a by-product of the sweeps: for each point it is the
+ * change divided by omega, taken at the time of its update. So it is 
+ * available after every sweep without any additional passes over the mesh.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return Relative residual norm or 1.0 before the first sweep. */
+n_float sor_residual(struct sor *sor)
+{
+	if(sor->resid_first<=0.0) return 1.0;
+
+	return sqrt(sor->resid/sor->resid_first);
 }
 
 /** @brief Performs a single iteration of the SOR algorithm on the whole mesh.
  *
- * @param sp Pointer to the space struct. */
-void sor_iterate(struct space *sp)
+ * With a fixed extrapolation parameter larger than 1 the iteration uses
+ * Chebyshev acceleration (Hageman and Young): omega starts at 1 and 
+ * changes after each half-sweep (one color), approaching a_soromega. The
+ * spectral radius of the Jacobi iteration is calculated from a_soromega 
+ * assuming that it is optimal.
+ *
+ * If a_sorsweeps is larger than 1, that many sweeps are done with 
+ * temporal blocking (see sor_sweep_wave()). Line relaxation does them one
+ * after another. Corrections in mixed precision and sweeps over packed
+ * blocks are done one sweep at a time.
+ *
+ * @param sor Pointer to the SOR state.
+ * @return Number of sweeps done. */
+int sor_iterate(struct sor *sor)
 {
-	struct block *cur, *ynext, *znext;
+	struct space *sp;
+	n_float omega[2*SOR_SWEEPS_MAX];
+	n_float sleep;
+	double delta, rho2;
+	int n, sweeps, quiet;
+
+	sp=sor->sp;
+
+	if(sor->storage==sor_half && !sor->packdone) {
+		sor->packdone=1;
+
+		if(sor_pack(sor)) {
+			error("Can't allocate work space for packed blocks");
+			sor->storage=sor_float;
+		}
+	}
+
+	sweeps=(sor->refines>0 || sor->packed>0) ? 1 : a_sorsweeps;
+
+	assert(sweeps>=1 && sweeps<=SOR_SWEEPS_MAX);
+
+	rho2=0.0;
+	if(a_soromega>1.0) {
+		rho2=1.0-(2.0/a_soromega-1.0)*(2.0/a_soromega-1.0);
+	}
+
+	for(n=0;n<2*sweeps;n++) {
+		if(a_soromega_auto) {
+			omega[n]=sor->omega;
+		} else if(a_soromega>1.0) {
+			sor->cheb=sor_cheb_next(rho2, sor->cheb);
+			omega[n]=sor->cheb;
+		} else {
+			omega[n]=a_soromega;
+		}
+	}
+
+	/* in automatic mode sleeping blocks would disturb the estimate */
+	sleep=(a_soromega_auto && !sor->frozen) ? 0.0 : sor->sleep;
+
+	if(sor->wake) {
+		sor->wake=0;
+		sleep=0.0;
+	}
+
+	/* blocks only fall asleep at the end of a sweep */
+	quiet=0;
+	if(sleep>0.0 && sor->refines==0 && sor->packed==0 && 
+						sor->relax!=sor_line) {
+		for(n=0;n<sp->varnum;n++) {
+			if(sp->var[n]->quiet>=SOR_SLEEP_SWEEPS) quiet++;
+		}
+	}
+
+	/* with all blocks asleep nothing would ever change */
+	if(quiet>0 && quiet==sp->varnum) {
+		sleep=0.0;
+		quiet=0;
+	}
 
-	cur=sp->blk;
+	sor->awake=(quiet==0);
 
-	while(cur!=NULL) {
-		znext=cur->znext;
-		while(cur!=NULL) {
-			ynext=cur->ynext;
-			while(cur!=NULL) {
-				sor_iterate_block(cur);
+	/* runs of variable blocks are found by their n arrays, so wait until
+	 * blocks are unpacked */
+	if(sor->relax==sor_line && sor->packed==0) {
+		if(sor->runs==NULL && sor_lines_init(sor)) {
+			error("Can't allocate line relaxation work space");
+			sor_lines_done(sor);
+			sor->relax=sor_point;
+		}
+	}
 
-				cur=cur->xnext;
+	if(sor->refines>0) {
+		delta=sor_sweep_rb(sp, sor, omega[0], omega[1], 0.0, 1, 
+								&sor->resid);
+	} else if(sor->packed>0) {
+		delta=sor_sweep_rb(sp, sor, omega[0], omega[1], 0.0, 0, 
+								&sor->resid);
+		pool_run(sp->pool, sor_rescale_pass, sp, sp->varnum);
+	} else if(sor->relax==sor_line) {
+		delta=0.0;
+		for(n=0;n<sweeps;n++) {
+			delta=sor_sweep_lines(sor, omega[2*n], omega[2*n+1],
+								&sor->resid);
+		}
+	} else if(sweeps>1) {
+		delta=sor_sweep_wave(sp, omega, sweeps, sleep, &sor->resid);
+	} else {
+		delta=sor_sweep_rb(sp, sor, omega[0], omega[1], sleep, 0, 
+								&sor->resid);
+	}
+
+	if(a_soromega_auto && sor->refines==0) {
+		sor_auto_update(sor, delta, sweeps);
+	}
+
+	if(sor->resid_first<=0.0) {
+		sor->resid_first=sor->resid;
+		sor->solve_first=sor->resid;
+	}
+
+	if(sor->sleep<=0.0) {
+		for(n=0;n<sp->varnum;n++) {
+			if(sp->var[n]->dmax>sor->sleep) {
+				sor->sleep=sp->var[n]->dmax;
 			}
-			cur=ynext;
 		}
-		cur=znext;
+		sor->sleep*=SOR_SLEEP_TOLERANCE*sor->tol;
 	}
+
+	if(sor->packed>0) {
+		if(sor->pack_best<=0.0 || 
+			sor->resid < sor->pack_best * (1.0 - SOR_PACK_PROGRESS)) {
+			sor->pack_best=sor->resid;
+			sor->pack_stall=0;
+		} else {
+			sor->pack_stall++;
+		}
+
+		if(sor->resid < sor->resid_first * 
+				SOR_PACK_REDUCTION * SOR_PACK_REDUCTION || 
+				sor->pack_stall >= SOR_PACK_STALL) {
+			sor_unpack(sor);
+		}
+	}
+
+	if(sor->packed==0 && sor->precision==sor_mixed && 
+			sor->resid < sor->solve_first *
+			SOR_REFINE_REDUCTION * SOR_REFINE_REDUCTION) {
+		if(sor->refines==0 && sor_refine_init(sp)) {
+			error("Can't allocate mixed precision work space");
+			sor->precision=sor_single;
+		} else {
+			sor_refine(sor);
+		}
+	}
+
+	return sweeps;
 }
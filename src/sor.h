@@ -6,8 +6,60 @@
 /** @file 
  * @brief SOR algorithm, header */
 
+/** @brief Relaxation method used by the SOR solver. */
+enum sor_relax {
+	/** @brief Point SOR. */
+	sor_point,
+	/** @brief Line SOR along the z axis. */
+	sor_line
+};
+
+/** @brief Precision of the solution computed by the SOR solver. */
+enum sor_precision {
+	/** @brief Single precision (n_float). */
+	sor_single,
+	/** @brief Single precision sweeps with iterative refinement in 
+	 * double precision. */
+	sor_mixed
+};
+
+/** @brief Storage of mesh point values in the SOR solver. */
+enum sor_storage {
+	/** @brief Single precision (n_float). */
+	sor_float,
+	/** @brief Packed into 16 bits for a coarse pre-solve, where 
+	 * possible. */
+	sor_half
+};
+
 extern n_float a_soromega;
+extern int a_soromega_auto;
+extern int a_sorsweeps;
+extern enum sor_relax a_sorrelax;
+extern enum sor_precision a_sorprecision;
+extern enum sor_storage a_sorstorage;
+
+/** @brief Largest number of sweeps with temporal blocking. */
+#define SOR_SWEEPS_MAX		32
+
+struct sor;
+
+struct sor *sor_init(struct space *sp, n_float tol);
+void sor_done(struct sor *sor);
+
+void sor_reference(struct sor *sor);
+n_float sor_guess_scale(struct sor *sor);
+
+int sor_iterate(struct sor *sor);
+double sor_sweep(struct space *sp, n_float omega);
+
+void sor_finish(struct sor *sor);
+
+n_float sor_get_omega(struct sor *sor);
+n_float sor_cheb_next(double rho2, n_float omega);
+n_float sor_residual(struct sor *sor);
 
-void sor_iterate(struct space *sp);
+void sor_wake(struct sor *sor);
+int sor_awake(struct sor *sor);
 
 #endif
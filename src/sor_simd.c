@@ -0,0 +1,274 @@
+/**
+ * @file src/sor_simd.c
+ *
+ * @brief Vectorized SOR kernels, code.
+ *
+ * Kernels are written with GCC vector extensions, so they don't depend on
+ * a particular instruction set. The compiler uses whatever the target
+ * supports, or falls back to scalar code.
+ *
+ * A vector always covers SIMD_WIDTH consecutive points of a row, starting
+ * with a point of the color that is being updated. New values are computed
+ * for all of them, but only every other lane is stored. Lanes of the other
+ * color are only read by the stencil, so the row can be processed with
+ * plain unaligned loads and a blend instead of a branch per point. Rows
+ * are split into runs of variable points by the caller, so constant points
+ * don't need to be checked.
+ *
+ * Squared changes are summed in double precision, since the sum is used
+ * for the residual that decides when to stop.
+ */
+
+#include "assert.h"
+#include "sor_simd.h"
+
+/** @brief Size of a vector in bytes. One AVX register when the compiler is
+ * allowed to use AVX (see -march), one SSE register otherwise. Wider 
+ * vectors don't help, since SOR on large meshes is limited by memory 
+ * bandwidth. */
+#ifdef __AVX__
+#define SIMD_BYTES	32
+#else
+#define SIMD_BYTES	16
+#endif
+
+/** @brief Number of n_float values in a vector. */
+#define SIMD_WIDTH	((int) (SIMD_BYTES/sizeof(n_float)))
+
+/** @brief Vector of n_float values. Can be loaded from unaligned
+ * addresses. */
+typedef n_float vf __attribute__((vector_size(SIMD_BYTES),
+						aligned(sizeof(n_float)),
+						__may_alias__));
+
+/** @brief Vector of integers, used as a blend mask. */
+typedef int vi __attribute__((vector_size(SIMD_WIDTH*sizeof(int))));
+
+/** @brief Vector of doubles, used to sum squared changes. */
+typedef double vd __attribute__((vector_size(SIMD_WIDTH*sizeof(double))));
+
+#define LOAD(_p_)	(*((vf *) (_p_)))
+
+/** @brief Row kernel for planes with uniform coefficients.
+ *
+ * Each vector of the row is loaded only once. Neighbors in x direction are
+ * shuffled together from the current, previous and next vector. Loading
+ * them again from memory would partially overlap the store from the
+ * previous step, which is very slow on most processors.
+ *
+ * @param row Pointer to the row description. */
+void sor_row_h(struct sor_row *row)
+{
+	vf kx, ky, kz, w, w1;
+	vf prev, c, next, n1, n2, d, dm;
+	vd acc;
+	vi even, left, right, gt;
+	n_float s;
+
+	n_float *o, *oy1, *oy2, *oz1, *oz2, *f;
+	int x, i, stop;
+
+	o=row->o;
+	oy1=row->oy1;
+	oy2=row->oy2;
+	oz1=row->oz1;
+	oz2=row->oz2;
+	f=row->f;
+
+	stop=row->stop;
+
+	kx=(vf) {} + row->kx;
+	ky=(vf) {} + row->ky;
+	kz=(vf) {} + row->kz;
+
+	w=(vf) {} + row->omega;
+	w1=(vf) {} + (n_float) (1.0 - row->omega);
+
+	for(i=0;i<SIMD_WIDTH;i++) {
+		even[i]=(i%2) ? 0 : -1;
+		left[i]=SIMD_WIDTH + i - 1;
+		right[i]=i + 1;
+	}
+
+	acc=(vd) {};
+	dm=(vf) {};
+	row->delta=0.0;
+	row->dmax=0.0;
+
+	x=row->start;
+
+	if(x + SIMD_WIDTH <= stop) {
+		prev=(vf) {};
+		prev[SIMD_WIDTH-1]=o[x-1];
+
+		c=LOAD(o + x);
+
+		do {
+			/* the point at x + SIMD_WIDTH is at most row->stop */
+
+			if(x + 2*SIMD_WIDTH <= stop + 1) {
+				next=LOAD(o + x + SIMD_WIDTH);
+			} else {
+				next=(vf) {};
+				next[0]=o[x + SIMD_WIDTH];
+			}
+
+			n1=kx * (__builtin_shuffle(prev, c, left) +
+					__builtin_shuffle(c, next, right));
+			n1+=ky * (LOAD(oy1 + x) + LOAD(oy2 + x));
+			n1+=kz * (LOAD(oz1 + x) + LOAD(oz2 + x));
+
+			if(f!=NULL) n1+=LOAD(f + x);
+
+			n2=w1 * c + w * n1;
+
+			*((vf *) (o + x))=(vf) (((vi) n2 & even) |
+							((vi) c & ~even));
+
+			d=(vf) ((vi) (n2 - c) & even);
+			d*=d;
+			acc+=__builtin_convertvector(d, vd);
+
+			gt=(d > dm);
+			dm=(vf) (((vi) d & gt) | ((vi) dm & ~gt));
+
+			prev=c;
+			c=next;
+
+			x+=SIMD_WIDTH;
+		} while(x + SIMD_WIDTH <= stop);
+	}
+
+	/* remaining points that don't fill a whole vector */
+
+	for(; x < stop; x+=2) {
+		s=row->kx * (o[x-1] + o[x+1]) +
+			row->ky * (oy1[x] + oy2[x]) +
+			row->kz * (oz1[x] + oz2[x]);
+
+		if(f!=NULL) s+=f[x];
+
+		s=row->omega * (s - o[x]);
+		row->delta+=s * s;
+		if(s * s > row->dmax) row->dmax=s * s;
+
+		o[x]+=s;
+	}
+
+	for(i=0;i<SIMD_WIDTH;i++) {
+		row->delta+=acc[i];
+		if(dm[i] > row->dmax) row->dmax=dm[i];
+	}
+}
+
+/** @brief Row kernel for planes with a coefficient table.
+ *
+ * Same as sor_row_h(), except that weights are loaded from the coefficient
+ * table for each vector.
+ *
+ * @param row Pointer to the row description. */
+void sor_row_n(struct sor_row *row)
+{
+	vf w, w1;
+	vf prev, c, next, n1, n2, d, dm;
+	vd acc;
+	vi even, left, right, gt;
+	n_float s;
+
+	n_float *o, *oy1, *oy2, *oz1, *oz2, *f;
+	n_float **k;
+	int x, i, stop;
+
+	o=row->o;
+	oy1=row->oy1;
+	oy2=row->oy2;
+	oz1=row->oz1;
+	oz2=row->oz2;
+	f=row->f;
+	k=row->k;
+
+	stop=row->stop;
+
+	w=(vf) {} + row->omega;
+	w1=(vf) {} + (n_float) (1.0 - row->omega);
+
+	for(i=0;i<SIMD_WIDTH;i++) {
+		even[i]=(i%2) ? 0 : -1;
+		left[i]=SIMD_WIDTH + i - 1;
+		right[i]=i + 1;
+	}
+
+	acc=(vd) {};
+	dm=(vf) {};
+	row->delta=0.0;
+	row->dmax=0.0;
+
+	x=row->start;
+
+	if(x + SIMD_WIDTH <= stop) {
+		prev=(vf) {};
+		prev[SIMD_WIDTH-1]=o[x-1];
+
+		c=LOAD(o + x);
+
+		do {
+			if(x + 2*SIMD_WIDTH <= stop + 1) {
+				next=LOAD(o + x + SIMD_WIDTH);
+			} else {
+				next=(vf) {};
+				next[0]=o[x + SIMD_WIDTH];
+			}
+
+			n1=LOAD(k[BLK_K_X1] + x) *
+					__builtin_shuffle(prev, c, left);
+			n1+=LOAD(k[BLK_K_X2] + x) *
+					__builtin_shuffle(c, next, right);
+			n1+=LOAD(k[BLK_K_Y1] + x) * LOAD(oy1 + x);
+			n1+=LOAD(k[BLK_K_Y2] + x) * LOAD(oy2 + x);
+			n1+=LOAD(k[BLK_K_Z1] + x) * LOAD(oz1 + x);
+			n1+=LOAD(k[BLK_K_Z2] + x) * LOAD(oz2 + x);
+
+			n1*=LOAD(k[BLK_K_D] + x);
+
+			if(f!=NULL) n1+=LOAD(f + x);
+
+			n2=w1 * c + w * n1;
+
+			*((vf *) (o + x))=(vf) (((vi) n2 & even) |
+							((vi) c & ~even));
+
+			d=(vf) ((vi) (n2 - c) & even);
+			d*=d;
+			acc+=__builtin_convertvector(d, vd);
+
+			gt=(d > dm);
+			dm=(vf) (((vi) d & gt) | ((vi) dm & ~gt));
+
+			prev=c;
+			c=next;
+
+			x+=SIMD_WIDTH;
+		} while(x + SIMD_WIDTH <= stop);
+	}
+
+	for(; x < stop; x+=2) {
+		s=k[BLK_K_X1][x] * o[x-1] + k[BLK_K_X2][x] * o[x+1] +
+			k[BLK_K_Y1][x] * oy1[x] + k[BLK_K_Y2][x] * oy2[x] +
+			k[BLK_K_Z1][x] * oz1[x] + k[BLK_K_Z2][x] * oz2[x];
+
+		s*=k[BLK_K_D][x];
+
+		if(f!=NULL) s+=f[x];
+
+		s=row->omega * (s - o[x]);
+		row->delta+=s * s;
+		if(s * s > row->dmax) row->dmax=s * s;
+
+		o[x]+=s;
+	}
+
+	for(i=0;i<SIMD_WIDTH;i++) {
+		row->delta+=acc[i];
+		if(dm[i] > row->dmax) row->dmax=dm[i];
+	}
+}
@@ -0,0 +1,70 @@
+/**
+ * @file src/sor_simd.h
+ *
+ * @brief Vectorized SOR kernels, header.
+ */
+
+#ifndef _SOR_SIMD_H
+#define _SOR_SIMD_H
+
+#include "struct.h"
+#include "block.h"
+
+/** @brief Description of one row of mesh points along the x axis that is
+ * passed to the row kernels.
+ *
+ * All pointers point to the mesh point with x=0 in the respective row. */
+struct sor_row {
+	/** @brief Row that is updated. */
+	n_float *o;
+
+	/** @brief Neighboring rows in y direction (y-1 and y+1). */
+	n_float *oy1, *oy2;
+
+	/** @brief Neighboring rows in z direction (z-1 and z+1). */
+	n_float *oz1, *oz2;
+
+	/** @brief Block coordinate of the first point to update. Points from
+	 * \a start to \a stop (exclusive) with step 2 are updated. They must 
+	 * all be variable points (see \a span in struct block). */
+	int start;
+
+	/** @brief Block coordinate of the first point after the updated
+	 * part of the row. */
+	int stop;
+
+	/** @brief Stencil weights, already divided by the sum of weights.
+	 * Used for planes with uniform coefficients. */
+	n_float kx, ky, kz;
+
+	/** @brief Rows of the stencil coefficient table (see BLK_K()). Used
+	 * for other planes. */
+	n_float *k[BLK_K_NUM];
+
+	/** @brief Right hand side for the updated row, already divided by
+	 * the sum of weights. It is added to the weighted sum of the 
+	 * neighbors. NULL when solving the homogeneous equations. */
+	n_float *f;
+
+	/** @brief SOR extrapolation parameter. */
+	n_float omega;
+
+	/** @brief Set by the row kernel to the sum of squared changes of all
+	 * updated points. */
+	double delta;
+
+	/** @brief Set by the row kernel to the largest squared change of an
+	 * updated point. */
+	n_float dmax;
+};
+
+/** @brief Updates every other point in a row of a mesh block.
+ *
+ * Points at \a start, \a start+2, ... are updated. Neighbors at odd offsets
+ * are only read, so this is one half of a red-black sweep. */
+typedef void (*sor_row_func)(struct sor_row *row);
+
+void sor_row_h(struct sor_row *row);
+void sor_row_n(struct sor_row *row);
+
+#endif
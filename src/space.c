@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "config.h"
 #include "assert.h"
@@ -8,8 +11,18 @@
 #include "error.h"
 #include "space.h"
 #include "malloc.h"
+#include "pool.h"
 
-static struct block *sp_block_find_cache=NULL;
+/** @brief How the mesh is divided into blocks. */
+enum sp_blocks a_spblocks=sp_blocks_fixed;
+
+/** @brief Number of times the mesh step can be doubled far from objects
+ * (see sp_refine()). 0 for a uniform mesh. */
+int a_sprefine=0;
+
+/** @brief Largest number of mesh points that a value is interpolated 
+ * from (see sp_interp()). */
+#define SP_INTERP_MAX		16
 
 /** @brief Get pointer to a mesh block.
  *
@@ -37,9 +50,492 @@ static struct block *sp_block(struct space *sp, n_v3i pos, n_v3i size)
 	return(&sp->blk[off]);
 }
 
+/** @brief Builds a table that maps coordinates on one axis to block 
+ * offsets.
+ *
+ * Helper function for sp_alloc_blocks().
+ *
+ * @param map Set to the table (see \a blkmapx in struct space).
+ * @param org Absolute coordinate of the first entry in the table.
+ * @param num Number of blocks along the axis.
+ * @param start Array of the absolute coordinates of the first point in 
+ * each block along the axis.
+ * @param len Array of sizes of each block along the axis.
+ * @param stride Distance in \a blk between neighbouring blocks along the
+ * axis.
+ * @return Length of the table or -1 on memory allocation error. */
+static int sp_block_map(int **map, int org, int num, int *start, int *len,
+								int stride)
+{
+	int n, c, end;
+
+	end=org;
+	for(n=0;n<num;n++) {
+		if(start[n] + len[n] > end) end=start[n] + len[n];
+	}
+
+	*map=n_calloc(end - org + 1, sizeof(**map));
+	if(*map==NULL) return -1;
+
+	for(c=0;c<end-org;c++) (*map)[c]=-1;
+
+	for(n=0;n<num;n++) {
+		for(c=start[n];c<start[n]+len[n];c++) {
+			if(c>=org) (*map)[c - org]=n*stride;
+		}
+	}
+
+	return end - org;
+}
+
+/** @brief Builds the tables used by sp_block_find().
+ *
+ * Helper function for sp_alloc_blocks().
+ *
+ * @param sp Pointer to the grid structure with allocated blocks.
+ * @return 0 on success and -1 on memory allocation error. */
+static int sp_block_maps(struct space *sp)
+{
+	struct block *cur;
+	int *start, *len;
+	int n, num;
+
+	num=sp->blknum.x;
+	if(sp->blknum.y>num) num=sp->blknum.y;
+	if(sp->blknum.z>num) num=sp->blknum.z;
+
+	start=n_calloc(num, sizeof(*start));
+	len=n_calloc(num, sizeof(*len));
+	if(start==NULL || len==NULL) {
+		if(start!=NULL) n_free(start);
+		if(len!=NULL) n_free(len);
+		return -1;
+	}
+
+	for(n=0, cur=sp->blk;cur!=NULL;n++, cur=cur->xnext) {
+		start[n]=cur->pos.x;
+		len[n]=cur->size.x;
+	}
+	sp->blkmaplen.x=sp_block_map(&sp->blkmapx, sp->pos.x, 
+						sp->blknum.x, start, len, 1);
+
+	for(n=0, cur=sp->blk;cur!=NULL;n++, cur=cur->ynext) {
+		start[n]=cur->pos.y;
+		len[n]=cur->size.y;
+	}
+	sp->blkmaplen.y=sp_block_map(&sp->blkmapy, sp->pos.y, 
+						sp->blknum.y, start, len, sp->blknum.x);
+
+	for(n=0, cur=sp->blk;cur!=NULL;n++, cur=cur->znext) {
+		start[n]=cur->pos.z;
+		len[n]=cur->size.z;
+	}
+	sp->blkmaplen.z=sp_block_map(&sp->blkmapz, sp->pos.z, 
+						sp->blknum.z, start, len,
+						sp->blknum.x * sp->blknum.y);
+
+	n_free(start);
+	n_free(len);
+
+	if(sp->blkmaplen.x<0 || sp->blkmaplen.y<0 || sp->blkmaplen.z<0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Splits an axis into blocks of nearly equal length.
+ *
+ * Helper function for sp_alloc_blocks().
+ *
+ * @param len Number of points on the axis.
+ * @param max Largest length of a block.
+ * @param align If larger than 1, the length of all blocks except the last
+ * one is rounded up to a multiple of this. It must divide \a max.
+ * @param size Set to the lengths of the blocks or NULL to only count 
+ * them.
+ * @return Number of blocks. */
+static int sp_split(int len, int max, int align, int *size)
+{
+	int n, num, w;
+
+	if(max<1) max=1;
+
+	num=(len + max - 1) / max;
+	if(num<1) num=1;
+
+	if(size==NULL) return num;
+
+	if(align>1) {
+		w=(len + num - 1) / num;
+		w=(w + align - 1) / align * align;
+
+		for(n=0;n<num;n++) {
+			size[n]=(len < w) ? len : w;
+			len-=size[n];
+		}
+	} else {
+		for(n=0;n<num;n++) {
+			size[n]=len / num + (n < len % num);
+		}
+	}
+
+	return num;
+}
+
+/** @brief Width of the widest block when the x axis is split by 
+ * sp_split() with alignment ALLOC_BLOCK_MIN.
+ *
+ * @param len Number of points on the axis.
+ * @param num Number of blocks.
+ * @return Width of the block. */
+static int sp_width(int len, int num)
+{
+	int w;
+
+	w=(len + num - 1) / num;
+	w=(w + ALLOC_BLOCK_MIN - 1) / ALLOC_BLOCK_MIN * ALLOC_BLOCK_MIN;
+
+	return (len < w) ? len : w;
+}
+
+/** @brief Size of the processor cache that planes of mesh blocks should
+ * fit in.
+ *
+ * @return Size in bytes. */
+static long sp_cache_size()
+{
+	long size;
+
+	size=0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	size=sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+	if(size<=0) size=ALLOC_CACHE_SIZE;
+
+	return size;
+}
+
+/** @brief Number of blocks when the mesh is split into \a nx by \a ny 
+ * blocks horizontally and layers are split into blocks of at most \a h
+ * points vertically.
+ *
+ * Helper function for sp_alloc_blocks().
+ *
+ * @param sp Pointer to the grid structure.
+ * @param nx Number of blocks along the x axis.
+ * @param ny Number of blocks along the y axis.
+ * @param h Largest height of a block.
+ * @return Number of blocks. */
+static int sp_block_count(struct space *sp, int nx, int ny, int h)
+{
+	int n, num;
+
+	num=0;
+	for(n=0;n<sp->laynum;n++) {
+		num+=nx * ny * sp_split(sp->lay[n]->height, h, 1, NULL);
+	}
+
+	return num;
+}
+
+/** @brief Chooses the largest height of mesh blocks.
+ *
+ * Sweeps run through a block plane by plane, so the height of a block 
+ * doesn't change how well it fits in the cache. Tall layers are only split
+ * when there are fewer than ALLOC_BLOCKS_PER_THREAD blocks per thread, so
+ * that all threads get work without making rows shorter. Blocks are not 
+ * split to less than ALLOC_BLOCK_MIN points.
+ *
+ * Helper function for sp_alloc_blocks().
+ *
+ * @param sp Pointer to the grid structure.
+ * @param nx Number of blocks along the x axis.
+ * @param ny Number of blocks along the y axis.
+ * @return Largest height of a block. */
+static int sp_choose_height(struct space *sp, int nx, int ny)
+{
+	int n, h, need;
+
+	h=1;
+	for(n=0;n<sp->laynum;n++) {
+		if(sp->lay[n]->height>h) h=sp->lay[n]->height;
+	}
+
+	need=ALLOC_BLOCKS_PER_THREAD * pool_threads(sp->pool);
+
+	while(h>ALLOC_BLOCK_MIN && sp_block_count(sp, nx, ny, h)<need) h--;
+
+	return h;
+}
+
+/** @brief Chooses the horizontal size of mesh blocks (a_spblocks equal to
+ * sp_blocks_auto).
+ *
+ * Layers can't share blocks, since the material of a block is homogeneous
+ * in z direction, so thin layers give blocks that are mostly halo. For 
+ * each candidate size this counts the mesh points of all blocks including
+ * their halos and the size with the fewest points is chosen. Wide blocks 
+ * have fewer points in halos, but ALLOC_PLANES planes of a block must fit
+ * in half of the processor cache during a sweep, together with the table
+ * of stencil coefficients if there are objects in the mesh (empty layers
+ * have uniform coefficients, see blk_coef_row()). Sizes that give fewer 
+ * than ALLOC_BLOCKS_PER_THREAD blocks per thread, even with tall layers 
+ * split (see sp_choose_height()), are only used when no size gives 
+ * enough.
+ *
+ * Blocks along the x axis are multiples of ALLOC_BLOCK_MIN points wide,
+ * except the last one, so that rows fill whole vectors of the SIMD sweep 
+ * kernels.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param cache Cache size in bytes.
+ * @return Largest width and depth of a block. */
+static int sp_choose_size(struct space *sp, long cache)
+{
+	int b, best, nx, ny, bx, by, h, n, k, enough, best_enough;
+	double points, best_points, column;
+
+	column=ALLOC_PLANES * ALLOC_POINT_BYTES;
+	for(n=0;n<sp->laynum;n++) {
+		if(sp->lay[n]->objnum>0) {
+			column+=BLK_K_NUM * sizeof(n_float);
+			break;
+		}
+	}
+
+	best=ALLOC_BLOCK_MIN;
+	best_points=-1.0;
+	best_enough=0;
+
+	for(b=ALLOC_BLOCK_MIN;b<=ALLOC_BLOCK_MAX;b+=ALLOC_BLOCK_MIN) {
+		nx=sp_split(sp->size.x, b, 1, NULL);
+		ny=sp_split(sp->size.y, b, 1, NULL);
+
+		/* widest blocks */
+		bx=sp_width(sp->size.x, nx);
+		by=(sp->size.y + ny - 1) / ny;
+
+		/* larger sizes have even larger planes */
+		if(b>ALLOC_BLOCK_MIN && 
+				(bx + 2) * (by + 2) * column > cache / 2) {
+			break;
+		}
+
+		h=sp_choose_height(sp, nx, ny);
+
+		points=0.0;
+		for(n=0;n<sp->laynum;n++) {
+			k=sp_split(sp->lay[n]->height, h, 1, NULL);
+
+			points+=(double) nx * ny * (bx + 2) * (by + 2) * 
+				(sp->lay[n]->height + 2 * k);
+		}
+
+		enough=sp_block_count(sp, nx, ny, h) >= 
+				ALLOC_BLOCKS_PER_THREAD * pool_threads(sp->pool);
+
+		if(best_points<0.0 || (enough && !best_enough) ||
+				(enough==best_enough && points<best_points)) {
+			best=b;
+			best_points=points;
+			best_enough=enough;
+		}
+
+		/* larger sizes give the same blocks */
+		if(nx==1 && ny==1) break;
+	}
+
+	return best;
+}
+
+/** @brief Checks whether the distance between grid points changes along
+ * an axis.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param axis Axis to check.
+ * @return 1 if the mesh is graded along \a axis and 0 otherwise. */
+int sp_graded(struct space *sp, n_axis axis)
+{
+	int n;
+
+	if(axis!=Z) return sp->grading>1.0 && sp->gradmax>1.0;
+
+	for(n=0;n<sp->laynum;n++) {
+		if(sp->lay[n]->step>0.0 && sp->lay[n]->step!=sp->step.z) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Distance between a grid point and the next one along an axis.
+ *
+ * Helper function for sp_coord_build(). Along X and Y the distance grows
+ * by a factor of \a grading for each point more than \a gradmargin points
+ * outside of the bounding box of objects, up to \a gradmax times \a step.
+ * Along Z it is the step of the layer.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param axis Axis of the distance.
+ * @param c Absolute coordinate of the point along \a axis.
+ * @param lo Start of the bounding box of objects along \a axis.
+ * @param hi End of the bounding box of objects along \a axis.
+ * @return Distance in meters. */
+static double sp_coord_step(struct space *sp, n_axis axis, int c, int lo, 
+									int hi)
+{
+	struct layer *lay;
+	double f;
+	int d;
+
+	if(axis==Z) {
+		if(c<0) c=0;
+		if(c>=sp->size.z) c=sp->size.z - 1;
+
+		lay=sp_lay_find(sp, c);
+		assert(lay!=NULL);
+
+		return (lay->step>0.0) ? lay->step : sp->step.z;
+	}
+
+	d=0;
+	if(c>=hi + sp->gradmargin) d=c - hi - sp->gradmargin + 1;
+	if(c<lo - sp->gradmargin) d=lo - sp->gradmargin - c;
+
+	f=pow(sp->grading, d);
+	if(f>sp->gradmax) f=sp->gradmax;
+
+	return f * ((axis==X) ? sp->step.x : sp->step.y);
+}
+
+/** @brief Builds the tables of positions of mesh points for graded axes.
+ *
+ * Helper function for sp_alloc_blocks(). The bounding box of objects is 
+ * taken over all objects in all layers of the space, so that it is the 
+ * same for every part of the mesh that is loaded.
+ *
+ * @param sp Pointer to the grid structure with allocated blocks.
+ * @return 0 on success and -1 on memory allocation error. */
+static int sp_coord_build(struct space *sp)
+{
+	struct object *obj;
+	n_v2i lo, hi;
+	int a, n, m, len, org;
+
+	lo=v2i(INT_MAX, INT_MAX);
+	hi=v2i(INT_MIN, INT_MIN);
+
+	for(n=0;n<sp->laynum;n++) {
+		for(m=0;m<sp->lay[n]->objnum;m++) {
+			obj=sp->lay[n]->obj[m];
+
+			if(obj->pos.x<lo.x) lo.x=obj->pos.x;
+			if(obj->pos.y<lo.y) lo.y=obj->pos.y;
+			if(obj->pos.x + obj->size.x>hi.x) {
+				hi.x=obj->pos.x + obj->size.x;
+			}
+			if(obj->pos.y + obj->size.y>hi.y) {
+				hi.y=obj->pos.y + obj->size.y;
+			}
+		}
+	}
+
+	for(a=0;a<3;a++) {
+		if(!sp_graded(sp, a)) continue;
+
+		len=(a==X) ? sp->blkmaplen.x : 
+			(a==Y) ? sp->blkmaplen.y : sp->blkmaplen.z;
+		org=(a==X) ? sp->pos.x : (a==Y) ? sp->pos.y : sp->pos.z;
+
+		sp->coord[a]=n_calloc(len + 2, sizeof(*sp->coord[a]));
+		if(sp->coord[a]==NULL) return -1;
+
+		/* entry 0 is the ghost point before the mesh */
+		sp->coord[a][0]=0.0;
+		for(n=1;n<len + 2;n++) {
+			sp->coord[a][n]=sp->coord[a][n - 1] + 
+				sp_coord_step(sp, a, org + n - 2, 
+					(a==X) ? lo.x : lo.y, 
+					(a==X) ? hi.x : hi.y);
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Position of a mesh point along a graded axis.
+ *
+ * Helper function for sp_dist(). Points past the ends of the table (the 
+ * last point of a coarse block on the border of the space can be) 
+ * continue with the step at that end.
+ *
+ * @param c Table of positions (see \a coord in struct space).
+ * @param len Number of entries in the table.
+ * @param i Index of the point.
+ * @return Position in meters. */
+static double sp_coord(double *c, int len, int i)
+{
+	if(i<0) return c[0] + i * (c[1] - c[0]);
+	if(i>=len) {
+		return c[len - 1] + (i - len + 1) * (c[len - 1] - c[len - 2]);
+	}
+
+	return c[i];
+}
+
+/** @brief Physical distance between two mesh points.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param a Absolute position of the first point.
+ * @param b Absolute position of the second point. It must differ from 
+ * \a a along one axis only.
+ * @return Distance in meters, negative if \a b is before \a a. */
+double sp_dist(struct space *sp, n_v3i a, n_v3i b)
+{
+	n_axis axis;
+	double *c;
+	int i, j, len;
+
+	if(a.x!=b.x) {
+		assert(a.y==b.y && a.z==b.z);
+
+		axis=X;
+		i=a.x - sp->pos.x + 1;
+		j=b.x - sp->pos.x + 1;
+	} else if(a.y!=b.y) {
+		assert(a.z==b.z);
+
+		axis=Y;
+		i=a.y - sp->pos.y + 1;
+		j=b.y - sp->pos.y + 1;
+	} else {
+		axis=Z;
+		i=a.z - sp->pos.z + 1;
+		j=b.z - sp->pos.z + 1;
+	}
+
+	c=sp->coord[axis];
+	if(c==NULL) {
+		return (double) (j - i) * ((axis==X) ? sp->step.x : 
+				(axis==Y) ? sp->step.y : sp->step.z);
+	}
+
+	len=((axis==X) ? sp->blkmaplen.x : (axis==Y) ? sp->blkmaplen.y : 
+						sp->blkmaplen.z) + 2;
+
+	return sp_coord(c, len, j) - sp_coord(c, len, i);
+}
+
 /** @brief Allocates memory for all mesh blocks and sets some default
  * values.
  *
+ * With a_spblocks equal to sp_blocks_fixed the mesh is divided into 
+ * squares of ALLOC_BLOCK_SIZE points horizontally and into layers 
+ * vertically. Otherwise the size of blocks is chosen by sp_choose_size()
+ * and sp_choose_height().
+ *
  * @param sp Pointer to the grid structure.
  * @return 0 on success and -1 on memory allocation error. */
 static int sp_alloc_blocks(struct space *sp)
@@ -53,38 +549,108 @@ static int sp_alloc_blocks(struct space *sp)
 	size_t memsize;
 	struct block *cur;
 
+	int *xsize, *ysize, *zsize;
+	long cache;
+	int b, h, n, m, z;
+
 	assert(sp!=NULL);
 
 	/* how many blocks we need in horizontal directions? */
 
-	size.x=sp->size.x/ALLOC_BLOCK_SIZE;
-	if(sp->size.x%ALLOC_BLOCK_SIZE>0) size.x++;
+	cache=0;
+	b=0;
+	h=0;
+
+	if(a_spblocks==sp_blocks_fixed) {
+		size.x=sp->size.x/ALLOC_BLOCK_SIZE;
+		if(sp->size.x%ALLOC_BLOCK_SIZE>0) size.x++;
+
+		size.y=sp->size.y/ALLOC_BLOCK_SIZE;
+		if(sp->size.y%ALLOC_BLOCK_SIZE>0) size.y++;
+
+		/* vertically we divide the grid into layers. */
+
+		size.z=sp->laynum;
+	} else {
+		cache=sp_cache_size();
+		b=sp_choose_size(sp, cache);
+
+		size.x=sp_split(sp->size.x, b, 1, NULL);
+		size.y=sp_split(sp->size.y, b, 1, NULL);
+
+		/* tall layers are divided further */
+
+		h=sp_choose_height(sp, size.x, size.y);
+
+		size.z=0;
+		for(n=0;n<sp->laynum;n++) {
+			size.z+=sp_split(sp->lay[n]->height, h, 1, NULL);
+		}
+	}
+
+	xsize=n_calloc(size.x, sizeof(*xsize));
+	ysize=n_calloc(size.y, sizeof(*ysize));
+	zsize=n_calloc(size.z, sizeof(*zsize));
+	if(xsize==NULL || ysize==NULL || zsize==NULL) {
+		if(xsize!=NULL) n_free(xsize);
+		if(ysize!=NULL) n_free(ysize);
+		if(zsize!=NULL) n_free(zsize);
+		return -1;
+	}
+
+	if(a_spblocks==sp_blocks_fixed) {
+		for(n=0;n<size.x;n++) xsize[n]=ALLOC_BLOCK_SIZE;
+		for(n=0;n<size.y;n++) ysize[n]=ALLOC_BLOCK_SIZE;
+		for(n=0;n<size.z;n++) zsize[n]=sp->lay[n]->height;
+	} else {
+		sp_split(sp->size.x, b, ALLOC_BLOCK_MIN, xsize);
 
-	size.y=sp->size.y/ALLOC_BLOCK_SIZE;
-	if(sp->size.y%ALLOC_BLOCK_SIZE>0) size.y++;
+		/* coarse blocks need sizes that are multiples of their
+		 * scale (see sp_refine()) */
+		sp_split(sp->size.y, b, (a_sprefine>0) ? ALLOC_BLOCK_MIN : 1,
+									ysize);
 
-	/* vertically we divide the grid into layers. */
+		m=0;
+		for(n=0;n<sp->laynum;n++) {
+			m+=sp_split(sp->lay[n]->height, h, 1, &zsize[m]);
+		}
 
-	size.z=sp->laynum;
+		info("Mesh blocks are %d x %d points, up to %d high "
+			"(%ld kB cache)", xsize[0], ysize[0], h, cache/1024);
+	}
 
 	memsize=size.x * size.y * size.z;
 
-	sp->blk=n_calloc(memsize, sizeof(*sp->blk));
-	if(sp->blk==NULL) return -1;
+	sp->arena=mem_arena_init(ALLOC_ARENA_SLAB);
+	if(sp->arena!=NULL) {
+		sp->blk=mem_arena_calloc(sp->arena, memsize, sizeof(*sp->blk));
+	}
+	if(sp->blk==NULL) {
+		if(sp->arena!=NULL) mem_arena_done(sp->arena);
+		sp->arena=NULL;
+		n_free(xsize);
+		n_free(ysize);
+		n_free(zsize);
+		return -1;
+	}
 
-	for(pos.z=0;pos.z<size.z;pos.z++) {
+	sp->blknum=size;
 
-		blksize.x=ALLOC_BLOCK_SIZE;
-		blksize.y=ALLOC_BLOCK_SIZE;
-		blksize.z=sp->lay[pos.z]->height;
+	/* layers are stacked from z = 0 without gaps (see sp_lay_load()) */
+	z=0;
+	for(pos.z=0;pos.z<size.z;pos.z++) {
 
-		blkpos.z=sp->lay[pos.z]->z;
+		blksize.z=zsize[pos.z];
+		blkpos.z=z;
+		z+=zsize[pos.z];
 
+		blkpos.y=sp->pos.y;
 		for(pos.y=0;pos.y<size.y;pos.y++) {
-			for(pos.x=0;pos.x<size.x;pos.x++) {
+			blksize.y=ysize[pos.y];
 
-				blkpos.x=sp->pos.x+ALLOC_BLOCK_SIZE*pos.x;
-				blkpos.y=sp->pos.y+ALLOC_BLOCK_SIZE*pos.y;
+			blkpos.x=sp->pos.x;
+			for(pos.x=0;pos.x<size.x;pos.x++) {
+				blksize.x=xsize[pos.x];
 
 				cur=sp_block(sp, pos, size);
 
@@ -120,11 +686,21 @@ static int sp_alloc_blocks(struct space *sp)
 							v3i_add(pos, v3i_z), 
 							size);
 				}
+
+				blkpos.x+=blksize.x;
 			}
+
+			blkpos.y+=blksize.y;
 		}
 	}
 
-	return 0;
+	n_free(xsize);
+	n_free(ysize);
+	n_free(zsize);
+
+	if(sp_block_maps(sp)) return -1;
+
+	return sp_coord_build(sp);
 }
 
 /** @brief Free all memory allocated for mesh blocks.
@@ -133,6 +709,7 @@ static int sp_alloc_blocks(struct space *sp)
 static void sp_free_blocks(struct space *sp)
 {
 	struct block *cur, *ynext, *znext;
+	int n;
 
 	assert(sp!=NULL);
 	assert(sp->blk!=NULL);
@@ -153,9 +730,31 @@ static void sp_free_blocks(struct space *sp)
 		cur=znext;
 	}
 
-	sp_block_find_cache=NULL;
+	if(sp->blkmapx!=NULL) n_free(sp->blkmapx);
+	if(sp->blkmapy!=NULL) n_free(sp->blkmapy);
+	if(sp->blkmapz!=NULL) n_free(sp->blkmapz);
+
+	sp->blkmapx=NULL;
+	sp->blkmapy=NULL;
+	sp->blkmapz=NULL;
+	sp->blkmaplen=v3i_o;
+
+	if(sp->var!=NULL) {
+		n_free(sp->var);
+		sp->var=NULL;
+		sp->varnum=0;
+	}
 
-	n_free(sp->blk);
+	sp->linked=0;
+
+	for(n=0;n<3;n++) {
+		if(sp->coord[n]!=NULL) n_free(sp->coord[n]);
+		sp->coord[n]=NULL;
+	}
+
+	/* blocks and their arrays are released together with the arena */
+	mem_arena_done(sp->arena);
+	sp->arena=NULL;
 	sp->blk=NULL;
 }
 
@@ -179,6 +778,9 @@ int sp_pos_inside(struct space *sp, n_v3i pos)
 }
 
 /** @brief Finds a mesh block that holds information about certain position.
+ *
+ * Block indexes are looked up in tables for each axis, so this takes the 
+ * same time for all positions and is safe to call from several threads.
  *
  * @param sp Pointer to the space struct.
  * @param pos Position in absolute coordinates.
@@ -186,50 +788,154 @@ int sp_pos_inside(struct space *sp, n_v3i pos)
  * allocated part of the mesh. */
 static struct block *sp_block_find(struct space *sp, n_v3i pos)
 {
-	struct block *cur, *cache;
+	int x, y, z;
 
 	assert(sp!=NULL);
 	assert(sp->blk!=NULL);
 
-	cache=sp_block_find_cache;
+	x=pos.x - sp->pos.x;
+	y=pos.y - sp->pos.y;
+	z=pos.z - sp->pos.z;
 
-	if(cache!=NULL) {
-		if((cache->pos.z <= pos.z)
-				&&(cache->pos.z + cache->size.z > pos.z)
-				&&(cache->pos.y <= pos.y)
-				&&(cache->pos.y + cache->size.y > pos.y)
-				&&(cache->pos.x <= pos.x)
-				&&(cache->pos.x + cache->size.x > pos.x)) {
-			return cache;
-		}
-	}
+	/* unsigned comparison also catches negative coordinates */
 
-	cur=sp->blk;
+	if((unsigned) x >= (unsigned) sp->blkmaplen.x) return NULL;
+	if((unsigned) y >= (unsigned) sp->blkmaplen.y) return NULL;
+	if((unsigned) z >= (unsigned) sp->blkmaplen.z) return NULL;
 
-	while(cur!=NULL) {
-		if((cur->pos.z <= pos.z)&&(cur->pos.z + cur->size.z > pos.z)) {
-			break;
-		}
-		cur=cur->znext;
-	}
-	while(cur!=NULL) {
-		if((cur->pos.y <= pos.y)&&(cur->pos.y + cur->size.y > pos.y)) {
-			break;
+	x=sp->blkmapx[x];
+	y=sp->blkmapy[y];
+	z=sp->blkmapz[z];
+
+	if((x | y | z) < 0) return NULL;
+
+	return &sp->blk[x + y + z];
+}
+
+/** @brief Finds the mesh block of a mesh point and its index in the 
+ * arrays of the block.
+ *
+ * @param sp Pointer to the space struct.
+ * @param pos Position in absolute coordinates.
+ * @param off Set to the array index of the point in the block (see 
+ * blk_off3()).
+ * @return Pointer to the mesh block or NULL if position is outside of 
+ * allocated part of the mesh or in a coarse block (see sp_refine()). */
+struct block *sp_point_find(struct space *sp, n_v3i pos, size_t *off)
+{
+	struct block *blk;
+
+	blk=sp_block_find(sp, pos);
+	if(blk==NULL || blk->scale>1) return NULL;
+
+	*off=blk_off3(blk, v3i_sub(pos, blk->pos));
+
+	return blk;
+}
+
+/** @brief Finds the mesh points that the value at a position is 
+ * interpolated from.
+ *
+ * Values between the points of coarse blocks (see sp_refine()) are 
+ * interpolated bilinearly from the four surrounding points. Points past 
+ * the last one of a coarse block are taken from the next block, so ghost
+ * points are never used. Sources that are already in the arrays get 
+ * their weights added.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Position in absolute coordinates.
+ * @param w Weight of the value at \a pos.
+ * @param src Array of pointers to the values of the sources, 
+ * SP_INTERP_MAX entries.
+ * @param srcw Array of weights of the sources, SP_INTERP_MAX entries.
+ * @param num Number of sources already in the arrays.
+ * @return New number of sources. */
+static int sp_interp(struct space *sp, n_v3i pos, n_float w, n_float **src,
+						n_float *srcw, int num)
+{
+	struct block *blk;
+	n_float *p;
+	n_v3i c, f;
+	int s, dx, dy, wx, wy, n;
+
+	blk=sp_block_find(sp, pos);
+
+	assert(blk!=NULL);
+
+	s=blk->scale;
+
+	c=v3i_sub(pos, blk->pos);
+	f=v3i(c.x % s, c.y % s, 0);
+	c=v3i(c.x / s, c.y / s, c.z);
+
+	if(blk->n==NULL) {
+		p=&blk->c_n;
+	} else if(f.x==0 && f.y==0) {
+		assert(c.x < blk->size.x && c.y < blk->size.y);
+
+		p=&blk->n[blk_off3(blk, c)];
+	} else {
+		for(dy=0;dy<2;dy++) {
+			wy=dy ? f.y : s - f.y;
+			if(wy==0) continue;
+
+			for(dx=0;dx<2;dx++) {
+				wx=dx ? f.x : s - f.x;
+				if(wx==0) continue;
+
+				num=sp_interp(sp, blk_abs(blk, 
+					v3i_add(c, v3i(dx, dy, 0))),
+					w * wx * wy / (s * s), src, srcw, num);
+			}
 		}
-		cur=cur->ynext;
+
+		return num;
 	}
-	while(cur!=NULL) {
-		if((cur->pos.x <= pos.x)&&(cur->pos.x + cur->size.x > pos.x)) {
-			break;
+
+	for(n=0;n<num;n++) {
+		if(src[n]==p) {
+			srcw[n]+=w;
+			return num;
 		}
-		cur=cur->xnext;
 	}
 
-	sp_block_find_cache=cur;
+	assert(num < SP_INTERP_MAX);
+
+	src[num]=p;
+	srcw[num]=w;
+
+	return num + 1;
+}
+
+/** @brief Interpolates the value of scalar field at a position in a 
+ * coarse block.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Position in absolute coordinates.
+ * @return Value of the field. */
+static n_float sp_n_interp(struct space *sp, n_v3i pos)
+{
+	n_float *src[SP_INTERP_MAX];
+	n_float srcw[SP_INTERP_MAX];
+	n_float v;
+	int n, num;
+
+	num=sp_interp(sp, pos, 1.0, src, srcw, 0);
 
-	return cur;
+	v=0.0;
+	for(n=0;n<num;n++) v+=srcw[n] * *src[n];
+
+	return v;
 }
 
+/** @brief Checks whether the mesh point at \a pos coordinates is 
+ * constant.
+ *
+ * Points between the points of a coarse block are variable.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Position of the desired point in absolute coordinates
+ * @return 1 if the point is constant and 0 otherwise. */
 int sp_con_get(struct space *sp, n_v3i pos)
 {
 	size_t off;
@@ -248,8 +954,17 @@ int sp_con_get(struct space *sp, n_v3i pos)
 		assert(blk->con != NULL);
 
 		blkpos=v3i_sub(pos, blk->pos);
+
+		if(blk->scale>1) {
+			if(blkpos.x % blk->scale || blkpos.y % blk->scale) {
+				return 0;
+			}
+			blkpos.x/=blk->scale;
+			blkpos.y/=blk->scale;
+		}
+
 		off=blk_off3(blk, blkpos);
-		return blk->con[off];
+		return BLK_CON_OFF(blk, off);
 	}
 }
 
@@ -272,6 +987,8 @@ n_float sp_n_get(struct space *sp, n_v3i pos)
 
 	if(blk->n==NULL) {
 		return blk->c_n;
+	} else if(blk->scale>1) {
+		return sp_n_interp(sp, pos);
 	} else {
 		blkpos=v3i_sub(pos, blk->pos);
 		off=blk_off3(blk, blkpos);
@@ -279,6 +996,43 @@ n_float sp_n_get(struct space *sp, n_v3i pos)
 	}
 }
 
+/** @brief Get value of scalar field at mesh point at \a pos coordinates
+ * in double precision.
+ *
+ * Same as sp_n_get(), except that the low order part kept by the SOR solver
+ * in mixed precision (see BLK_VEC_LO) is included.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Position of the desired point in absolute coordinates
+ * @return Value of the field */
+double sp_n_get_double(struct space *sp, n_v3i pos)
+{
+	size_t off;
+	struct block *blk;
+	n_v3i blkpos;
+
+	assert(sp!=NULL);
+
+	blk=sp_block_find(sp, pos);
+
+	assert(blk!=NULL);
+
+	if(blk->n==NULL) {
+		return blk->c_n;
+	} else if(blk->scale>1) {
+		return sp_n_interp(sp, pos);
+	} else {
+		blkpos=v3i_sub(pos, blk->pos);
+		off=blk_off3(blk, blkpos);
+
+		if(blk->vec[BLK_VEC_LO]==NULL) {
+			return blk->n[off];
+		} else {
+			return (double) blk->n[off] + blk->vec[BLK_VEC_LO][off];
+		}
+	}
+}
+
 /** @brief Get value of material propert at \a pos coordinates.
  *
  * @param sp Pointer to the grid structure.
@@ -334,6 +1088,33 @@ void sp_a_set(struct space *sp, n_v3i pos, n_float a)
 	blk->a[off]=a;
 }
 
+/** @brief Set value of material property in all blocks of a layer.
+ *
+ * Material is stored once for each block, but a layer can be split into
+ * several blocks along z (see sp_alloc_blocks()).
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Absolute x and y coordinates.
+ * @param lay Pointer to the layer.
+ * @param a Value of the material property */
+void sp_a_set_layer(struct space *sp, n_v2i pos, struct layer *lay, 
+								n_float a)
+{
+	struct block *blk;
+	n_v3i p;
+
+	p=v3i_ez(pos, lay->z);
+	while(p.z < lay->z + lay->height) {
+		blk=sp_block_find(sp, p);
+
+		assert(blk!=NULL);
+
+		sp_a_set(sp, p, a);
+
+		p.z=blk->pos.z + blk->size.z;
+	}
+}
+
 /** @brief Set value of scalar field at mesh point at \a pos coordinates and
  * set that mesh point as variable.
  *
@@ -360,7 +1141,7 @@ static void sp_n_set_var(struct space *sp, n_v3i pos, n_float n)
 
 	off=blk_off3(blk, blkpos);
 	blk->n[off]=n;
-	blk->con[off]=0;
+	blk_con_set(blk, off, 0);
 }
 
 /** @brief Set value of scalar field at mesh point at \a pos coordinates and
@@ -395,7 +1176,7 @@ static void sp_n_set_con(struct space *sp, n_v3i pos, n_float n)
 
 	off=blk_off3(blk, blkpos);
 	blk->n[off]=n;
-	blk->con[off]=1;
+	blk_con_set(blk, off, 1);
 }
 
 /** @brief Set value of scalar field at mesh point at \a pos coordinates and
@@ -423,6 +1204,20 @@ struct space *sp_init(n_v3f step)
 	if(sp==NULL) return NULL;
 
 	sp->blk=NULL;
+	sp->arena=NULL;
+
+	sp->blknum=v3i_o;
+	sp->blkmapx=NULL;
+	sp->blkmapy=NULL;
+	sp->blkmapz=NULL;
+	sp->blkmaplen=v3i_o;
+
+	sp->var=NULL;
+	sp->varnum=0;
+	sp->linked=0;
+
+	sp->pool=NULL;
+	sp->net=NULL;
 
 	sp->lay=NULL;
 	sp->laynum=0;
@@ -433,12 +1228,51 @@ struct space *sp_init(n_v3f step)
 
 	sp->step=step;
 
+	sp->grading=1.0;
+	sp->gradmax=1.0;
+	sp->gradmargin=0;
+	sp->coord[0]=NULL;
+	sp->coord[1]=NULL;
+	sp->coord[2]=NULL;
+
 	sp->name=NULL;
 	sp->next=NULL;
 
 	return sp;
 }
 
+/** @brief Creates an empty mesh with the same layers and mesh step as 
+ * another one.
+ *
+ * The layers themselves are shared with \a sp, but blocks, thread pool and
+ * net are not, so the new mesh can be loaded and iterated independently 
+ * of \a sp and of other copies.
+ *
+ * @param sp Pointer to the grid structure to copy.
+ * @return Pointer to the new grid structure or NULL on error. */
+struct space *sp_dup(struct space *sp)
+{
+	struct space *copy;
+
+	assert(sp!=NULL);
+
+	copy=sp_init(sp->step);
+	if(copy==NULL) return NULL;
+
+	copy->lay=sp->lay;
+	copy->laynum=sp->laynum;
+
+	copy->size=sp->size;
+
+	copy->grading=sp->grading;
+	copy->gradmax=sp->gradmax;
+	copy->gradmargin=sp->gradmargin;
+
+	if(sp->name!=NULL) copy->name=strdup(sp->name);
+
+	return copy;
+}
+
 void sp_done(struct space *sp)
 {
 	assert(sp!=NULL);
@@ -453,7 +1287,7 @@ void sp_done(struct space *sp)
 
 void sp_lay_load(struct space *sp, struct layer *lay)
 {
-	struct block *cur, *ynext;
+	struct block *cur, *ynext, *znext;
 
 	assert(sp!=NULL);
 	assert(sp->blk!=NULL);
@@ -470,16 +1304,21 @@ void sp_lay_load(struct space *sp, struct layer *lay)
 
 	assert(cur!=NULL);
 
-	while(cur!=NULL) {
-		ynext=cur->ynext;
+	/* a layer can be split into several blocks along z */
+	while(cur!=NULL && cur->pos.z < lay->z + lay->height) {
+		znext=cur->znext;
 		while(cur!=NULL) {
-			assert(cur->a == NULL);
+			ynext=cur->ynext;
+			while(cur!=NULL) {
+				assert(cur->a == NULL);
 
-			cur->c_a = lay->mat->e;
+				cur->c_a = lay->mat->e;
 
-			cur=cur->xnext;
+				cur=cur->xnext;
+			}
+			cur=ynext;
 		}
-		cur=ynext;
+		cur=znext;
 	}
 }
 
@@ -555,6 +1394,47 @@ void sp_border(struct space *sp)
 	}
 }
 
+/** @brief Makes a list of all variable mesh blocks.
+ *
+ * Helper function for sp_optimize(). The list is used by the SOR routines
+ * to split work between threads.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param num Number of variable blocks. */
+static void sp_var_list(struct space *sp, int num)
+{
+	struct block *cur, *ynext, *znext;
+	int n;
+
+	if(sp->var!=NULL) n_free(sp->var);
+
+	sp->var=n_calloc(num, sizeof(*sp->var));
+	sp->varnum=0;
+
+	if(sp->var==NULL) return;
+
+	n=0;
+	cur=sp->blk;
+
+	while(cur!=NULL) {
+		znext=cur->znext;
+		while(cur!=NULL) {
+			ynext=cur->ynext;
+			while(cur!=NULL) {
+				if(cur->n != NULL) {
+					assert(n<num);
+					sp->var[n++]=cur;
+				}
+				cur=cur->xnext;
+			}
+			cur=ynext;
+		}
+		cur=znext;
+	}
+
+	sp->varnum=n;
+}
+
 /** @brief Optimize allocated mesh blocks.
  *
  * This function should be called before starting the SOR iteration.
@@ -570,6 +1450,7 @@ void sp_optimize(struct space *sp)
 	unsigned long int all=0;
 
 	struct block *cur, *ynext, *znext;
+	int n;
 
 	assert(sp!=NULL);
 	assert(sp->blk!=NULL);
@@ -604,6 +1485,23 @@ void sp_optimize(struct space *sp)
 		cur=znext;
 	}
 
+	sp_var_list(sp, alloc);
+
+	/* Stencil coefficients depend on materials in neighboring blocks, 
+	 * so they can only be calculated after all blocks were converted. */
+
+	for(n=0;n<sp->varnum;n++) {
+		cur=sp->var[n];
+
+		if(blk_coef_build(cur)) {
+			error("Can't allocate stencil coefficient table");
+		}
+
+		if(blk_span_build(cur)) {
+			error("Can't allocate runs of variable points");
+		}
+	}
+
 	info("Allocated %d blocks of total %d (%.1f%%)", alloc, all, 
 							100.0 * alloc / all);
 	info("Optimization freed %d blocks", alloc_changed);
@@ -612,3 +1510,397 @@ void sp_optimize(struct space *sp)
 							100.0 * homo / all);
 	info("Optimization converted %d blocks to homogeneous", homo_changed);
 }
+
+/** @brief Includes a point of an object in the bounding box of objects in
+ * its column of mesh blocks.
+ *
+ * Helper function for sp_refine_mark().
+ *
+ * @param sp Pointer to the grid structure.
+ * @param pos Absolute x and y coordinates of the point.
+ * @param box Bounding boxes of all columns (see sp_refine()). */
+static void sp_refine_point(struct space *sp, n_v2i pos, int *box)
+{
+	int x, y, *b;
+
+	x=pos.x - sp->pos.x;
+	y=pos.y - sp->pos.y;
+
+	if((unsigned) x >= (unsigned) sp->blkmaplen.x) return;
+	if((unsigned) y >= (unsigned) sp->blkmaplen.y) return;
+
+	if(sp->blkmapx[x]<0 || sp->blkmapy[y]<0) return;
+
+	/* offset of the bottom block of the column */
+	b=&box[(sp->blkmapx[x] + sp->blkmapy[y]) * 4];
+
+	if(pos.x<b[0]) b[0]=pos.x;
+	if(pos.y<b[1]) b[1]=pos.y;
+	if(pos.x>b[2]) b[2]=pos.x;
+	if(pos.y>b[3]) b[3]=pos.y;
+}
+
+/** @brief Includes an object in the bounding boxes of objects in columns
+ * of mesh blocks.
+ *
+ * Helper function for sp_refine(). Objects cover the points one step past
+ * each set bit of their bitmap (see sp_add_obj()). Objects without a 
+ * bitmap cover their whole rectangle.
+ *
+ * @param sp Pointer to the grid structure.
+ * @param obj Pointer to the object.
+ * @param box Bounding boxes of all columns (see sp_refine()). */
+static void sp_refine_mark(struct space *sp, struct object *obj, int *box)
+{
+	n_v2i pos, p;
+
+	if(obj->pos.x > sp->pos.x + sp->size.x) return;
+	if(obj->pos.y > sp->pos.y + sp->size.y) return;
+	if(obj->pos.x + obj->size.x < sp->pos.x) return;
+	if(obj->pos.y + obj->size.y < sp->pos.y) return;
+
+	for(pos.y=0;pos.y<obj->size.y;pos.y++) {
+		for(pos.x=0;pos.x<obj->size.x;pos.x++) {
+			if(obj->map!=NULL && 
+				!map_get(obj->map, pos, obj->size)) continue;
+
+			p=v2i_add(obj->pos, pos);
+
+			sp_refine_point(sp, p, box);
+			sp_refine_point(sp, v2i_add(p, v2i(1, 0)), box);
+			sp_refine_point(sp, v2i_add(p, v2i(0, 1)), box);
+			sp_refine_point(sp, v2i_add(p, v2i(1, 1)), box);
+		}
+	}
+}
+
+/** @brief Distance from a column of mesh blocks to the nearest object.
+ *
+ * Helper function for sp_refine().
+ *
+ * @param sp Pointer to the grid structure.
+ * @param blk Pointer to the bottom block of the column.
+ * @param box Bounding boxes of all columns (see sp_refine()).
+ * @return Smallest distance along x or y in mesh units between a point of
+ * the column and a point of an object, INT_MAX if there are no objects. */
+static int sp_refine_dist(struct space *sp, struct block *blk, int *box)
+{
+	int c, d, dist, *b;
+
+	dist=INT_MAX;
+
+	for(c=0;c<sp->blknum.x * sp->blknum.y;c++) {
+		b=&box[c * 4];
+
+		/* column without objects */
+		if(b[0]>b[2]) continue;
+
+		d=b[0] - (blk->pos.x + blk->size.x - 1);
+		if(blk->pos.x - b[2] > d) d=blk->pos.x - b[2];
+		if(b[1] - (blk->pos.y + blk->size.y - 1) > d) {
+			d=b[1] - (blk->pos.y + blk->size.y - 1);
+		}
+		if(blk->pos.y - b[3] > d) d=blk->pos.y - b[3];
+
+		if(d<0) d=0;
+		if(d<dist) dist=d;
+	}
+
+	return dist;
+}
+
+/** @brief Number of points of a coarse block along one axis.
+ *
+ * Helper function for sp_refine(). The first point of a coarse block is
+ * always kept. Blocks that end on the border of the space must also keep
+ * their last point, which is constant. Other blocks must be a multiple of
+ * \a scale long, so that the next block starts at the point after their
+ * last one.
+ *
+ * @param pos Absolute coordinate of the first point of the block.
+ * @param len Number of points in the block.
+ * @param end Absolute coordinate after the last point of the space.
+ * @param scale Scale of the coarse block.
+ * @return Number of points or 0 if the block can't have this scale. */
+static int sp_refine_len(int pos, int len, int end, int scale)
+{
+	if(pos + len >= end) {
+		len=end - pos;
+		return ((len - 1) % scale) ? 0 : (len - 1) / scale + 1;
+	} else {
+		return (len % scale) ? 0 : len / scale;
+	}
+}
+
+/** @brief Chooses the scale of a column of mesh blocks.
+ *
+ * Helper function for sp_refine().
+ *
+ * @param sp Pointer to the grid structure.
+ * @param blk Pointer to the bottom block of the column.
+ * @param dist Distance to the nearest object (see sp_refine_dist()).
+ * @param size Set to the size of the coarse blocks, except for z.
+ * @return Scale of the column (1 if the column stays fine). */
+static int sp_refine_scale(struct space *sp, struct block *blk, int dist,
+								n_v3i *size)
+{
+	struct block *cur;
+	int s;
+
+	for(cur=blk;cur!=NULL;cur=cur->znext) {
+		if(cur->a!=NULL) return 1;
+	}
+
+	for(s=1 << a_sprefine;s>1;s/=2) {
+		if(dist/ALLOC_REFINE_DIST < s) continue;
+
+		size->x=sp_refine_len(blk->pos.x, blk->size.x, 
+					sp->pos.x + sp->size.x, s);
+		size->y=sp_refine_len(blk->pos.y, blk->size.y, 
+					sp->pos.y + sp->size.y, s);
+
+		if(size->x>0 && size->y>0) return s;
+	}
+
+	return 1;
+}
+
+/** @brief Finds sources of interpolated ghost points of a variable mesh
+ * block.
+ *
+ * Helper function for sp_refine(). Ghost points on faces towards blocks 
+ * with a different scale, or on all faces along x and y of a coarse 
+ * block, are interpolated (see blk_link_update()).
+ *
+ * @param sp Pointer to the grid structure.
+ * @param blk Pointer to the mesh block.
+ * @return 0 on success and -1 on error. */
+static int sp_refine_link(struct space *sp, struct block *blk)
+{
+	struct block *nb[4];
+	n_v3i start[4], du[4];
+	int nu[4];
+
+	n_float *src[SP_INTERP_MAX];
+	n_float srcw[SP_INTERP_MAX];
+	n_v3i pos, g;
+	unsigned int srcnum;
+	int f, i, m, num, pass;
+
+	nb[0]=blk->xprev;
+	start[0]=v3i(-1, 0, 0);
+	nb[1]=blk->xnext;
+	start[1]=v3i(blk->size.x, 0, 0);
+	du[0]=du[1]=v3i_y;
+	nu[0]=nu[1]=blk->size.y;
+
+	nb[2]=blk->yprev;
+	start[2]=v3i(0, -1, 0);
+	nb[3]=blk->ynext;
+	start[3]=v3i(0, blk->size.y, 0);
+	du[2]=du[3]=v3i_x;
+	nu[2]=nu[3]=blk->size.x;
+
+	/* the first pass counts ghost points and sources, the second one
+	 * stores them */
+
+	num=0;
+	srcnum=0;
+
+	for(pass=0;pass<2;pass++) {
+		num=0;
+		srcnum=0;
+
+		for(f=0;f<4;f++) {
+			if(nb[f]==NULL) continue;
+			if(blk->scale==1 && nb[f]->scale==1) continue;
+
+			for(pos.z=0;pos.z<blk->size.z;pos.z++) {
+				for(i=0;i<nu[f];i++) {
+					pos.x=start[f].x + i * du[f].x;
+					pos.y=start[f].y + i * du[f].y;
+
+					/* padding past the border of the 
+					 * space is not linked */
+					g=v3i_sub(blk_abs(blk, pos), sp->pos);
+					if(g.x >= sp->size.x || 
+						g.y >= sp->size.y) continue;
+
+					m=sp_interp(sp, blk_abs(blk, pos), 1.0,
+							src, srcw, 0);
+
+					if(pass>0) {
+						blk->link[num]=blk_off3(blk, 
+									pos);
+						blk->linkrow[num]=srcnum;
+
+						memcpy(&blk->linksrc[srcnum], 
+							src, m * sizeof(*src));
+						memcpy(&blk->linkw[srcnum], 
+							srcw, m * sizeof(*srcw));
+					}
+
+					num++;
+					srcnum+=m;
+				}
+			}
+		}
+
+		if(num==0) return 0;
+
+		if(pass==0) {
+			blk->link=n_calloc(num, sizeof(*blk->link));
+			blk->linkrow=n_calloc(num + 1, sizeof(*blk->linkrow));
+			blk->linksrc=n_calloc(srcnum, sizeof(*blk->linksrc));
+			blk->linkw=n_calloc(srcnum, sizeof(*blk->linkw));
+
+			if(blk->link==NULL || blk->linkrow==NULL || 
+					blk->linksrc==NULL || 
+					blk->linkw==NULL) {
+				blk_link_free(blk);
+				return -1;
+			}
+		}
+	}
+
+	blk->linkrow[num]=srcnum;
+	blk->linknum=num;
+
+	return 0;
+}
+
+/** @brief Number of mesh points in all variable blocks.
+ *
+ * @param sp Pointer to the grid structure.
+ * @return Number of points, without halos. */
+static double sp_var_points(struct space *sp)
+{
+	double points;
+	int n;
+
+	points=0.0;
+	for(n=0;n<sp->varnum;n++) {
+		points+=(double) sp->var[n]->size.x * sp->var[n]->size.y *
+							sp->var[n]->size.z;
+	}
+
+	return points;
+}
+
+/** @brief Makes mesh blocks far from objects coarse (a_sprefine larger 
+ * than 0).
+ *
+ * The potential changes slowly far from objects, so the fine mesh step is
+ * only needed near their edges. Each column of blocks (blocks with the same
+ * x and y position) gets the largest scale s of 2, 4, ... 2^a_sprefine 
+ * for which all its points are at least ALLOC_REFINE_DIST * s points away
+ * from the bitmaps of all objects on the mesh. Blocks in a column have the
+ * same scale, so the mesh is only coarse along x and y and faces along z 
+ * are copied as usual. Columns with heterogeneous blocks stay fine, and so
+ * do columns whose size doesn't allow the scale (see sp_refine_len()).
+ *
+ * Coarse blocks keep every s-th point of the fine mesh (see blk_coarsen()).
+ * Ghost points between blocks of different scale are interpolated from 
+ * the points of the neighboring blocks (see sp_refine_link()). Surfaces 
+ * around nets (see cap_flux_build()) are at most two points from objects,
+ * so they are always in fine blocks.
+ *
+ * Must be called after sp_optimize().
+ *
+ * @param sp Pointer to the grid structure. */
+void sp_refine(struct space *sp)
+{
+	struct block *cur;
+	n_v3i size;
+	double before;
+	int *box, *scale;
+	int c, n, m, num, coarse;
+
+	assert(sp!=NULL);
+	assert(sp->blk!=NULL);
+
+	if(a_sprefine<=0) return;
+
+	num=sp->blknum.x * sp->blknum.y;
+
+	box=n_calloc((size_t) num * 4, sizeof(*box));
+	scale=n_calloc(num, sizeof(*scale));
+	if(box==NULL || scale==NULL) {
+		error("Can't allocate coarse mesh blocks");
+		if(box!=NULL) n_free(box);
+		if(scale!=NULL) n_free(scale);
+		return;
+	}
+
+	/* bounding box of the objects in each column */
+
+	for(c=0;c<num;c++) {
+		box[c * 4 + 0]=INT_MAX;
+		box[c * 4 + 1]=INT_MAX;
+		box[c * 4 + 2]=INT_MIN;
+		box[c * 4 + 3]=INT_MIN;
+	}
+
+	for(n=0;n<sp->laynum;n++) {
+		for(m=0;m<sp->lay[n]->objnum;m++) {
+			sp_refine_mark(sp, sp->lay[n]->obj[m], box);
+		}
+	}
+
+	/* scales are chosen before any block is changed */
+
+	for(c=0;c<num;c++) {
+		scale[c]=sp_refine_scale(sp, &sp->blk[c], 
+				sp_refine_dist(sp, &sp->blk[c], box), &size);
+	}
+
+	before=sp_var_points(sp);
+
+	coarse=0;
+	for(c=0;c<num;c++) {
+		if(scale[c]<2) continue;
+
+		cur=&sp->blk[c];
+		size.x=sp_refine_len(cur->pos.x, cur->size.x, 
+					sp->pos.x + sp->size.x, scale[c]);
+		size.y=sp_refine_len(cur->pos.y, cur->size.y, 
+					sp->pos.y + sp->size.y, scale[c]);
+
+		for(cur=&sp->blk[c];cur!=NULL;cur=cur->znext) {
+			size.z=cur->size.z;
+
+			if(blk_coarsen(cur, scale[c], size)) {
+				error("Can't allocate coarse mesh blocks");
+				continue;
+			}
+
+			coarse++;
+
+			if(cur->n==NULL) continue;
+
+			if(blk_coef_build(cur)) {
+				error("Can't allocate stencil coefficient "
+								"table");
+			}
+			if(blk_span_build(cur)) {
+				error("Can't allocate runs of variable "
+								"points");
+			}
+		}
+	}
+
+	sp->linked=0;
+	for(n=0;n<sp->varnum;n++) {
+		if(sp_refine_link(sp, sp->var[n])) {
+			error("Can't allocate interpolated ghost points");
+		}
+		if(sp->var[n]->linknum>0) sp->linked++;
+	}
+
+	info("Coarsened %d blocks far from objects, %.0f of %.0f mesh "
+			"points left (%.1f%%)", coarse, sp_var_points(sp), 
+			before, 100.0 * sp_var_points(sp) / before);
+
+	n_free(box);
+	n_free(scale);
+}
@@ -6,15 +6,35 @@
 #include "struct.h"
 #include "block.h"
 
+/** @brief How the mesh is divided into blocks (see sp_alloc_blocks()). */
+enum sp_blocks {
+	/** @brief Squares of ALLOC_BLOCK_SIZE points, one block per 
+	 * layer. */
+	sp_blocks_fixed,
+	/** @brief Size chosen from layer heights and cache size, tall
+	 * layers are split into several blocks. */
+	sp_blocks_auto
+};
+
+extern enum sp_blocks a_spblocks;
+extern int a_sprefine;
+
 n_float sp_n_get(struct space *sp, n_v3i pos);
+double sp_n_get_double(struct space *sp, n_v3i pos);
 n_float sp_a_get(struct space *sp, n_v3i pos);
 void sp_a_set(struct space *sp, n_v3i pos, n_float a);
+void sp_a_set_layer(struct space *sp, n_v2i pos, struct layer *lay, 
+								n_float a);
 void sp_n_set(struct space *sp, n_v3i pos, n_float n, int con);
 int sp_con_get(struct space *sp, n_v3i pos);
+struct block *sp_point_find(struct space *sp, n_v3i pos, size_t *off);
 
 int sp_pos_inside(struct space *sp, n_v3i pos);
+int sp_graded(struct space *sp, n_axis axis);
+double sp_dist(struct space *sp, n_v3i a, n_v3i b);
 
 struct space *sp_init(n_v3f step);
+struct space *sp_dup(struct space *sp);
 void sp_done(struct space *sp);
 
 int sp_load(struct space *sp, n_v2i pos, n_v2i size);
@@ -23,5 +43,6 @@ void sp_unload(struct space *sp);
 void sp_border(struct space *sp);
 
 void sp_optimize(struct space *sp);
+void sp_refine(struct space *sp);
 
 #endif
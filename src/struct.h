@@ -1,6 +1,8 @@
 #ifndef _STRUCT_H
 #define _STRUCT_H
 
+#include <stddef.h>
+
 #include "num.h"
 
 /** @file 
@@ -20,7 +22,8 @@
  *   file.
  *
  * All coordinates are in mesh units. They can be converted to physical units 
- * (meters) by multiplying with step value in struct \a space.
+ * (meters) by multiplying with step value in struct \a space, unless the 
+ * mesh is graded (see \a coord in struct \a space).
  *
  * About coordinate systems:
  *
@@ -105,16 +108,46 @@ struct material {
 	struct material *next;
 };
 
+/** @brief Weight of the mesh point at x-1 */
+#define BLK_K_X1	0
+/** @brief Weight of the mesh point at x+1 */
+#define BLK_K_X2	1
+/** @brief Weight of the mesh point at y-1 */
+#define BLK_K_Y1	2
+/** @brief Weight of the mesh point at y+1 */
+#define BLK_K_Y2	3
+/** @brief Weight of the mesh point at z-1 */
+#define BLK_K_Z1	4
+/** @brief Weight of the mesh point at z+1 */
+#define BLK_K_Z2	5
+/** @brief Inverse of the sum of all weights */
+#define BLK_K_D		6
+/** @brief Number of coefficients per mesh point */
+#define BLK_K_NUM	7
+
+/** @brief Work array with the low order part of mesh point values when
+ * the SOR solver uses mixed precision (see sor_refine() in sor.c). The value
+ * of a mesh point is the sum of \a n and this array. */
+#define BLK_VEC_LO	4
+/** @brief Number of work arrays in a mesh block */
+#define BLK_VEC_NUM	5
+
 /** @brief One block of mesh points, part of the finite difference grid.
  *
  * Mesh blocks are rectangular parts of the grid. They are stored in a 
  * three-dimensional linked list. 
  *
- * The current allocation functions are pretty simple. They divide the grid
- * horizontally into equal squares (ALLOC_BLOCK_SIZE x ALLOC_BLOCK_SIZE) and 
- * vertically into layers. However the SOR routines should also work correctly 
- * with more general mesh divisions as long as the touching sides of 
- * neighboring blocks are of the same dimensions.
+ * By default the grid is divided horizontally into equal squares 
+ * (ALLOC_BLOCK_SIZE x ALLOC_BLOCK_SIZE) and vertically into layers. With
+ * --blocks=auto the horizontal size is chosen for each mesh and tall layers
+ * are divided into several blocks (see sp_alloc_blocks()). A block never
+ * spans more than one layer. All routines work with any division as long as
+ * the touching sides of neighboring blocks are of the same dimensions.
+ *
+ * With --refine, blocks far from objects are made coarse after the mesh is
+ * optimized: they only keep every second, fourth or eighth point along x 
+ * and y (see \a scale). Ghost points between blocks of different scale 
+ * are interpolated.
  *
  * The meterial property (alpha) can be either permittivity, conductivity or
  * permeability, depending on the type of calculation. Within a mesh block
@@ -160,12 +193,53 @@ struct block {
 	/** @brief Pointer to a three-dimensional array of allocated mesh
 	 * points.
 	 *
+	 * The array includes a halo of ghost points one point thick around
+	 * the block. Ghost points hold copies of the values in neighboring
+	 * blocks, so that the finite difference stencil never has to look
+	 * outside of this array (see blk_halo_update()). Valid block 
+	 * coordinates of ghost points are -1 and size.x (size.y, size.z).
+	 *
 	 * NULL if not allocated (constant block). In that case all mesh
 	 * points have value in \a c_n.
 	 *
-	 * Size: size.x * size.y * size.z */
+	 * Size: (size.x + 2) * (size.y + 2) * (size.z + 2) */
 	n_float *n;
 
+	/** @brief Pointer to a three-dimensional array of mesh point values
+	 * packed into 16 bits (see blk_pack()). The value of a point is
+	 * \a h_base + h * \a h_step, except for the largest packed value,
+	 * which is exactly \a h_top. There is no halo.
+	 *
+	 * NULL if the block is not packed. \a n is NULL while the block is
+	 * packed.
+	 *
+	 * Size: size.x * size.y * size.z */
+	unsigned short *h;
+
+	/** @brief Value of a packed point equal to zero. */
+	n_float h_base;
+
+	/** @brief Difference between values of two consecutive packed
+	 * points. */
+	n_float h_step;
+
+	/** @brief Value of the largest packed value. */
+	n_float h_top;
+
+	/** @brief Values of constant points in the block. They are kept at
+	 * the ends of the range of packed values, so that they are exact. 
+	 * FLT_MAX (-FLT_MAX) if no constant point is at the lower (upper)
+	 * end. */
+	n_float h_clo, h_chi;
+
+	/** @brief Smallest and largest value that was packed since the last
+	 * call to blk_pack_rescale(). */
+	n_float h_min, h_max;
+
+	/** @brief Set if a value was clamped to the range of packed values
+	 * since the last call to blk_pack_rescale(). */
+	int h_clamp;
+
 	/** @brief Pointer to a two-dimensional array of the material 
 	 * property (permittivity, conductivity or permeability depending
 	 * on the type of calculation). Material is always homogeneous 
@@ -177,14 +251,91 @@ struct block {
 	 * Size: size.x * size.y */
 	n_float *a;
 
-	/** @brief Pointer to a three-dimensional array that tells whether
-	 * point at (x,y,z) is constant or variable.
+	/** @brief Pointers to tables of finite difference stencil
+	 * coefficients.
+	 *
+	 * Since material is homogeneous in the z direction, coefficients are
+	 * equal for all planes of mesh points with z > 0 (k[1]). Points in
+	 * the plane z = 0 also depend on the material of the block below
+	 * (k[0]). Each table holds BLK_K_NUM two-dimensional arrays, one for 
+	 * each coefficient (see BLK_K()).
+	 *
+	 * NULL if coefficients are equal for all points in the plane. In
+	 * that case they are taken from \a c_k.
+	 *
+	 * Size: BLK_K_NUM * size.x * size.y */
+	n_float *k[2];
+
+	/** @brief Pointer to a three-dimensional bit mask that tells 
+	 * whether point at (x,y,z) is constant (bit set) or variable. Bits
+	 * are in the same order as values in \a n, with the lowest bit of 
+	 * each byte first (see BLK_CON_OFF()). Ghost points are always 
+	 * constant.
 	 *
 	 * NULL if not allocated (constant block). In that case all points
 	 * in the block are constant.
 	 *
-	 * Size: size.x * size.y * size.z */
-	char *con;
+	 * Size: ((size.x + 2) * (size.y + 2) * (size.z + 2) + 7) / 8 */
+	unsigned char *con;
+
+	/** @brief Pointer to an array of runs of variable points in rows of
+	 * the block (see blk_span_build()). A run is a pair of x block
+	 * coordinates: the first variable point and the first point after
+	 * the run. Runs of a row are in increasing order. Rows without
+	 * variable points have no runs.
+	 *
+	 * NULL if not built. */
+	unsigned short *span;
+
+	/** @brief Pointer to an array with the index of the first run of
+	 * each row in \a span. Runs of the row (y, z) are from 
+	 * spanrow[z * size.y + y] up to (excluding) 
+	 * spanrow[z * size.y + y + 1].
+	 *
+	 * Size: size.y * size.z + 1 */
+	unsigned int *spanrow;
+
+	/** @brief Pointer to an array of array indexes of ghost points that
+	 * are interpolated from neighboring blocks with a different 
+	 * \a scale (see blk_link_update()). Faces of the halo towards such
+	 * blocks are not refreshed by blk_halo_update().
+	 *
+	 * NULL if there are none.
+	 *
+	 * Size: linknum */
+	size_t *link;
+
+	/** @brief Pointer to an array with the index of the first source of
+	 * each interpolated ghost point in \a linksrc and \a linkw. Sources
+	 * of link[i] are from linkrow[i] up to (excluding) linkrow[i + 1].
+	 *
+	 * Size: linknum + 1 */
+	unsigned int *linkrow;
+
+	/** @brief Pointer to an array of pointers to the mesh point values
+	 * that ghost points are interpolated from. Values of constant 
+	 * blocks are their \a c_n. */
+	n_float **linksrc;
+
+	/** @brief Pointer to an array of interpolation weights, same order
+	 * as \a linksrc. */
+	n_float *linkw;
+
+	/** @brief Number of interpolated ghost points. */
+	int linknum;
+
+	/** @brief Distance between neighboring mesh points of the block
+	 * along the x and y axis in mesh units. 1, except in coarse blocks 
+	 * far from objects (see sp_refine()). Block coordinates (x,y,z) 
+	 * are then at absolute position pos + (x * scale, y * scale, z) and
+	 * \a size is the number of mesh points of the coarse block. */
+	int scale;
+
+	/** @brief Pointers to work arrays used by the solvers (see 
+	 * blk_vec_alloc()). Same layout as \a n.
+	 *
+	 * NULL if not allocated. */
+	n_float *vec[BLK_VEC_NUM];
 
 	/** @brief Value of all mesh points in this block if this block is 
 	 * constant. Ignored otherwise */
@@ -194,6 +345,32 @@ struct block {
 	 * otherwise. */
 	n_float c_a;
 
+	/** @brief Stencil coefficients for planes with uniform
+	 * coefficients (see \a k). */
+	n_float c_k[2][BLK_K_NUM];
+
+	/** @brief Sum of squared changes of mesh point values in the last 
+	 * SOR sweep (see sor_sweep()). */
+	double delta;
+
+	/** @brief Sum of squared residuals in the last SOR sweep that 
+	 * updated the block, each divided by the sum of stencil weights of
+	 * its point. */
+	double resid;
+
+	/** @brief Largest absolute change of a mesh point value in the last
+	 * SOR sweep. */
+	n_float dmax;
+
+	/** @brief Sum of the largest changes of ghost point values since
+	 * the block fell asleep (see \a quiet). */
+	n_float drift;
+
+	/** @brief Number of consecutive SOR sweeps in which all changes 
+	 * were small. The block is sleeping (not updated) while this is
+	 * at least SOR_SLEEP_SWEEPS (see sor.c). */
+	int quiet;
+
 	/** @brief Absolute position of the lower left corner of the block. */
 	n_v3i pos;
 
@@ -280,6 +457,12 @@ struct layer {
 	 * the layer. */
 	n_int z;
 
+	/** @brief Physical distance between grid points in meters in Z 
+	 * direction inside this layer (from the bottom plane of the layer to
+	 * the bottom plane of the next one). 0 if the step of the space is 
+	 * used. */
+	n_float step;
+
 	/** @brief Default material for this layer. */
 	struct material *mat;
 
@@ -323,6 +506,47 @@ struct space {
 	/** @brief Three-dimensional linked list of mesh blocks. */
 	struct block *blk;
 
+	/** @brief Arena that mesh blocks and their arrays are allocated
+	 * from while the mesh is loaded (see blk_calloc()). NULL if no mesh
+	 * is loaded. */
+	struct arena *arena;
+
+	/** @brief Number of mesh blocks in X, Y and Z direction. Blocks are
+	 * stored in \a blk as a three-dimensional array of this size. */
+	n_v3i blknum;
+
+	/** @brief Tables that map coordinates to offsets of mesh blocks 
+	 * in \a blk (see sp_block_find()). A point with absolute coordinates
+	 * x, y, z is in the block blk[blkmapx[x - pos.x] + 
+	 * blkmapy[y - pos.y] + blkmapz[z - pos.z]], or outside of all 
+	 * blocks if any of the three entries is -1.
+	 *
+	 * Size: blkmaplen.x (blkmaplen.y, blkmaplen.z) */
+	int *blkmapx, *blkmapy, *blkmapz;
+
+	/** @brief Length of the tables in \a blkmapx, \a blkmapy and
+	 * \a blkmapz. Blocks end at pos + blkmaplen. */
+	n_v3i blkmaplen;
+
+	/** @brief Array of pointers to all variable mesh blocks (blocks with
+	 * allocated mesh points). Set by sp_optimize(). */
+	struct block **var;
+	/** @brief Number of pointers in the variable block array. */
+	int varnum;
+
+	/** @brief Number of variable blocks with interpolated ghost points
+	 * (see \a link in struct block). */
+	int linked;
+
+	/** @brief Thread pool used when iterating this mesh. NULL if the
+	 * mesh is iterated in a single thread. */
+	struct pool *pool;
+
+	/** @brief Net whose objects are set to 1 V when objects are added
+	 * to this mesh (see sp_add_obj()). Other objects keep their own 
+	 * values. NULL if none. */
+	struct net *net;
+
 	/** @brief Array of pointers to all layers used in this grid */
 	struct layer **lay;
 	/** @brief Number of pointers in the layer array. */
@@ -336,9 +560,32 @@ struct space {
 	n_v3i size;
 
 	/** @brief Physical distance between grid points in meters in X, Y
-	 * and Z direction in meters */
+	 * and Z direction in meters. In a graded mesh this is the distance 
+	 * inside the bounding box of all objects (X and Y) and in layers 
+	 * without their own step (Z). */
 	n_v3f step;
 
+	/** @brief Factor by which the distance between grid points along X
+	 * and Y grows with each point outside of the bounding box of all 
+	 * objects. 1 for a uniform mesh. */
+	n_float grading;
+	/** @brief Largest distance between grid points along X and Y, as a
+	 * multiple of \a step. */
+	n_float gradmax;
+	/** @brief Number of points around the bounding box of all objects 
+	 * that still have distance \a step. Fields are strongest at the 
+	 * edges of conductors, so the grading should not start there. */
+	n_int gradmargin;
+
+	/** @brief Physical positions of mesh points in meters along X, Y and
+	 * Z (see sp_dist()). Entry i is the position of the point with 
+	 * absolute coordinate pos + i - 1, so that the arrays also cover 
+	 * ghost points next to the allocated part of the mesh. NULL for axes
+	 * with uniform step.
+	 *
+	 * Size: blkmaplen.x + 2 (blkmaplen.y + 2, blkmaplen.z + 2) */
+	double *coord[3];
+
 	/** @brief Name of this mesh. */
 	char *name;
 